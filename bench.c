@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "bench.h"
+
+void writeBenchJSON(struct statsOutput *output, struct benchResults *results, struct benchSummary *summaries);
+void writeBenchCSV(struct statsOutput *output, struct benchResults *results, struct benchSummary *summaries);
+void printBenchSummary(struct statsOutput *output, struct benchResults *results, struct benchSummary *summaries);
+
+// Names used for the measurements in JSON and CSV output
+static char* benchMetricNames[BENCH_METRIC_COUNT] = {"wall_us", "user_us", "sys_us", "minor_faults", "major_faults"};
+
+// Names used for the measurements in the human-readable summary
+static char* benchMetricLabels[BENCH_METRIC_COUNT] = {"Wall-Clock time", "User CPU time", "System CPU time", "Minor page faults", "Major page faults"};
+
+// Comparison function for sorting longs with qsort
+int compareLongs(const void* first, const void* second) {
+    long a = *(const long*) first;
+    long b = *(const long*) second;
+    return (a > b) - (a < b);
+}
+
+// Get the nearest-rank percentile of a sorted array
+long computePercentile(long* values, int count, int percentile) {
+    if (count == 0) {
+        return 0;
+    }
+
+    int rank = (count * percentile + 99) / 100;
+    if (rank < 1) {
+        rank = 1;
+    }
+    return values[rank - 1];
+}
+
+// Compute the summary statistics for a set of samples
+// Outliers are samples outside of Tukey's fences, 1.5 interquartile ranges past the quartiles
+void summarizeSamples(long* samples, int count, struct benchSummary *summary) {
+    memset(summary, 0, sizeof(struct benchSummary));
+    if (count == 0) {
+        return;
+    }
+
+    long* sorted = malloc(count * sizeof(long));
+    memcpy(sorted, samples, count * sizeof(long));
+    qsort(sorted, count, sizeof(long), compareLongs);
+
+    double total = 0;
+    for (int i = 0; i < count; i++) {
+        total += sorted[i];
+    }
+    summary->mean = total / count;
+
+    double squares = 0;
+    for (int i = 0; i < count; i++) {
+        squares += (sorted[i] - summary->mean) * (sorted[i] - summary->mean);
+    }
+    summary->stddev = (count > 1) ? sqrt(squares / (count - 1)) : 0;
+
+    summary->min = sorted[0];
+    summary->median = computePercentile(sorted, count, 50);
+    summary->p95 = computePercentile(sorted, count, 95);
+    summary->max = sorted[count - 1];
+
+    long firstQuartile = computePercentile(sorted, count, 25);
+    long thirdQuartile = computePercentile(sorted, count, 75);
+    double fence = 1.5 * (thirdQuartile - firstQuartile);
+    for (int i = 0; i < count; i++) {
+        if (sorted[i] < firstQuartile - fence) {
+            summary->lowOutliers++;
+        } else if (sorted[i] > thirdQuartile + fence) {
+            summary->highOutliers++;
+        }
+    }
+
+    free(sorted);
+}
+
+// Summarize every measurement and write the results in the configured format
+void writeBenchResults(struct statsOutput *output, struct benchResults *results) {
+    struct benchSummary summaries[BENCH_METRIC_COUNT];
+    for (int i = 0; i < BENCH_METRIC_COUNT; i++) {
+        summarizeSamples(results->samples[i], results->runs, &summaries[i]);
+    }
+
+    if (output->format == STATS_JSON) {
+        writeBenchJSON(output, results, summaries);
+    } else if (output->format == STATS_CSV) {
+        writeBenchCSV(output, results, summaries);
+    } else {
+        printBenchSummary(output, results, summaries);
+    }
+}
+
+// Write the results as a single JSON object, so two runs can be compared by a script
+void writeBenchJSON(struct statsOutput *output, struct benchResults *results, struct benchSummary *summaries) {
+    FILE* file = output->file;
+
+    fprintf(file, "{\"argv\":[");
+    for (int i = 0; results->arguments[i] != NULL; i++) {
+        if (i > 0) {
+            putc(',', file);
+        }
+        writeJSONString(file, results->arguments[i]);
+    }
+    fprintf(file, "]");
+    if (results->label != NULL) {
+        fprintf(file, ",\"path\":\"%s\"", results->label);
+    }
+    fprintf(file, ",\"runs\":%i,\"warmup\":%i,\"failures\":%i", results->runs, results->warmup, results->failures);
+
+    for (int i = 0; i < BENCH_METRIC_COUNT; i++) {
+        struct benchSummary *summary = &summaries[i];
+        fprintf(file, ",\"%s\":{\"mean\":%.3f,\"stddev\":%.3f,\"min\":%li,\"median\":%li,\"p95\":%li,\"max\":%li,\"low_outliers\":%i,\"high_outliers\":%i}",
+                benchMetricNames[i], summary->mean, summary->stddev, summary->min, summary->median, summary->p95, summary->max, summary->lowOutliers, summary->highOutliers);
+    }
+    fprintf(file, "}\n");
+}
+
+// Write one CSV row per measurement
+void writeBenchCSV(struct statsOutput *output, struct benchResults *results, struct benchSummary *summaries) {
+    FILE* file = output->file;
+
+    // Labelled results get a path column, and the header is only written once so both sets can go in one file
+    if (!output->wroteHeader) {
+        fprintf(file, "%smetric,runs,mean,stddev,min,median,p95,max,low_outliers,high_outliers\n", results->label != NULL ? "path," : "");
+        output->wroteHeader = 1;
+    }
+    for (int i = 0; i < BENCH_METRIC_COUNT; i++) {
+        struct benchSummary *summary = &summaries[i];
+        if (results->label != NULL) {
+            fprintf(file, "%s,", results->label);
+        }
+        fprintf(file, "%s,%i,%.3f,%.3f,%li,%li,%li,%li,%i,%i\n", benchMetricNames[i], results->runs,
+                summary->mean, summary->stddev, summary->min, summary->median, summary->p95, summary->max, summary->lowOutliers, summary->highOutliers);
+    }
+}
+
+// Print a table of the results, with times shown in milliseconds
+void printBenchSummary(struct statsOutput *output, struct benchResults *results, struct benchSummary *summaries) {
+    FILE* file = output->file;
+
+    if (results->label != NULL) {
+        fprintf(file, "Launch path: %s\n", results->label);
+    }
+    fprintf(file, "Benchmark: %i runs after %i warmup runs", results->runs, results->warmup);
+    if (results->failures > 0) {
+        fprintf(file, ", %i failed", results->failures);
+    }
+    fprintf(file, "\n");
+
+    fprintf(file, "%-20s %12s %12s %12s %12s %12s %12s\n", "", "mean", "stddev", "min", "median", "p95", "max");
+    for (int i = 0; i < BENCH_METRIC_COUNT; i++) {
+        struct benchSummary *summary = &summaries[i];
+        double scale = (i <= BENCH_SYSTEM) ? 1000.0 : 1.0;
+        fprintf(file, "%-20s %12.3f %12.3f %12.3f %12.3f %12.3f %12.3f\n", benchMetricLabels[i], summary->mean / scale, summary->stddev / scale,
+                summary->min / scale, summary->median / scale, summary->p95 / scale, summary->max / scale);
+    }
+    fprintf(file, "Times are in milliseconds.\n");
+
+    struct benchSummary *wall = &summaries[BENCH_WALL];
+    if (wall->lowOutliers + wall->highOutliers > 0) {
+        fprintf(file, "Warning: %i wall-clock outliers (%i low, %i high), the results may be disturbed by other activity.\n",
+                wall->lowOutliers + wall->highOutliers, wall->lowOutliers, wall->highOutliers);
+    }
+}
+
+// Say how the median wall-clock time of the second set of results compares with the first
+// Only the human-readable output gets this, the other formats already have both sets side by side
+void writeBenchComparison(struct statsOutput *output, struct benchResults *baseline, struct benchResults *candidate) {
+    struct benchSummary before, after;
+    if (output->format != STATS_HUMAN) {
+        return;
+    }
+
+    summarizeSamples(baseline->samples[BENCH_WALL], baseline->runs, &before);
+    summarizeSamples(candidate->samples[BENCH_WALL], candidate->runs, &after);
+    fprintf(output->file, "\nMedian wall-clock time: %.3f milliseconds with %s, %.3f milliseconds with %s", before.median / 1000.0, baseline->label, after.median / 1000.0, candidate->label);
+    if (before.median > 0) {
+        fprintf(output->file, " (%.1f%% %s)", fabs(100.0 * (before.median - after.median) / before.median), after.median <= before.median ? "faster" : "slower");
+    }
+    fprintf(output->file, "\n");
+}
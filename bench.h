@@ -0,0 +1,43 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "stats.h"
+
+// The measurements collected for every benchmark run
+#define BENCH_WALL 0
+#define BENCH_USER 1
+#define BENCH_SYSTEM 2
+#define BENCH_MINOR_FAULTS 3
+#define BENCH_MAJOR_FAULTS 4
+#define BENCH_METRIC_COUNT 5
+
+// Summary statistics for one measurement over all of the runs
+struct benchSummary {
+    double mean;
+    double stddev;
+    long min;
+    long median;
+    long p95;
+    long max;
+    int lowOutliers;
+    int highOutliers;
+};
+
+// Samples for every measurement, one per run
+struct benchResults {
+    char** arguments;
+    // What was measured when there is more than one set of results, or NULL
+    char* label;
+    int runs;
+    int warmup;
+    int failures;
+    long* samples[BENCH_METRIC_COUNT];
+};
+
+void summarizeSamples(long* samples, int count, struct benchSummary *summary);
+void writeBenchResults(struct statsOutput *output, struct benchResults *results);
+void writeBenchComparison(struct statsOutput *output, struct benchResults *baseline, struct benchResults *candidate);
+int compareLongs(const void* first, const void* second);
+long computePercentile(long* values, int count, int percentile);
+
+#endif
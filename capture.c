@@ -0,0 +1,225 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "capture.h"
+
+#define TRUE 1
+#define FALSE 0
+
+// The most moved past the limit by one splice
+#define CAPTURE_CHUNK 65536
+
+ssize_t forwardOutput(int fd, int outputFd);
+int openSpillFile();
+void copyCapturedFile(int fd, long long size, int outputFd);
+
+// Make the pipe a job writes its output into, and the memfd it is collected in
+// Returns NULL if either couldn't be made, and otherwise sets writeFd to the end the job gets
+struct capture* openCapture(int* writeFd) {
+    int fds[2];
+
+    // Only our end is non-blocking, the job should just wait when the pipe is full
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        return NULL;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+    int memoryFd = memfd_create("shell2-output", MFD_CLOEXEC);
+    if (memoryFd == -1) {
+        close(fds[0]);
+        close(fds[1]);
+        return NULL;
+    }
+
+    struct capture *capture = calloc(1, sizeof(struct capture));
+    capture->pipeFd = fds[0];
+    capture->memoryFd = memoryFd;
+    capture->spillFd = -1;
+    *writeFd = fds[1];
+    return capture;
+}
+
+// Move whatever is waiting in the pipe into the memfd with splice, so it never passes through our memory
+// Past the limit it goes to the spill file, or to /dev/null and is counted as dropped
+// Returns TRUE once every writer has closed the pipe and it is empty, or stdout has been closed on a passed through job
+int drainCapture(struct capture *capture, struct captureSettings *settings) {
+    static int nullFd = -1;
+
+    capture->blocked = FALSE;
+    while (capture->pipeFd != -1) {
+        ssize_t moved;
+        if (capture->passThrough) {
+            moved = forwardOutput(capture->pipeFd, STDOUT_FILENO);
+        } else if (capture->size < settings->limit) {
+            loff_t offset = capture->size;
+            moved = splice(capture->pipeFd, NULL, capture->memoryFd, &offset, settings->limit - capture->size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved > 0) {
+                capture->size += moved;
+            }
+        } else {
+            if (settings->mode == CAPTURE_SPILL && capture->spillFd == -1) {
+                capture->spillFd = openSpillFile();
+            }
+            if (capture->spillFd == -1 && nullFd == -1) {
+                nullFd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+            }
+            moved = splice(capture->pipeFd, NULL, capture->spillFd != -1 ? capture->spillFd : nullFd, NULL, CAPTURE_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved > 0 && capture->spillFd != -1) {
+                capture->spilled += moved;
+            } else if (moved > 0) {
+                capture->dropped += moved;
+            }
+        }
+
+        if (moved == -1 && errno == EINTR) {
+            continue;
+        }
+        if (moved == -1 && errno == EAGAIN) {
+            // Output still waiting in the pipe means it is stdout that is full, not the pipe that is empty
+            int pending = 0;
+            capture->blocked = capture->passThrough && ioctl(capture->pipeFd, FIONREAD, &pending) == 0 && pending > 0;
+            return FALSE;
+        }
+
+        // Closing our end also takes it out of any epoll set, and anything still writing gets EPIPE
+        // That includes stdout going away, like a pager quitting, so the job's output is dropped with it
+        if (moved <= 0) {
+            close(capture->pipeFd);
+            capture->pipeFd = -1;
+        }
+    }
+    return TRUE;
+}
+
+// Pass output straight through, with splice if the output can take it and otherwise with a copy
+// Returns the number of bytes moved, 0 at the end of the pipe, or -1 with errno set
+ssize_t forwardOutput(int fd, int outputFd) {
+    static char buffer[CAPTURE_CHUNK];
+
+    fflush(stdout);
+    ssize_t moved = splice(fd, NULL, outputFd, NULL, CAPTURE_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (moved != -1 || errno != EINVAL) {
+        return moved;
+    }
+
+    // Terminals can't be spliced to, and what has been read is out of the pipe, so it is written out even if that means waiting
+    moved = read(fd, buffer, sizeof(buffer));
+    for (ssize_t written = 0; moved > 0 && written < moved; ) {
+        ssize_t result = write(outputFd, buffer + written, moved - written);
+        if (result == -1 && errno == EAGAIN) {
+            struct pollfd output = {outputFd, POLLOUT, 0};
+            poll(&output, 1, -1);
+        } else if (result == -1 && errno != EINTR) {
+            return -1;
+        }
+        written += (result > 0) ? result : 0;
+    }
+    return moved;
+}
+
+// Open an unlinked file for output past the limit, in $TMPDIR or /tmp
+// Returns -1 if it can't be made, and the output is dropped instead
+int openSpillFile() {
+    char* directory = getenv("TMPDIR");
+    if (directory == NULL || directory[0] == '\0') {
+        directory = "/tmp";
+    }
+    return open(directory, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+}
+
+// Write out everything captured so far, with sendfile so it doesn't pass through our memory either,
+// followed by a note if any of it was dropped
+void writeCapture(struct capture *capture, FILE* output) {
+    fflush(output);
+    copyCapturedFile(capture->memoryFd, capture->size, fileno(output));
+    if (capture->spillFd != -1) {
+        copyCapturedFile(capture->spillFd, capture->spilled, fileno(output));
+    }
+    if (capture->dropped > 0) {
+        fprintf(output, "[%lli more bytes of output were dropped]\n", capture->dropped);
+    }
+}
+
+// Copy the first size bytes of a file to the output
+void copyCapturedFile(int fd, long long size, int outputFd) {
+    char buffer[CAPTURE_CHUNK];
+    off_t offset = 0;
+
+    while (offset < size) {
+        ssize_t written = sendfile(outputFd, fd, &offset, size - offset);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written > 0) {
+            continue;
+        }
+        if (written == 0 || (errno != EINVAL && errno != ENOSYS)) {
+            return;
+        }
+
+        // Older kernels can only sendfile to sockets
+        ssize_t length = pread(fd, buffer, sizeof(buffer), offset);
+        if (length <= 0 || write(outputFd, buffer, length) != length) {
+            return;
+        }
+        offset += length;
+    }
+}
+
+// Forget the output that has already been shown
+void resetCapture(struct capture *capture) {
+    if (ftruncate(capture->memoryFd, 0) == 0) {
+        capture->size = 0;
+    }
+    if (capture->spillFd != -1) {
+        close(capture->spillFd);
+        capture->spillFd = -1;
+    }
+    capture->spilled = 0;
+    capture->dropped = 0;
+}
+
+// Close the pipe and the buffers and free the capture
+void closeCapture(struct capture *capture) {
+    if (capture->pipeFd != -1) {
+        close(capture->pipeFd);
+    }
+    if (capture->spillFd != -1) {
+        close(capture->spillFd);
+    }
+    close(capture->memoryFd);
+    free(capture);
+}
+
+// Parse a size in bytes with an optional K, M or G suffix
+// Returns -1 if it doesn't make sense
+int parseCaptureSize(char* text, long long *size) {
+    char* end;
+    long long bytes = strtoll(text, &end, 10);
+
+    if (*end == 'K' || *end == 'k') {
+        bytes <<= 10;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        bytes <<= 20;
+        end++;
+    } else if (*end == 'G' || *end == 'g') {
+        bytes <<= 30;
+        end++;
+    }
+    if (end == text || *end != '\0' || bytes <= 0) {
+        return -1;
+    }
+    *size = bytes;
+    return 0;
+}
@@ -0,0 +1,41 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+
+// How much of a job's output is kept in memory by default
+#define CAPTURE_DEFAULT_LIMIT (1024 * 1024)
+
+// What happens to output past the limit
+#define CAPTURE_TRUNCATE 0
+#define CAPTURE_SPILL 1
+
+// A job's stdout and stderr, read from a pipe and kept in a memfd until the job is done
+// Output past the limit goes to an unlinked temporary file, or is dropped and counted
+struct capture {
+    int pipeFd;
+    int memoryFd;
+    long long size;
+    int spillFd;
+    long long spilled;
+    long long dropped;
+    // Set while the job is in the foreground, when its output goes straight to stdout
+    int passThrough;
+    // Set when stdout is full and the output waiting in the pipe can't be passed through yet
+    int blocked;
+};
+
+// How much to keep in memory, and what to do with the rest
+struct captureSettings {
+    long long limit;
+    int mode;
+};
+
+struct capture* openCapture(int* writeFd);
+int drainCapture(struct capture *capture, struct captureSettings *settings);
+void writeCapture(struct capture *capture, FILE* output);
+void resetCapture(struct capture *capture);
+void closeCapture(struct capture *capture);
+int parseCaptureSize(char* text, long long *size);
+
+#endif
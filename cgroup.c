@@ -0,0 +1,428 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+
+#include "cgroup.h"
+
+int findCgroupMount(char* mount, int size);
+int hasController(char* list, char* controller);
+int waitToRemoveCgroup(char* path, int waits);
+void retryCgroupRemovals(int waits);
+int writeCgroupFile(char* directory, char* file, char* value);
+long long readCgroupValue(char* directory, char* file, char* key);
+void readCgroupIO(char* directory, struct cgroupStats *stats);
+
+// The controllers handed down to the job cgroups, each enabled on its own so a missing one doesn't stop the rest
+static char* controllers[] = {"cpu", "memory", "pids", "io"};
+#define CONTROLLER_COUNT 4
+
+// How long to wait for the processes of a killed cgroup to go away, in 10 millisecond steps,
+// when a job finishes and when the shell exits
+#define CGROUP_KILL_WAITS 5
+#define CGROUP_EXIT_WAITS 100
+
+// The cgroup the shell started in, the directory every job's cgroup is created in, and the leaf the shell moves to
+// Controllers can only be handed down from a cgroup with no processes of its own, so the shell can't stay where it was
+static char ownCgroup[4096];
+static char cgroupParent[4096];
+static char shellCgroup[4096];
+static int movedShell = 0;
+static int enabledControllers[CONTROLLER_COUNT];
+
+// Job cgroups that were still busy after their processes were killed, removed again later
+static char** pendingCgroups = NULL;
+static int pendingCount = 0;
+
+// Find where the cgroup v2 hierarchy is mounted
+// Returns 0 on success, or -1 if there is no cgroup2 mount
+int findCgroupMount(char* mount, int size) {
+    FILE* mounts = fopen("/proc/self/mounts", "r");
+    char device[256], path[4096], type[64];
+    int found = -1;
+
+    if (mounts == NULL) {
+        return -1;
+    }
+    while (fscanf(mounts, "%255s %4095s %63s %*[^\n]", device, path, type) == 3) {
+        if (strcmp(type, "cgroup2") == 0) {
+            snprintf(mount, size, "%s", path);
+            found = 0;
+            break;
+        }
+    }
+    fclose(mounts);
+
+    return found;
+}
+
+// Create a cgroup for the shell's jobs below the cgroup the shell is running in, and move the shell into a leaf next to them
+// Returns 0 on success, or -1 with errno set if cgroups haven't been delegated to us
+int setupCgroupParent() {
+    char mount[4096], ownPath[4096] = "";
+    char line[4096], path[8192], enabled[4096] = "";
+
+    if (findCgroupMount(mount, sizeof(mount)) == -1) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    // The unified hierarchy is the "0::" line
+    FILE* file = fopen("/proc/self/cgroup", "r");
+    if (file == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(ownPath, sizeof(ownPath), "%s", line + 3);
+        }
+    }
+    fclose(file);
+
+    if (snprintf(ownCgroup, sizeof(ownCgroup), "%s%s", mount, strcmp(ownPath, "/") == 0 ? "" : ownPath) >= (int) sizeof(ownCgroup)
+            || snprintf(cgroupParent, sizeof(cgroupParent), "%s/shell2-%i", ownCgroup, getpid()) >= (int) sizeof(cgroupParent)
+            || snprintf(shellCgroup, sizeof(shellCgroup), "%s/shell", cgroupParent) >= (int) sizeof(shellCgroup)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if (mkdir(cgroupParent, 0755) == -1 && errno != EEXIST) {
+        return -1;
+    }
+
+    // Writing 0 moves the writer, and the jobs we fork from now on start out in the leaf too
+    if ((mkdir(shellCgroup, 0755) == 0 || errno == EEXIST) && writeCgroupFile(shellCgroup, "cgroup.procs", "0") == 0) {
+        movedShell = 1;
+    }
+
+    // Try to hand the controllers down to the job cgroups, missing ones just mean fewer limits and stats
+    // Only the ones we turn on ourselves are turned off again on the way out
+    snprintf(path, sizeof(path), "%s/cgroup.subtree_control", ownCgroup);
+    file = fopen(path, "r");
+    if (file != NULL) {
+        if (fgets(enabled, sizeof(enabled), file) == NULL) {
+            enabled[0] = '\0';
+        }
+        fclose(file);
+    }
+    for (int i = 0; i < CONTROLLER_COUNT; i++) {
+        char value[16];
+        snprintf(value, sizeof(value), "+%s", controllers[i]);
+        enabledControllers[i] = (!hasController(enabled, controllers[i]) && writeCgroupFile(ownCgroup, "cgroup.subtree_control", value) == 0);
+        writeCgroupFile(cgroupParent, "cgroup.subtree_control", value);
+    }
+
+    return 0;
+}
+
+// Check whether a cgroup.subtree_control line lists a controller
+int hasController(char* list, char* controller) {
+    size_t length = strlen(controller);
+    for (char* found = strstr(list, controller); found != NULL; found = strstr(found + 1, controller)) {
+        if ((found == list || found[-1] == ' ') && (found[length] == ' ' || found[length] == '\n' || found[length] == '\0')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Remove the shell's cgroups on the way out, which only works once every job cgroup is gone
+// The shell goes back to the cgroup it started in, which needs the controllers we turned on there turned off again
+void removeCgroupParent() {
+    retryCgroupRemovals(CGROUP_EXIT_WAITS);
+    for (int i = 0; i < CONTROLLER_COUNT; i++) {
+        char value[16];
+        snprintf(value, sizeof(value), "-%s", controllers[i]);
+        writeCgroupFile(cgroupParent, "cgroup.subtree_control", value);
+        if (enabledControllers[i]) {
+            writeCgroupFile(ownCgroup, "cgroup.subtree_control", value);
+        }
+    }
+    if (movedShell) {
+        writeCgroupFile(ownCgroup, "cgroup.procs", "0");
+    }
+    rmdir(shellCgroup);
+    rmdir(cgroupParent);
+}
+
+// Write a value into one of the files of a cgroup
+// Returns 0 on success, or -1 with errno set
+int writeCgroupFile(char* directory, char* file, char* value) {
+    char path[8192];
+    snprintf(path, sizeof(path), "%s/%s", directory, file);
+
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    int result = write(fd, value, strlen(value));
+    int error = errno;
+    close(fd);
+    errno = error;
+
+    return (result == -1) ? -1 : 0;
+}
+
+// Read a value from a cgroup file, either the whole file or the line starting with key
+// Returns -1 if the file or key doesn't exist
+long long readCgroupValue(char* directory, char* file, char* key) {
+    char path[8192], name[256];
+    long long value;
+    long long result = -1;
+
+    snprintf(path, sizeof(path), "%s/%s", directory, file);
+    FILE* input = fopen(path, "r");
+    if (input == NULL) {
+        return -1;
+    }
+
+    if (key == NULL) {
+        if (fscanf(input, "%lli", &value) == 1) {
+            result = value;
+        }
+    } else {
+        while (fscanf(input, "%255s %lli", name, &value) == 2) {
+            if (strcmp(name, key) == 0) {
+                result = value;
+                break;
+            }
+        }
+    }
+    fclose(input);
+
+    return result;
+}
+
+// Add up the bytes read and written on every device in io.stat
+void readCgroupIO(char* directory, struct cgroupStats *stats) {
+    char path[8192], field[256];
+    long long value;
+
+    stats->ioReadBytes = -1;
+    stats->ioWriteBytes = -1;
+
+    snprintf(path, sizeof(path), "%s/io.stat", directory);
+    FILE* input = fopen(path, "r");
+    if (input == NULL) {
+        return;
+    }
+
+    stats->ioReadBytes = 0;
+    stats->ioWriteBytes = 0;
+    while (fscanf(input, "%255s", field) == 1) {
+        if (sscanf(field, "rbytes=%lli", &value) == 1) {
+            stats->ioReadBytes += value;
+        } else if (sscanf(field, "wbytes=%lli", &value) == 1) {
+            stats->ioWriteBytes += value;
+        }
+    }
+    fclose(input);
+}
+
+// Create a leaf cgroup for a job and apply the limits to it
+// Returns the path of the new cgroup, or NULL if it couldn't be created
+char* createJobCgroup(char* name, struct cgroupLimits *limits) {
+    char path[8192], value[64];
+    snprintf(path, sizeof(path), "%s/%s", cgroupParent, name);
+
+    if (mkdir(path, 0755) == -1) {
+        return NULL;
+    }
+
+    // Limits whose controller isn't enabled can't be set, so warn about them
+    if (limits->cpuQuota > 0) {
+        snprintf(value, sizeof(value), "%li %li", limits->cpuQuota, limits->cpuPeriod);
+        if (writeCgroupFile(path, "cpu.max", value) == -1) {
+            printf("Unable to set the CPU limit: %s\n", strerror(errno));
+        }
+    }
+    if (limits->memoryMax > 0) {
+        snprintf(value, sizeof(value), "%lli", limits->memoryMax);
+        if (writeCgroupFile(path, "memory.max", value) == -1) {
+            printf("Unable to set the memory limit: %s\n", strerror(errno));
+        }
+    }
+    if (limits->pidsMax > 0) {
+        snprintf(value, sizeof(value), "%li", limits->pidsMax);
+        if (writeCgroupFile(path, "pids.max", value) == -1) {
+            printf("Unable to set the process limit: %s\n", strerror(errno));
+        }
+    }
+
+    return strdup(path);
+}
+
+// Move a process into a cgroup, before it calls exec so nothing escapes the accounting
+int addToCgroup(char* path, int pid) {
+    char value[32];
+    snprintf(value, sizeof(value), "%i", pid);
+    return writeCgroupFile(path, "cgroup.procs", value);
+}
+
+// Read the accounting for the whole process tree of a finished job
+void readCgroupStats(char* path, struct cgroupStats *stats) {
+    stats->usageUsec = readCgroupValue(path, "cpu.stat", "usage_usec");
+    stats->userUsec = readCgroupValue(path, "cpu.stat", "user_usec");
+    stats->systemUsec = readCgroupValue(path, "cpu.stat", "system_usec");
+    stats->memoryPeak = readCgroupValue(path, "memory.peak", NULL);
+    readCgroupIO(path, stats);
+}
+
+// Remove a job's cgroup once everything in it has exited
+// Anything the job left running behind gets killed so the cgroup can go away, and if it is still busy
+// after a short wait, like while the killed processes wait to be reaped, it is removed later
+void removeJobCgroup(char* path) {
+    retryCgroupRemovals(0);
+    if (rmdir(path) == 0 || errno != EBUSY) {
+        return;
+    }
+    if (writeCgroupFile(path, "cgroup.kill", "1") == -1 || waitToRemoveCgroup(path, CGROUP_KILL_WAITS) == 0) {
+        return;
+    }
+    pendingCgroups = realloc(pendingCgroups, (pendingCount + 1) * sizeof(char*));
+    pendingCgroups[pendingCount++] = strdup(path);
+}
+
+// Remove a cgroup, waiting up to waits times for cgroup.events to say something changed while it is busy
+// Returns 0 once it is gone, or -1 if it is still there
+int waitToRemoveCgroup(char* path, int waits) {
+    char events[8192];
+    snprintf(events, sizeof(events), "%s/cgroup.events", path);
+    int fd = open(events, O_RDONLY | O_CLOEXEC);
+
+    int result;
+    for (int i = 0; (result = rmdir(path)) == -1 && errno == EBUSY && i < waits; i++) {
+        struct pollfd changed = {fd, POLLPRI, 0};
+        poll(&changed, fd != -1, 10);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    return (result == 0 || errno == ENOENT) ? 0 : -1;
+}
+
+// Try again to remove the job cgroups that were still busy, waiting for each one up to waits times
+void retryCgroupRemovals(int waits) {
+    int kept = 0;
+    for (int i = 0; i < pendingCount; i++) {
+        if (waitToRemoveCgroup(pendingCgroups[i], waits) == 0) {
+            free(pendingCgroups[i]);
+        } else {
+            pendingCgroups[kept++] = pendingCgroups[i];
+        }
+    }
+    pendingCount = kept;
+}
+
+// Fall back to per-process resource limits when cgroups aren't available
+// Unlike a cgroup, these only apply to each process on its own
+int applyRlimits(int pid, struct cgroupLimits *limits) {
+    struct rlimit limit;
+    int result = 0;
+
+    if (limits->memoryMax > 0) {
+        limit.rlim_cur = limit.rlim_max = limits->memoryMax;
+        result |= prlimit(pid, RLIMIT_AS, &limit, NULL);
+    }
+    if (limits->pidsMax > 0) {
+        limit.rlim_cur = limit.rlim_max = limits->pidsMax;
+        result |= prlimit(pid, RLIMIT_NPROC, &limit, NULL);
+    }
+
+    return result;
+}
+
+// Set one of the limits from the limit builtin
+// cpu takes a number of cores, memory takes bytes with an optional K, M or G suffix, and pids takes a count
+// Returns 0 on success, or -1 if the name or value doesn't make sense
+int parseLimit(struct cgroupLimits *limits, char* name, char* value) {
+    char* end;
+
+    if (strcmp(name, "cpu") == 0) {
+        double cores = strtod(value, &end);
+        // Infinite, NaN and overflowing core counts can't be converted to a quota
+        if (*end != '\0' || !isfinite(cores) || cores < 0 || cores * 100000 >= (double) LONG_MAX) {
+            return -1;
+        }
+        limits->cpuPeriod = 100000;
+        limits->cpuQuota = (long) (cores * limits->cpuPeriod);
+    } else if (strcmp(name, "memory") == 0) {
+        long long bytes = strtoll(value, &end, 10);
+        int shift = 0;
+        if (*end == 'K' || *end == 'k') {
+            shift = 10;
+            end++;
+        } else if (*end == 'M' || *end == 'm') {
+            shift = 20;
+            end++;
+        } else if (*end == 'G' || *end == 'g') {
+            shift = 30;
+            end++;
+        }
+        // Shifting past LLONG_MAX would overflow
+        if (*end != '\0' || bytes < 0 || bytes > LLONG_MAX >> shift) {
+            return -1;
+        }
+        bytes <<= shift;
+        limits->memoryMax = bytes;
+    } else if (strcmp(name, "pids") == 0) {
+        long count = strtol(value, &end, 10);
+        if (*end != '\0' || count < 0) {
+            return -1;
+        }
+        limits->pidsMax = count;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Print the limits that new jobs will get
+void printLimits(struct cgroupLimits *limits, int mode) {
+    char* modes[] = {"off", "cgroup v2", "setrlimit"};
+    printf("Job limits: %s\n", modes[mode]);
+
+    if (limits->cpuQuota > 0) {
+        printf("cpu: %.2f cores\n", (double) limits->cpuQuota / limits->cpuPeriod);
+    } else {
+        printf("cpu: unlimited\n");
+    }
+    if (limits->memoryMax > 0) {
+        printf("memory: %lli bytes\n", limits->memoryMax);
+    } else {
+        printf("memory: unlimited\n");
+    }
+    if (limits->pidsMax > 0) {
+        printf("pids: %li\n", limits->pidsMax);
+    } else {
+        printf("pids: unlimited\n");
+    }
+}
+
+// Print the accounting for a job's whole process tree
+void printCgroupStats(FILE* file, struct cgroupStats *stats) {
+    if (stats->usageUsec >= 0) {
+        fprintf(file, "Cgroup CPU time: %.3f milliseconds (user %.3f, system %.3f)\n", stats->usageUsec / 1000.0, stats->userUsec / 1000.0, stats->systemUsec / 1000.0);
+    }
+    if (stats->memoryPeak >= 0) {
+        fprintf(file, "Cgroup peak memory: %lli kilobytes\n", stats->memoryPeak / 1024);
+    } else {
+        fprintf(file, "Cgroup peak memory: not available\n");
+    }
+    if (stats->ioReadBytes >= 0) {
+        fprintf(file, "Cgroup IO: %lli bytes read, %lli bytes written\n", stats->ioReadBytes, stats->ioWriteBytes);
+    } else {
+        fprintf(file, "Cgroup IO: not available\n");
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef CGROUP_H
+#define CGROUP_H
+
+#include <stdio.h>
+
+// How job resource limits are enforced
+#define CGROUP_OFF 0
+#define CGROUP_V2 1
+#define CGROUP_RLIMIT 2
+
+// Limits applied to each job, 0 means unlimited
+struct cgroupLimits {
+    long cpuQuota;
+    long cpuPeriod;
+    long long memoryMax;
+    long pidsMax;
+};
+
+// Accounting read back from a job's cgroup, -1 for anything that isn't available
+struct cgroupStats {
+    long long usageUsec;
+    long long userUsec;
+    long long systemUsec;
+    long long memoryPeak;
+    long long ioReadBytes;
+    long long ioWriteBytes;
+};
+
+int setupCgroupParent();
+void removeCgroupParent();
+char* createJobCgroup(char* name, struct cgroupLimits *limits);
+int addToCgroup(char* path, int pid);
+void readCgroupStats(char* path, struct cgroupStats *stats);
+void removeJobCgroup(char* path);
+int applyRlimits(int pid, struct cgroupLimits *limits);
+int parseLimit(struct cgroupLimits *limits, char* name, char* value);
+void printLimits(struct cgroupLimits *limits, int mode);
+void printCgroupStats(FILE* file, struct cgroupStats *stats);
+
+#endif
@@ -0,0 +1,425 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "graph.h"
+#include "stats.h"
+
+#define TRUE 1
+#define FALSE 0
+
+int parseTaskLine(struct graphTask *task, char* line, int lineNumber, char*** dependencyNames);
+char** splitWords(char* text);
+int compareTaskNames(const void* first, const void* second);
+int findTask(struct taskGraph *graph, int* byName, char* name);
+int orderTasks(struct taskGraph *graph, int* order);
+int goesFirst(struct taskGraph *graph, int first, int second);
+void pushReadyTask(struct taskGraph *graph, int index, struct timespec now);
+void skipDependents(struct taskGraph *graph, int index, int* skipped);
+
+// The graph being sorted by compareTaskNames, since qsort has no context argument
+static struct taskGraph *sortingGraph;
+
+// Read and check a graph file, working out the longest chain from every task
+// Returns -1 after printing what is wrong with it
+int loadGraph(struct taskGraph *graph, char* fileName) {
+    FILE* input = stdin;
+    if (strcmp(fileName, "-") != 0) {
+        input = fopen(fileName, "r");
+        if (input == NULL) {
+            printf("Unable to open %s!\nError Number: %i\nError Message: %s\n", fileName, errno, strerror(errno));
+            return -1;
+        }
+    }
+
+    memset(graph, 0, sizeof(struct taskGraph));
+    int capacity = 64, lineCount = 0, valid = TRUE;
+    graph->tasks = malloc(capacity * sizeof(struct graphTask));
+    graph->lines = malloc(capacity * sizeof(char*));
+    char*** dependencyNames = malloc(capacity * sizeof(char**));
+
+    // The lines are kept, since the names and arguments point into them
+    char* line = NULL;
+    size_t lineSize = 0;
+    while (getline(&line, &lineSize, input) != -1) {
+        lineCount++;
+        char* start = line + strspn(line, " \t\n");
+        if (*start == '\0' || *start == '#') {
+            continue;
+        }
+        if (graph->count == capacity) {
+            capacity *= 2;
+            graph->tasks = realloc(graph->tasks, capacity * sizeof(struct graphTask));
+            graph->lines = realloc(graph->lines, capacity * sizeof(char*));
+            dependencyNames = realloc(dependencyNames, capacity * sizeof(char**));
+        }
+        graph->lines[graph->count] = line;
+        if (!parseTaskLine(&graph->tasks[graph->count], start, lineCount, &dependencyNames[graph->count])) {
+            valid = FALSE;
+        }
+        graph->count++;
+        line = NULL;
+        lineSize = 0;
+    }
+    free(line);
+    if (input != stdin) {
+        fclose(input);
+    }
+
+    if (valid && graph->count == 0) {
+        printf("There are no tasks in %s!\n", fileName);
+        valid = FALSE;
+    }
+
+    // Look the names up in a sorted list of tasks, checking that each is only used once
+    int* byName = malloc(graph->count * sizeof(int));
+    for (int i = 0; valid && i < graph->count; i++) {
+        byName[i] = i;
+    }
+    if (valid) {
+        sortingGraph = graph;
+        qsort(byName, graph->count, sizeof(int), compareTaskNames);
+        for (int i = 1; i < graph->count; i++) {
+            if (strcmp(graph->tasks[byName[i - 1]].name, graph->tasks[byName[i]].name) == 0) {
+                printf("Task %s on line %i is already defined on line %i!\n", graph->tasks[byName[i]].name, graph->tasks[byName[i]].lineNumber, graph->tasks[byName[i - 1]].lineNumber);
+                valid = FALSE;
+            }
+        }
+    }
+
+    // Turn the dependency names into task numbers
+    for (int i = 0; i < graph->count; i++) {
+        struct graphTask *task = &graph->tasks[i];
+        for (int j = 0; valid && j < task->dependencyCount; j++) {
+            task->dependencies[j] = findTask(graph, byName, dependencyNames[i][j]);
+            if (task->dependencies[j] == -1) {
+                printf("Task %s on line %i depends on %s, which isn't defined!\n", task->name, task->lineNumber, dependencyNames[i][j]);
+                valid = FALSE;
+            }
+        }
+        free(dependencyNames[i]);
+    }
+    free(dependencyNames);
+    free(byName);
+
+    // Every task also needs to know which tasks are waiting on it
+    for (int i = 0; valid && i < graph->count; i++) {
+        struct graphTask *task = &graph->tasks[i];
+        for (int j = 0; j < task->dependencyCount; j++) {
+            graph->tasks[task->dependencies[j]].dependentCount++;
+        }
+    }
+    for (int i = 0; valid && i < graph->count; i++) {
+        graph->tasks[i].dependents = malloc(graph->tasks[i].dependentCount * sizeof(int));
+        graph->tasks[i].dependentCount = 0;
+    }
+    for (int i = 0; valid && i < graph->count; i++) {
+        struct graphTask *task = &graph->tasks[i];
+        for (int j = 0; j < task->dependencyCount; j++) {
+            struct graphTask *dependency = &graph->tasks[task->dependencies[j]];
+            dependency->dependents[dependency->dependentCount++] = i;
+        }
+    }
+
+    // The chain lengths are worked out from the end of the graph back, which also finds any cycles
+    int* order = malloc(graph->count * sizeof(int));
+    if (valid && !orderTasks(graph, order)) {
+        valid = FALSE;
+    }
+    for (int i = graph->count - 1; valid && i >= 0; i--) {
+        struct graphTask *task = &graph->tasks[order[i]];
+        task->chainLength = 1;
+        for (int j = 0; j < task->dependentCount; j++) {
+            int length = graph->tasks[task->dependents[j]].chainLength + 1;
+            if (length > task->chainLength) {
+                task->chainLength = length;
+            }
+        }
+    }
+    free(order);
+
+    graph->ready = malloc(graph->count * sizeof(int));
+    if (!valid) {
+        freeGraph(graph);
+        return -1;
+    }
+    return 0;
+}
+
+// Split a "name: dependencies ; command" line in place
+// Returns FALSE after printing what is wrong with it
+int parseTaskLine(struct graphTask *task, char* line, int lineNumber, char*** dependencyNames) {
+    memset(task, 0, sizeof(struct graphTask));
+    task->lineNumber = lineNumber;
+
+    char* colon = strchr(line, ':');
+    char* semicolon = strchr(line, ';');
+    if (colon == NULL || semicolon == NULL || semicolon < colon) {
+        printf("Line %i should look like \"name: dependencies ; command\"!\n", lineNumber);
+        *dependencyNames = calloc(1, sizeof(char*));
+        task->arguments = calloc(1, sizeof(char*));
+        task->dependencies = malloc(sizeof(int));
+        return FALSE;
+    }
+    *colon = '\0';
+    *semicolon = '\0';
+
+    char** names = splitWords(line);
+    *dependencyNames = splitWords(colon + 1);
+    task->arguments = splitWords(semicolon + 1);
+    task->name = names[0];
+    while ((*dependencyNames)[task->dependencyCount] != NULL) {
+        task->dependencyCount++;
+    }
+    task->dependencies = malloc((task->dependencyCount + 1) * sizeof(int));
+
+    int valid = TRUE;
+    if (names[0] == NULL || names[1] != NULL) {
+        printf("Line %i should start with one task name!\n", lineNumber);
+        valid = FALSE;
+    } else if (task->arguments[0] == NULL) {
+        printf("Task %s on line %i has no command!\n", task->name, lineNumber);
+        valid = FALSE;
+    }
+    free(names);
+    return valid;
+}
+
+// Split text on whitespace in place, returning a NULL terminated list of words
+char** splitWords(char* text) {
+    char** words = malloc((strlen(text) / 2 + 2) * sizeof(char*));
+    char* position;
+    int count = 0;
+
+    for (char* word = strtok_r(text, " \t\n", &position); word != NULL; word = strtok_r(NULL, " \t\n", &position)) {
+        words[count++] = word;
+    }
+    words[count] = NULL;
+    return words;
+}
+
+// Order task numbers by name
+int compareTaskNames(const void* first, const void* second) {
+    return strcmp(sortingGraph->tasks[*(const int*) first].name, sortingGraph->tasks[*(const int*) second].name);
+}
+
+// Binary search the tasks sorted by name
+// Returns the task number, or -1 if there is no task with that name
+int findTask(struct taskGraph *graph, int* byName, char* name) {
+    int low = 0, high = graph->count - 1;
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        int comparison = strcmp(name, graph->tasks[byName[middle]].name);
+        if (comparison == 0) {
+            return byName[middle];
+        }
+        if (comparison < 0) {
+            high = middle - 1;
+        } else {
+            low = middle + 1;
+        }
+    }
+    return -1;
+}
+
+// Put the tasks in an order where every task comes after its dependencies
+// Returns FALSE after printing the tasks caught in a cycle if there isn't one
+int orderTasks(struct taskGraph *graph, int* order) {
+    int* remaining = malloc(graph->count * sizeof(int));
+    int count = 0;
+
+    for (int i = 0; i < graph->count; i++) {
+        remaining[i] = graph->tasks[i].dependencyCount;
+        if (remaining[i] == 0) {
+            order[count++] = i;
+        }
+    }
+    for (int next = 0; next < count; next++) {
+        struct graphTask *task = &graph->tasks[order[next]];
+        for (int j = 0; j < task->dependentCount; j++) {
+            if (--remaining[task->dependents[j]] == 0) {
+                order[count++] = task->dependents[j];
+            }
+        }
+    }
+
+    if (count < graph->count) {
+        printf("These tasks depend on each other in a cycle:");
+        for (int i = 0; i < graph->count; i++) {
+            if (remaining[i] > 0) {
+                printf(" %s", graph->tasks[i].name);
+            }
+        }
+        printf("\n");
+    }
+    free(remaining);
+    return count == graph->count;
+}
+
+// Free the tasks and the lines they point into
+void freeGraph(struct taskGraph *graph) {
+    for (int i = 0; i < graph->count; i++) {
+        free(graph->tasks[i].arguments);
+        free(graph->tasks[i].dependencies);
+        free(graph->tasks[i].dependents);
+        free(graph->lines[i]);
+    }
+    free(graph->tasks);
+    free(graph->lines);
+    free(graph->ready);
+    memset(graph, 0, sizeof(struct taskGraph));
+}
+
+// The ready task with the longest chain after it goes first, since it holds up the most,
+// and otherwise the one that comes first in the file
+int goesFirst(struct taskGraph *graph, int first, int second) {
+    int firstLength = graph->tasks[first].chainLength, secondLength = graph->tasks[second].chainLength;
+    return firstLength > secondLength || (firstLength == secondLength && first < second);
+}
+
+// Add a task to the ready heap
+void pushReadyTask(struct taskGraph *graph, int index, struct timespec now) {
+    int* heap = graph->ready;
+    int position = graph->readyCount++;
+
+    graph->tasks[index].state = TASK_READY;
+    graph->tasks[index].readyTime = now;
+    heap[position] = index;
+    while (position > 0 && goesFirst(graph, heap[position], heap[(position - 1) / 2])) {
+        int swap = heap[position];
+        heap[position] = heap[(position - 1) / 2];
+        heap[(position - 1) / 2] = swap;
+        position = (position - 1) / 2;
+    }
+}
+
+// Make every task without dependencies ready
+void startGraph(struct taskGraph *graph, struct timespec now) {
+    for (int i = 0; i < graph->count; i++) {
+        graph->tasks[i].waitingOn = graph->tasks[i].dependencyCount;
+        if (graph->tasks[i].waitingOn == 0) {
+            pushReadyTask(graph, i, now);
+        }
+    }
+}
+
+// Take the ready task with the longest chain after it
+// Returns -1 if nothing is ready
+int takeReadyTask(struct taskGraph *graph) {
+    int* heap = graph->ready;
+    if (graph->readyCount == 0) {
+        return -1;
+    }
+    int index = heap[0];
+    heap[0] = heap[--graph->readyCount];
+
+    int position = 0;
+    while (1) {
+        int first = position;
+        int left = 2 * position + 1, right = 2 * position + 2;
+        if (left < graph->readyCount && goesFirst(graph, heap[left], heap[first])) {
+            first = left;
+        }
+        if (right < graph->readyCount && goesFirst(graph, heap[right], heap[first])) {
+            first = right;
+        }
+        if (first == position) {
+            break;
+        }
+        int swap = heap[position];
+        heap[position] = heap[first];
+        heap[first] = swap;
+        position = first;
+    }
+
+    graph->tasks[index].state = TASK_RUNNING;
+    return index;
+}
+
+// Mark every task that depends on a failed one, directly or not, as skipped
+void skipDependents(struct taskGraph *graph, int index, int* skipped) {
+    struct graphTask *task = &graph->tasks[index];
+    for (int i = 0; i < task->dependentCount; i++) {
+        struct graphTask *dependent = &graph->tasks[task->dependents[i]];
+        if (dependent->state == TASK_WAITING) {
+            dependent->state = TASK_SKIPPED;
+            (*skipped)++;
+            skipDependents(graph, task->dependents[i], skipped);
+        }
+    }
+}
+
+// Record that a task has finished, making the tasks that were only waiting on it ready,
+// or skipping everything after it if it failed
+// Returns the number of tasks that were skipped
+int finishTask(struct taskGraph *graph, int index, int succeeded, struct timespec now) {
+    struct graphTask *task = &graph->tasks[index];
+    int skipped = 0;
+
+    task->endTime = now;
+    if (!succeeded) {
+        task->state = TASK_FAILED;
+        skipDependents(graph, index, &skipped);
+        return skipped;
+    }
+
+    task->state = TASK_DONE;
+    for (int i = 0; i < task->dependentCount; i++) {
+        struct graphTask *dependent = &graph->tasks[task->dependents[i]];
+        if (--dependent->waitingOn == 0 && dependent->state == TASK_WAITING) {
+            pushReadyTask(graph, task->dependents[i], now);
+        }
+    }
+    return 0;
+}
+
+// Print the chain of tasks that set the total wall-clock time, found by starting at the task that
+// finished last and going back through whichever dependency let it start
+// The time a task spent ready but waiting for a free worker is shown too, since more workers would save it
+void printCriticalPath(struct taskGraph *graph, struct timespec graphStart, struct timespec graphEnd) {
+    int last = -1;
+    for (int i = 0; i < graph->count; i++) {
+        int finished = graph->tasks[i].state == TASK_DONE || graph->tasks[i].state == TASK_FAILED;
+        if (finished && (last == -1 || computeTimeDifference(graph->tasks[last].endTime, graph->tasks[i].endTime) > 0)) {
+            last = i;
+        }
+    }
+    if (last == -1) {
+        return;
+    }
+
+    // Walk back to the start, then print the chain in the order it ran
+    int* chain = malloc(graph->count * sizeof(int));
+    int length = 0;
+    for (int index = last; index != -1; ) {
+        struct graphTask *task = &graph->tasks[index];
+        chain[length++] = index;
+        index = -1;
+        for (int j = 0; j < task->dependencyCount; j++) {
+            int dependency = task->dependencies[j];
+            if (index == -1 || computeTimeDifference(graph->tasks[index].endTime, graph->tasks[dependency].endTime) > 0) {
+                index = dependency;
+            }
+        }
+    }
+
+    long long total = computeTimeDifference(graphStart, graphEnd);
+    long long running = 0;
+    for (int i = 0; i < length; i++) {
+        struct graphTask *task = &graph->tasks[chain[i]];
+        running += computeTimeDifference(task->startTime, task->endTime);
+    }
+
+    printf("Critical path: %i task%s, %.3f of %.3f milliseconds spent running\n", length, length == 1 ? "" : "s", running / 1000000.0, total / 1000000.0);
+    for (int i = length - 1; i >= 0; i--) {
+        struct graphTask *task = &graph->tasks[chain[i]];
+        printf("  %-20s started at %10.3f ms, ran %10.3f ms", task->name, computeTimeDifference(graphStart, task->startTime) / 1000000.0, computeTimeDifference(task->startTime, task->endTime) / 1000000.0);
+        long long waited = computeTimeDifference(task->readyTime, task->startTime);
+        if (waited >= 1000000) {
+            printf(", waited %.3f ms for a worker", waited / 1000000.0);
+        }
+        printf("%s\n", task->state == TASK_FAILED ? " (failed)" : "");
+    }
+    free(chain);
+}
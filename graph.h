@@ -0,0 +1,52 @@
+#ifndef GRAPH_H
+#define GRAPH_H
+
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <time.h>
+
+// Where a task is on its way through the graph
+#define TASK_WAITING 0
+#define TASK_READY 1
+#define TASK_RUNNING 2
+#define TASK_DONE 3
+#define TASK_FAILED 4
+#define TASK_SKIPPED 5
+
+// A named command from a graph file, "name: dependencies ; command"
+struct graphTask {
+    char* name;
+    char** arguments;
+    int lineNumber;
+    int* dependencies;
+    int dependencyCount;
+    int* dependents;
+    int dependentCount;
+    // Dependencies that haven't finished yet, the task is ready once this reaches 0
+    int waitingOn;
+    // The number of tasks in the longest chain from this one to the end of the graph
+    int chainLength;
+    int state;
+    int status;
+    struct timespec readyTime;
+    struct timespec startTime;
+    struct timespec endTime;
+};
+
+// Every task in the file, and a heap of the ready ones, longest chain first
+struct taskGraph {
+    struct graphTask *tasks;
+    int count;
+    char** lines;
+    int* ready;
+    int readyCount;
+};
+
+int loadGraph(struct taskGraph *graph, char* fileName);
+void freeGraph(struct taskGraph *graph);
+void startGraph(struct taskGraph *graph, struct timespec now);
+int takeReadyTask(struct taskGraph *graph);
+int finishTask(struct taskGraph *graph, int index, int succeeded, struct timespec now);
+void printCriticalPath(struct taskGraph *graph, struct timespec graphStart, struct timespec graphEnd);
+
+#endif
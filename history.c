@@ -0,0 +1,317 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "history.h"
+
+#define TRUE 1
+#define FALSE 0
+
+int publishedAfter(struct history *history, uint64_t sequence, uint64_t next);
+int wallBucket(long long wallTime);
+long long bucketValue(int bucket);
+long long computeBucketPercentile(struct historyEntry *entry, double percentile);
+struct historyEntry* findHistoryEntry(struct history *history, char* command);
+void removeHistorySlot(struct history *history, int slot);
+void indexHistoryRecord(struct history *history, int slot, struct historyRecord *record);
+int compareEntryCounts(const void* first, const void* second);
+
+// Map the history file, creating it if needed, and index the records already in it
+// Returns -1 if the file can't be used
+int openHistory(struct history *history, char* fileName) {
+    size_t size = sizeof(struct historyHeader) + HISTORY_RECORDS * sizeof(struct historyRecord);
+    struct stat info;
+
+    memset(history, 0, sizeof(struct history));
+
+    int fd = open(fileName, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        return -1;
+    }
+
+    // Another shell could be creating the same file, so only one of us sets it up
+    flock(fd, LOCK_EX);
+    if (fstat(fd, &info) == -1 || (info.st_size < (off_t) size && ftruncate(fd, size) == -1)) {
+        close(fd);
+        return -1;
+    }
+
+    char* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    history->header = (struct historyHeader*) map;
+    history->records = (struct historyRecord*) (map + sizeof(struct historyHeader));
+    history->mappedSize = size;
+
+    if (history->header->magic == 0) {
+        history->header->capacity = HISTORY_RECORDS;
+        history->header->recordSize = sizeof(struct historyRecord);
+        history->header->nextSequence = 0;
+        history->header->magic = HISTORY_MAGIC;
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+
+    // Refuse files written in some other layout rather than misreading them
+    if (history->header->magic != HISTORY_MAGIC || history->header->capacity != HISTORY_RECORDS || history->header->recordSize != sizeof(struct historyRecord)) {
+        munmap(map, size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    history->slots = calloc(HISTORY_RECORDS, sizeof(struct historySlot));
+
+    // Only the records still in the ring can be indexed
+    uint64_t next = __atomic_load_n(&history->header->nextSequence, __ATOMIC_ACQUIRE);
+    history->indexedSequence = (next > HISTORY_RECORDS) ? next - HISTORY_RECORDS : 0;
+    updateHistoryIndex(history);
+
+    return 0;
+}
+
+// Unmap the file and free the index
+void closeHistory(struct history *history) {
+    for (int i = 0; i < HISTORY_INDEX_BUCKETS; i++) {
+        struct historyEntry *entry = history->buckets[i];
+        while (entry != NULL) {
+            struct historyEntry *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+    }
+    free(history->slots);
+    munmap(history->header, history->mappedSize);
+    memset(history, 0, sizeof(struct history));
+}
+
+// Claim the next slot of the ring and copy the record into it, without any system calls
+void appendHistory(struct history *history, struct historyRecord *record) {
+    uint64_t sequence = __atomic_fetch_add(&history->header->nextSequence, 1, __ATOMIC_ACQ_REL);
+    struct historyRecord *slot = &history->records[sequence % HISTORY_RECORDS];
+
+    // Readers skip the slot while its sequence doesn't match, and the fence keeps the copy from being seen before that
+    __atomic_store_n(&slot->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy((char*) slot + sizeof(uint64_t), (char*) record + sizeof(uint64_t), sizeof(struct historyRecord) - sizeof(uint64_t));
+    __atomic_store_n(&slot->sequence, sequence + 1, __ATOMIC_RELEASE);
+
+    updateHistoryIndex(history);
+}
+
+// Check whether any record after the given one has been published
+// Writers fill their slot right after taking a sequence, so a slot still unpublished once a newer one is done
+// most likely belongs to a shell that was killed while writing it
+int publishedAfter(struct history *history, uint64_t sequence, uint64_t next) {
+    for (uint64_t later = sequence + 1; later < next; later++) {
+        if (__atomic_load_n(&history->records[later % HISTORY_RECORDS].sequence, __ATOMIC_ACQUIRE) == later + 1) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Add the records written since the last update, by this shell or any other, to the index
+// A record that never got published is skipped once a newer one has been, so a killed writer can't hold up the rest
+void updateHistoryIndex(struct history *history) {
+    uint64_t next = __atomic_load_n(&history->header->nextSequence, __ATOMIC_ACQUIRE);
+
+    // Records that were overwritten before we saw them are lost
+    if (next - history->indexedSequence > HISTORY_RECORDS) {
+        history->indexedSequence = next - HISTORY_RECORDS;
+    }
+
+    while (history->indexedSequence < next) {
+        uint64_t sequence = history->indexedSequence;
+        struct historyRecord *slot = &history->records[sequence % HISTORY_RECORDS];
+        struct historyRecord record;
+
+        // Copy the record and make sure it didn't change while we copied it
+        uint64_t before = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        memcpy(&record, slot, sizeof(struct historyRecord));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        uint64_t after = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+
+        if ((before < sequence + 1 || after < sequence + 1) && !publishedAfter(history, sequence, next)) {
+            // Still being written, pick it up next time
+            break;
+        }
+        if (before == sequence + 1 && after == sequence + 1) {
+            record.command[HISTORY_COMMAND_SIZE - 1] = '\0';
+            indexHistoryRecord(history, sequence % HISTORY_RECORDS, &record);
+        } else {
+            // A newer record already took the slot, or the writer never finished it
+            removeHistorySlot(history, sequence % HISTORY_RECORDS);
+        }
+        history->indexedSequence++;
+    }
+}
+
+// Log scale bucket for a wall-clock time, with four buckets per power of two
+int wallBucket(long long wallTime) {
+    if (wallTime < 4) {
+        return (wallTime < 0) ? 0 : (int) wallTime;
+    }
+    int highBit = 63 - __builtin_clzll(wallTime);
+    return highBit * 4 + (int) ((wallTime >> (highBit - 2)) & 3);
+}
+
+// The time in the middle of a bucket
+long long bucketValue(int bucket) {
+    if (bucket < 4) {
+        return bucket;
+    }
+    int highBit = bucket / 4;
+    long long width = 1LL << (highBit - 2);
+    return (1LL << highBit) + (bucket % 4) * width + width / 2;
+}
+
+// Nearest rank percentile from the histogram, accurate to about a tenth
+long long computeBucketPercentile(struct historyEntry *entry, double percentile) {
+    long rank = (long) (percentile / 100.0 * entry->count + 0.999999);
+    long seen = 0;
+
+    for (int i = 0; i < HISTORY_WALL_BUCKETS; i++) {
+        seen += entry->wallBuckets[i];
+        if (seen >= rank) {
+            return bucketValue(i);
+        }
+    }
+    return 0;
+}
+
+// Find the index entry for a command, adding it if it is new
+struct historyEntry* findHistoryEntry(struct history *history, char* command) {
+    unsigned int bucket = 5381;
+    for (char* c = command; *c != '\0'; c++) {
+        bucket = (bucket * 33) ^ (unsigned char) *c;
+    }
+    bucket %= HISTORY_INDEX_BUCKETS;
+
+    struct historyEntry *entry = history->buckets[bucket];
+    while (entry != NULL && strcmp(entry->command, command) != 0) {
+        entry = entry->next;
+    }
+    if (entry == NULL) {
+        entry = calloc(1, sizeof(struct historyEntry));
+        strcpy(entry->command, command);
+        entry->next = history->buckets[bucket];
+        history->buckets[bucket] = entry;
+        history->entryCount++;
+    }
+
+    return entry;
+}
+
+// Take whatever the ring slot used to hold out of the totals
+void removeHistorySlot(struct history *history, int slot) {
+    struct historySlot *old = &history->slots[slot];
+    if (old->entry != NULL) {
+        old->entry->count--;
+        old->entry->wallTime -= old->wallTime;
+        old->entry->cpuTime -= old->cpuTime;
+        old->entry->wallBuckets[old->bucket]--;
+        old->entry = NULL;
+    }
+}
+
+// Add a record to its command's totals, replacing the record the slot used to hold
+void indexHistoryRecord(struct history *history, int slot, struct historyRecord *record) {
+    removeHistorySlot(history, slot);
+
+    struct historyEntry *entry = findHistoryEntry(history, record->command);
+    struct historySlot *current = &history->slots[slot];
+    current->entry = entry;
+    current->bucket = wallBucket(record->wallTime);
+    current->wallTime = record->wallTime;
+    current->cpuTime = (record->stats.ru_utime.tv_sec + record->stats.ru_stime.tv_sec) * 1000000LL + record->stats.ru_utime.tv_usec + record->stats.ru_stime.tv_usec;
+
+    entry->count++;
+    entry->wallTime += current->wallTime;
+    entry->cpuTime += current->cpuTime;
+    entry->wallBuckets[current->bucket]++;
+}
+
+// Sort the busiest commands first
+int compareEntryCounts(const void* first, const void* second) {
+    long a = (*(struct historyEntry**) first)->count;
+    long b = (*(struct historyEntry**) second)->count;
+    return (a < b) - (a > b);
+}
+
+// Print the count, mean and p95 wall-clock time, and mean CPU time of every command, or just the given one
+void printHistoryStats(struct history *history, char* command) {
+    updateHistoryIndex(history);
+
+    struct historyEntry **entries = malloc((history->entryCount + 1) * sizeof(struct historyEntry*));
+    int count = 0;
+    for (int i = 0; i < HISTORY_INDEX_BUCKETS; i++) {
+        for (struct historyEntry *entry = history->buckets[i]; entry != NULL; entry = entry->next) {
+            if (entry->count > 0 && (command == NULL || strcmp(entry->command, command) == 0)) {
+                entries[count++] = entry;
+            }
+        }
+    }
+
+    if (count == 0) {
+        printf(command == NULL ? "No jobs have been recorded yet.\n" : "No jobs named %s have been recorded.\n", command);
+        free(entries);
+        return;
+    }
+
+    qsort(entries, count, sizeof(struct historyEntry*), compareEntryCounts);
+    printf("%-32s %8s %14s %14s %14s\n", "Command", "Count", "Mean wall ms", "p95 wall ms", "Mean CPU ms");
+    for (int i = 0; i < count; i++) {
+        struct historyEntry *entry = entries[i];
+        printf("%-32.32s %8li %14.3f %14.3f %14.3f\n", entry->command, entry->count,
+               entry->wallTime / 1000000.0 / entry->count,
+               computeBucketPercentile(entry, 95.0) / 1000000.0,
+               entry->cpuTime / 1000.0 / entry->count);
+    }
+
+    free(entries);
+}
+
+// FNV-1a over the arguments, with a separator so "a b" and "ab" differ
+// Pass HISTORY_HASH_SEED to start, or a previous hash to chain the stages of a pipeline
+uint64_t hashArguments(char** arguments, uint64_t hash) {
+    for (int i = 0; arguments[i] != NULL; i++) {
+        for (char* c = arguments[i]; *c != '\0'; c++) {
+            hash = (hash ^ (unsigned char) *c) * 1099511628211ULL;
+        }
+        hash = hash * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Add one process's usage to a job's total, keeping the largest resident set size
+void addUsage(struct rusage *total, struct rusage *stats) {
+    timeradd(&total->ru_utime, &stats->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &stats->ru_stime, &total->ru_stime);
+    if (stats->ru_maxrss > total->ru_maxrss) {
+        total->ru_maxrss = stats->ru_maxrss;
+    }
+    total->ru_ixrss += stats->ru_ixrss;
+    total->ru_idrss += stats->ru_idrss;
+    total->ru_isrss += stats->ru_isrss;
+    total->ru_minflt += stats->ru_minflt;
+    total->ru_majflt += stats->ru_majflt;
+    total->ru_nswap += stats->ru_nswap;
+    total->ru_inblock += stats->ru_inblock;
+    total->ru_oublock += stats->ru_oublock;
+    total->ru_msgsnd += stats->ru_msgsnd;
+    total->ru_msgrcv += stats->ru_msgrcv;
+    total->ru_nsignals += stats->ru_nsignals;
+    total->ru_nvcsw += stats->ru_nvcsw;
+    total->ru_nivcsw += stats->ru_nivcsw;
+}
@@ -0,0 +1,74 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+#include <sys/resource.h>
+
+#define HISTORY_MAGIC 0x5348324849535431ULL
+#define HISTORY_RECORDS 16384
+#define HISTORY_COMMAND_SIZE 64
+#define HISTORY_INDEX_BUCKETS 256
+#define HISTORY_WALL_BUCKETS 256
+#define HISTORY_HASH_SEED 14695981039346656037ULL
+
+// One finished job, written into the next slot of the ring
+// The sequence is stored last, so a reader can tell when the record is complete
+struct historyRecord {
+    uint64_t sequence;
+    uint64_t argumentHash;
+    int64_t startTime;
+    int64_t wallTime;
+    int32_t pid;
+    int32_t status;
+    int32_t processCount;
+    int32_t reserved;
+    struct rusage stats;
+    char command[HISTORY_COMMAND_SIZE];
+};
+
+// The start of the history file, followed by HISTORY_RECORDS records
+struct historyHeader {
+    uint64_t magic;
+    uint64_t capacity;
+    uint64_t recordSize;
+    uint64_t nextSequence;
+};
+
+// Running totals for one command, with a log scale histogram of the wall-clock times for percentiles
+struct historyEntry {
+    char command[HISTORY_COMMAND_SIZE];
+    long count;
+    long long wallTime;
+    long long cpuTime;
+    int wallBuckets[HISTORY_WALL_BUCKETS];
+    struct historyEntry *next;
+};
+
+// What each ring slot contributed to the index, so it can be taken back out when the slot is reused
+struct historySlot {
+    struct historyEntry *entry;
+    int bucket;
+    long long wallTime;
+    long long cpuTime;
+};
+
+// The mapped history file and the per-command index built from it
+struct history {
+    struct historyHeader *header;
+    struct historyRecord *records;
+    size_t mappedSize;
+    uint64_t indexedSequence;
+    struct historySlot *slots;
+    struct historyEntry *buckets[HISTORY_INDEX_BUCKETS];
+    int entryCount;
+};
+
+int openHistory(struct history *history, char* fileName);
+void closeHistory(struct history *history);
+void appendHistory(struct history *history, struct historyRecord *record);
+void updateHistoryIndex(struct history *history);
+void printHistoryStats(struct history *history, char* command);
+uint64_t hashArguments(char** arguments, uint64_t hash);
+void addUsage(struct rusage *total, struct rusage *stats);
+
+#endif
@@ -0,0 +1,215 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "input.h"
+
+#define TRUE 1
+#define FALSE 0
+
+void moveToHeap(struct inputReader *reader);
+void growArguments(struct inputReader *reader);
+
+// Set up a reader for the fd, mapping it if it is a regular file and reading blocks otherwise
+// Returns -1 if the buffers can't be allocated
+int initInputReader(struct inputReader *reader, int fd) {
+    struct stat info;
+
+    memset(reader, 0, sizeof(struct inputReader));
+    reader->fd = fd;
+
+    reader->argumentCapacity = INITIAL_ARGUMENTS;
+    reader->arguments = malloc((reader->argumentCapacity + 1) * sizeof(char*));
+    if (reader->arguments == NULL) {
+        return -1;
+    }
+
+    // A script file is mapped privately, so tokenizing it in place never touches the file
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        off_t offset = lseek(fd, 0, SEEK_CUR);
+        char* map = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED && offset >= 0 && offset <= info.st_size) {
+            madvise(map, info.st_size, MADV_SEQUENTIAL);
+            reader->buffer = map;
+            reader->capacity = info.st_size;
+            reader->start = offset;
+            reader->end = info.st_size;
+            reader->mapped = TRUE;
+            reader->reachedEOF = TRUE;
+            return 0;
+        }
+        if (map != MAP_FAILED) {
+            munmap(map, info.st_size);
+        }
+    }
+
+    reader->capacity = INPUT_BLOCK_SIZE;
+    reader->buffer = malloc(reader->capacity);
+    if (reader->buffer == NULL) {
+        free(reader->arguments);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Set up a reader that returns the lines of a string, for commands given on the command line
+// Returns -1 if the buffers can't be allocated
+int initInputReaderString(struct inputReader *reader, char* string) {
+    memset(reader, 0, sizeof(struct inputReader));
+    reader->fd = -1;
+
+    reader->argumentCapacity = INITIAL_ARGUMENTS;
+    reader->arguments = malloc((reader->argumentCapacity + 1) * sizeof(char*));
+    reader->end = strlen(string);
+    reader->capacity = reader->end + 1;
+    reader->buffer = malloc(reader->capacity);
+    if (reader->arguments == NULL || reader->buffer == NULL) {
+        free(reader->arguments);
+        free(reader->buffer);
+        return -1;
+    }
+
+    memcpy(reader->buffer, string, reader->end);
+    reader->reachedEOF = TRUE;
+    return 0;
+}
+
+// Release the buffer and the argument array
+void closeInputReader(struct inputReader *reader) {
+    if (reader->mapped) {
+        munmap(reader->buffer, reader->capacity);
+    } else {
+        free(reader->buffer);
+    }
+    free(reader->arguments);
+    reader->buffer = NULL;
+    reader->arguments = NULL;
+}
+
+// Copy what is left of a mapped file into a heap buffer with room for a terminator
+void moveToHeap(struct inputReader *reader) {
+    size_t length = reader->end - reader->start;
+    size_t capacity = (length + 1 > INPUT_BLOCK_SIZE) ? length + 1 : INPUT_BLOCK_SIZE;
+    char* buffer = malloc(capacity);
+
+    if (buffer == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    memcpy(buffer, reader->buffer + reader->start, length);
+    munmap(reader->buffer, reader->capacity);
+
+    reader->buffer = buffer;
+    reader->capacity = capacity;
+    reader->start = 0;
+    reader->end = length;
+    reader->mapped = FALSE;
+}
+
+// Return the next line without its new line character, or NULL at the end of the input
+// The line lives in the reader's buffer and is only valid until the next call
+char* readLine(struct inputReader *reader) {
+    size_t scanned = reader->start;
+
+    while (TRUE) {
+        char* newline = memchr(reader->buffer + scanned, '\n', reader->end - scanned);
+        if (newline != NULL) {
+            char* line = reader->buffer + reader->start;
+            *newline = '\0';
+            reader->start = newline - reader->buffer + 1;
+            return line;
+        }
+
+        if (reader->reachedEOF) {
+            if (reader->start == reader->end) {
+                return NULL;
+            }
+
+            // The last line has no new line, so it needs room for a terminator
+            if (reader->mapped || reader->end == reader->capacity) {
+                moveToHeap(reader);
+            }
+            char* line = reader->buffer + reader->start;
+            reader->buffer[reader->end] = '\0';
+            reader->start = reader->end;
+            return line;
+        }
+
+        // Move the partial line to the front, and grow the buffer if the line fills it
+        if (reader->start > 0) {
+            memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+        }
+        scanned = reader->end;
+        if (reader->end == reader->capacity) {
+            char* buffer = realloc(reader->buffer, reader->capacity * 2);
+            if (buffer == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            reader->buffer = buffer;
+            reader->capacity *= 2;
+        }
+
+        if (reader->wait != NULL) {
+            reader->wait(reader->fd, reader->waitContext);
+        }
+
+        ssize_t bytesRead = read(reader->fd, reader->buffer + reader->end, reader->capacity - reader->end);
+        if (bytesRead > 0) {
+            reader->end += bytesRead;
+        } else if (bytesRead == 0 || errno != EINTR) {
+            reader->reachedEOF = TRUE;
+        }
+    }
+}
+
+// Double the argument array, keeping room for the NULL at the end
+void growArguments(struct inputReader *reader) {
+    char** arguments = realloc(reader->arguments, (reader->argumentCapacity * 2 + 1) * sizeof(char*));
+    if (arguments == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    reader->arguments = arguments;
+    reader->argumentCapacity *= 2;
+}
+
+// Split the line on spaces and tabs in place, like strtok but with no limit on the number of arguments
+// Returns the NULL terminated argument array, which is reused for the next line
+char** splitArguments(struct inputReader *reader, char* line, int* count) {
+    int argumentCount = 0;
+
+    while (TRUE) {
+        while (*line == ' ' || *line == '\t' || *line == '\r') {
+            line++;
+        }
+        if (*line == '\0') {
+            break;
+        }
+
+        if (argumentCount == reader->argumentCapacity) {
+            growArguments(reader);
+        }
+        reader->arguments[argumentCount++] = line;
+
+        while (*line != '\0' && *line != ' ' && *line != '\t' && *line != '\r') {
+            line++;
+        }
+        if (*line != '\0') {
+            *line++ = '\0';
+        }
+    }
+
+    reader->arguments[argumentCount] = NULL;
+    *count = argumentCount;
+    return reader->arguments;
+}
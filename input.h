@@ -0,0 +1,33 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stddef.h>
+
+#define INPUT_BLOCK_SIZE 65536
+#define INITIAL_ARGUMENTS 32
+
+// Buffered line reader shared by the shells
+// Lines are tokenized in place, so the buffer and argument array are reused for every line
+struct inputReader {
+    int fd;
+    char* buffer;
+    size_t capacity;
+    size_t start;
+    size_t end;
+    int mapped;
+    int reachedEOF;
+    char** arguments;
+    int argumentCapacity;
+
+    // Called before read() so the caller can do other work until the fd is readable
+    void (*wait)(int fd, void* context);
+    void* waitContext;
+};
+
+int initInputReader(struct inputReader *reader, int fd);
+int initInputReaderString(struct inputReader *reader, char* string);
+void closeInputReader(struct inputReader *reader);
+char* readLine(struct inputReader *reader);
+char** splitArguments(struct inputReader *reader, char* line, int* count);
+
+#endif
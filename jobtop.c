@@ -0,0 +1,205 @@
+#include <sys/types.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+
+#include "livestats.h"
+#include "timeout.h"
+
+// What was seen of a record last time, for working out the CPU use since then
+struct previousSample {
+    int32_t pid;
+    int64_t cpuTime;
+    int64_t sampleTime;
+};
+
+void printUsage(char* programName);
+char* findShell();
+void printLiveJobs(struct liveStats *live, struct previousSample *previous);
+void formatDuration(long long nanoseconds, char* buffer, size_t size);
+
+int main(int argc, char* argv[]) {
+    static struct option longOptions[] = {
+        {"delay", required_argument, NULL, 'd'},
+        {"iterations", required_argument, NULL, 'n'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    long long delay = 1000000000LL;
+    int iterations = 0;
+    int option;
+
+    while ((option = getopt_long(argc, argv, "d:n:h", longOptions, NULL)) != -1) {
+        switch (option) {
+        case 'd':
+            if (parseDuration(optarg, &delay) == -1 || delay < 1000000) {
+                printf("Invalid delay: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        default:
+            printUsage(argv[0]);
+            exit(option == 'h' ? 0 : 1);
+        }
+    }
+
+    // Without a PID, look for the one shell publishing its jobs
+    char* name = (optind < argc) ? argv[optind] : findShell();
+    if (name == NULL) {
+        exit(1);
+    }
+
+    struct liveStats live;
+    if (attachLiveStats(&live, name) == -1) {
+        printf("Unable to open the live statistics for %s!\nError Number: %i\nError Message: %s\n", name, errno, strerror(errno));
+        exit(1);
+    }
+
+    struct previousSample *previous = calloc(live.header->capacity, sizeof(struct previousSample));
+    int clearScreen = isatty(STDOUT_FILENO) && iterations != 1;
+
+    // Reading never blocks the shell, so this can poll as often as it likes
+    for (int i = 0; iterations == 0 || i < iterations; i++) {
+        if (i > 0) {
+            struct timespec pause = {delay / 1000000000, delay % 1000000000};
+            nanosleep(&pause, NULL);
+        }
+        if (clearScreen) {
+            printf("\033[H\033[J");
+        }
+        if (kill(live.header->shellPid, 0) == -1 && errno == ESRCH) {
+            printf("Shell %lli has exited.\n", (long long) live.header->shellPid);
+            exit(1);
+        }
+        printLiveJobs(&live, previous);
+        fflush(stdout);
+    }
+
+    closeLiveStats(&live);
+    free(previous);
+    return 0;
+}
+
+// Print the options
+void printUsage(char* programName) {
+    printf("Usage: %s [-d delay] [-n iterations] [shell-pid]\n", programName);
+    printf("  -d, --delay duration    time between updates, like 500ms or 2s (default 1s)\n");
+    printf("  -n, --iterations count  stop after this many updates (default: run until interrupted)\n");
+    printf("Shows the running jobs of a shell2 started with --live.\n");
+}
+
+// Find the segment of the only running shell that publishes live statistics
+// Returns its name, or NULL after printing why there isn't exactly one
+char* findShell() {
+    static char name[300];
+    int found = 0;
+
+    DIR* directory = opendir("/dev/shm");
+    if (directory == NULL) {
+        perror("opendir");
+        return NULL;
+    }
+
+    // Segments left behind by shells that were killed don't count
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL) {
+        if (strncmp(entry->d_name, LIVE_NAME_PREFIX + 1, strlen(LIVE_NAME_PREFIX) - 1) != 0) {
+            continue;
+        }
+        int pid = atoi(entry->d_name + strlen(LIVE_NAME_PREFIX) - 1);
+        if (pid <= 0 || (kill(pid, 0) == -1 && errno == ESRCH)) {
+            continue;
+        }
+        if (found++ > 0) {
+            printf("More than one shell is publishing its jobs, give the PID of the one to show.\n");
+            closedir(directory);
+            return NULL;
+        }
+        snprintf(name, sizeof(name), "/%s", entry->d_name);
+    }
+    closedir(directory);
+
+    if (found == 0) {
+        printf("No shell is publishing its jobs, start shell2 with --live.\n");
+        return NULL;
+    }
+    return name;
+}
+
+// Print one line per running job, with the CPU use since the last update
+void printLiveJobs(struct liveStats *live, struct previousSample *previous) {
+    struct timespec realNow;
+    clock_gettime(CLOCK_REALTIME, &realNow);
+    long long now = realNow.tv_sec * 1000000000LL + realNow.tv_nsec;
+    long long sampleTime = __atomic_load_n(&live->header->sampleTime, __ATOMIC_ACQUIRE);
+    uint64_t highWater = __atomic_load_n(&live->header->highWater, __ATOMIC_ACQUIRE);
+    int running = 0, stopped = 0;
+    char elapsed[32], cpuTime[32];
+
+    printf("%-6s %-8s %-7s %5s %10s %10s %6s %10s  %s\n", "JOB", "PID", "STATE", "PROCS", "ELAPSED", "CPU", "CPU%", "RSS(KB)", "COMMAND");
+    for (uint64_t index = 0; index < highWater && index < live->header->capacity; index++) {
+        struct liveRecord record;
+        if (!readLiveRecord(live, index, &record)) {
+            previous[index].pid = 0;
+            continue;
+        }
+
+        // The CPU use since the last update if it is the same job, and otherwise its average
+        double usage = (record.elapsed > 0) ? 100.0 * record.cpuTime / record.elapsed : 0;
+        struct previousSample *last = &previous[index];
+        if (last->pid == record.pid && record.sampleTime > last->sampleTime) {
+            usage = 100.0 * (record.cpuTime - last->cpuTime) / (record.sampleTime - last->sampleTime);
+        }
+        if (last->pid != record.pid || record.sampleTime > last->sampleTime) {
+            last->pid = record.pid;
+            last->cpuTime = record.cpuTime;
+            last->sampleTime = record.sampleTime;
+        }
+
+        // Running jobs keep getting older between samples, stopped ones don't
+        long long age = (record.state == LIVE_RUNNING) ? now - record.sampleTime : 0;
+        formatDuration(record.elapsed + age, elapsed, sizeof(elapsed));
+        formatDuration(record.cpuTime, cpuTime, sizeof(cpuTime));
+
+        char job[16];
+        if (record.job == 0) {
+            snprintf(job, sizeof(job), "fg");
+        } else {
+            snprintf(job, sizeof(job), "[%i]", record.job);
+        }
+        printf("%-6s %-8i %-7s %5i %10s %10s %6.1f %10lli  %s\n", job, record.pid, record.state == LIVE_STOPPED ? "stopped" : "running", record.processCount, elapsed, cpuTime, usage, (long long) record.rss, record.command);
+
+        if (record.state == LIVE_STOPPED) {
+            stopped++;
+        } else {
+            running++;
+        }
+    }
+
+    printf("\nShell %lli: %i running, %i stopped", (long long) live->header->shellPid, running, stopped);
+    if (sampleTime > 0) {
+        printf(", sampled %.1f seconds ago", (now - sampleTime) / 1e9);
+    }
+    printf("\n");
+}
+
+// Format nanoseconds as seconds, or minutes and seconds, or hours and minutes
+void formatDuration(long long nanoseconds, char* buffer, size_t size) {
+    long long seconds = nanoseconds / 1000000000;
+    if (seconds < 60) {
+        snprintf(buffer, size, "%.2fs", nanoseconds / 1e9);
+    } else if (seconds < 3600) {
+        snprintf(buffer, size, "%lli:%02lli", seconds / 60, seconds % 60);
+    } else {
+        snprintf(buffer, size, "%lli:%02lli:%02lli", seconds / 3600, seconds / 60 % 60, seconds % 60);
+    }
+}
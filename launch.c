@@ -0,0 +1,264 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "launch.h"
+#include "placement.h"
+
+extern char **environ;
+
+int spawnCommand(char* commandName, char** arguments, struct launchOptions *options);
+int forkCommand(char* commandName, char** arguments, struct launchOptions *options);
+void getJobControlSignals(sigset_t *signals);
+void applyPlacement(struct placement *placement);
+
+// Fill in the default launch options
+void initLaunchOptions(struct launchOptions *options) {
+    options->method = launchMethodFromEnv();
+    options->path = NULL;
+    options->pathStale = 0;
+    options->inputFd = -1;
+    options->outputFd = -1;
+    options->errorFd = -1;
+    options->hold = 0;
+    options->holdFd = -1;
+    options->processGroup = -1;
+    options->defaultSignals = 0;
+    options->nice = 0;
+    options->placement = NULL;
+}
+
+// The signals an interactive shell ignores, which its children need back
+void getJobControlSignals(sigset_t *signals) {
+    sigemptyset(signals);
+    sigaddset(signals, SIGINT);
+    sigaddset(signals, SIGQUIT);
+    sigaddset(signals, SIGTSTP);
+    sigaddset(signals, SIGTTIN);
+    sigaddset(signals, SIGTTOU);
+}
+
+// Pick the launch method from LAUNCH_METHOD, defaulting to posix_spawn
+int launchMethodFromEnv() {
+    char* method = getenv("LAUNCH_METHOD");
+    if (method != NULL && strcmp(method, "fork") == 0) {
+        return LAUNCH_FORK;
+    }
+    return LAUNCH_SPAWN;
+}
+
+// Start the command with the requested method
+// Returns the PID of the child, or -1 if the command couldn't be started
+int launchCommand(char* commandName, char** arguments, struct launchOptions *options) {
+    // posix_spawn can't stop the child, change its niceness or place it before exec, so those commands always fork
+    if (options->method == LAUNCH_FORK || options->hold || options->nice != 0 || options->placement != NULL) {
+        return forkCommand(commandName, arguments, options);
+    }
+    return spawnCommand(commandName, arguments, options);
+}
+
+// Start the command with posix_spawnp, which avoids copying the parent's page tables
+int spawnCommand(char* commandName, char** arguments, struct launchOptions *options) {
+    posix_spawnattr_t attributes;
+    posix_spawn_file_actions_t fileActions;
+    sigset_t emptyMask, defaultSignals;
+    short flags = POSIX_SPAWN_SETSIGMASK;
+    pid_t pid;
+
+    // The command shouldn't inherit any signals the caller has blocked
+    sigemptyset(&emptyMask);
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setsigmask(&attributes, &emptyMask);
+
+    // The child joins its process group and resets its signals before exec, so there is no race
+    if (options->processGroup != -1) {
+        posix_spawnattr_setpgroup(&attributes, options->processGroup);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    if (options->defaultSignals) {
+        getJobControlSignals(&defaultSignals);
+        posix_spawnattr_setsigdefault(&attributes, &defaultSignals);
+        flags |= POSIX_SPAWN_SETSIGDEF;
+    }
+    posix_spawnattr_setflags(&attributes, flags);
+
+    // Hook up any redirected stdin, stdout and stderr
+    posix_spawn_file_actions_init(&fileActions);
+    if (options->inputFd != -1) {
+        posix_spawn_file_actions_adddup2(&fileActions, options->inputFd, STDIN_FILENO);
+    }
+    if (options->outputFd != -1) {
+        posix_spawn_file_actions_adddup2(&fileActions, options->outputFd, STDOUT_FILENO);
+    }
+    if (options->errorFd != -1) {
+        posix_spawn_file_actions_adddup2(&fileActions, options->errorFd, STDERR_FILENO);
+    }
+
+    // Run a known path directly so no failed execve calls are spent walking PATH
+    int result;
+    if (options->path != NULL) {
+        result = posix_spawn(&pid, options->path, &fileActions, &attributes, arguments, environ);
+        if (result == ENOENT || result == ENOTDIR || result == EACCES) {
+            // The path has gone away, so let the caller know and fall back to searching
+            options->pathStale = 1;
+            result = posix_spawnp(&pid, commandName, &fileActions, &attributes, arguments, environ);
+        }
+    } else {
+        result = posix_spawnp(&pid, commandName, &fileActions, &attributes, arguments, environ);
+    }
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&fileActions);
+
+    // posix_spawnp reports exec failures directly instead of through the child
+    if (result != 0) {
+        printLaunchError(result);
+        errno = result;
+        return -1;
+    }
+
+    return pid;
+}
+
+// Start the command with a plain fork and execvp
+int forkCommand(char* commandName, char** arguments, struct launchOptions *options) {
+    int holdFds[2] = {-1, -1};
+
+    // The child waits for the write end of this pipe to be closed before calling exec
+    if (options->hold && pipe2(holdFds, O_CLOEXEC) == -1) {
+        printLaunchError(errno);
+        return -1;
+    }
+
+    // Check the known path out here, since an execv failing in the child can't tell the caller it has gone away
+    char* path = options->path;
+    if (path != NULL && access(path, X_OK) == -1) {
+        options->pathStale = 1;
+        path = NULL;
+    }
+
+    // Flush first so the child doesn't repeat our buffered output
+    fflush(stdout);
+
+    int pid = fork();
+    if (pid == -1) {
+        printLaunchError(errno);
+        if (options->hold) {
+            close(holdFds[0]);
+            close(holdFds[1]);
+        }
+        return -1;
+    }
+
+    if (pid == 0) {
+        // We are in the child process
+        // The command shouldn't inherit any signals the caller has blocked
+        sigset_t emptyMask;
+        sigemptyset(&emptyMask);
+        sigprocmask(SIG_SETMASK, &emptyMask, NULL);
+
+        // Join the process group before the parent can hand it the terminal
+        if (options->processGroup != -1) {
+            setpgid(0, options->processGroup);
+        }
+        if (options->defaultSignals) {
+            sigset_t defaultSignals;
+            getJobControlSignals(&defaultSignals);
+            for (int signalNumber = 1; signalNumber < NSIG; signalNumber++) {
+                if (sigismember(&defaultSignals, signalNumber) == 1) {
+                    signal(signalNumber, SIG_DFL);
+                }
+            }
+        }
+
+        // Lowering our priority can't fail, and raising it is just skipped without the privilege
+        if (options->nice != 0) {
+            nice(options->nice);
+        }
+
+        // Both carry over exec, so the command never runs or allocates anywhere else
+        if (options->placement != NULL) {
+            applyPlacement(options->placement);
+        }
+
+        // Hook up any redirected stdin, stdout and stderr
+        if (options->inputFd != -1) {
+            dup2(options->inputFd, STDIN_FILENO);
+        }
+        if (options->outputFd != -1) {
+            dup2(options->outputFd, STDOUT_FILENO);
+        }
+        if (options->errorFd != -1) {
+            dup2(options->errorFd, STDERR_FILENO);
+        }
+
+        // Wait until the parent releases us
+        if (options->hold) {
+            char ignored;
+            close(holdFds[1]);
+            while (read(holdFds[0], &ignored, 1) == -1 && errno == EINTR) {
+            }
+        }
+
+        // Run the command, falling back to a PATH search if the known path has gone away
+        if (path != NULL) {
+            execv(path, arguments);
+        }
+        execvp(commandName, arguments);
+
+        // The command failed, so print out the error number and exit
+        printLaunchError(errno);
+        fflush(stdout);
+        _exit(1);
+    }
+
+    // Set the process group from this side too, so it is in place whichever of us runs first
+    if (options->processGroup != -1) {
+        setpgid(pid, options->processGroup == 0 ? pid : options->processGroup);
+    }
+
+    if (options->hold) {
+        close(holdFds[0]);
+        options->holdFd = holdFds[1];
+    }
+
+    return pid;
+}
+
+// Let a held command go ahead and call exec
+void releaseCommand(struct launchOptions *options) {
+    if (options->holdFd != -1) {
+        close(options->holdFd);
+        options->holdFd = -1;
+    }
+}
+
+// Print out the error that kept a command from running
+void printLaunchError(int error) {
+    printf("Invalid command!\nError Number: %i\nError Message: %s\n", error, strerror(error));
+}
+
+// Set the CPU affinity and NUMA memory policy of the calling process
+// Either can fail harmlessly, like on a kernel without NUMA support, and the command then runs unplaced
+void applyPlacement(struct placement *placement) {
+    if (CPU_COUNT(&placement->cpus) > 0) {
+        sched_setaffinity(0, sizeof(cpu_set_t), &placement->cpus);
+    }
+    if (placement->node >= 0 && placement->node < PLACEMENT_MAX_NODE_ID) {
+        unsigned long nodeMask[PLACEMENT_MAX_NODE_ID / (8 * sizeof(unsigned long))];
+        memset(nodeMask, 0, sizeof(nodeMask));
+        nodeMask[placement->node / (8 * sizeof(unsigned long))] |= 1UL << (placement->node % (8 * sizeof(unsigned long)));
+
+        // The kernel reads one bit fewer than maxnode says
+        syscall(SYS_set_mempolicy, placement->strict ? MPOL_BIND : MPOL_PREFERRED, nodeMask, sizeof(nodeMask) * 8 + 1);
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef LAUNCH_H
+#define LAUNCH_H
+
+// How a command gets started
+#define LAUNCH_SPAWN 0
+#define LAUNCH_FORK 1
+
+struct placement;
+
+// Options describing how to launch a command
+struct launchOptions {
+    int method;
+    // Absolute path to run instead of searching PATH, or NULL
+    char* path;
+    // Set when the path above no longer worked and PATH had to be searched
+    int pathStale;
+    // Descriptors to use as the command's stdin, stdout and stderr, or -1 to inherit them
+    int inputFd;
+    int outputFd;
+    int errorFd;
+    // Keep the child from calling exec until releaseCommand, so it can be set up from outside
+    int hold;
+    int holdFd;
+    // Process group to put the child in, 0 for a new group led by the child, or -1 to stay in ours
+    int processGroup;
+    // Put the job control signals back to their defaults, since an interactive shell ignores them
+    int defaultSignals;
+    // Niceness to add before exec, like nice(1), or 0 to leave it alone
+    int nice;
+    // CPUs and NUMA node to move to before exec, or NULL to run wherever the caller does
+    struct placement *placement;
+};
+
+void initLaunchOptions(struct launchOptions *options);
+int launchMethodFromEnv();
+int launchCommand(char* commandName, char** arguments, struct launchOptions *options);
+void releaseCommand(struct launchOptions *options);
+void printLaunchError(int error);
+
+#endif
@@ -0,0 +1,239 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "livestats.h"
+
+#define TRUE 1
+#define FALSE 0
+
+// How many times a reader retries a record the shell keeps rewriting before giving up on it
+#define LIVE_READ_RETRIES 1000
+
+// Create this shell's segment, named after its PID, fill in the header, and open the sampling timer
+// Returns -1 if shared memory isn't available
+int createLiveStats(struct liveStats *live, long long interval) {
+    size_t size = sizeof(struct liveHeader) + LIVE_RECORDS * sizeof(struct liveRecord);
+
+    memset(live, 0, sizeof(struct liveStats));
+    snprintf(live->name, sizeof(live->name), "%s%i", LIVE_NAME_PREFIX, getpid());
+
+    live->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (live->timerFd == -1) {
+        return -1;
+    }
+
+    // The records hold every job's command line, so only our own user may read them
+    int fd = shm_open(live->name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1 || ftruncate(fd, size) == -1) {
+        if (fd != -1) {
+            close(fd);
+            shm_unlink(live->name);
+        }
+        close(live->timerFd);
+        return -1;
+    }
+
+    // The segment starts out zeroed, so every record is already empty
+    char* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        shm_unlink(live->name);
+        close(live->timerFd);
+        return -1;
+    }
+
+    live->header = (struct liveHeader*) map;
+    live->records = (struct liveRecord*) (map + sizeof(struct liveHeader));
+    live->mappedSize = size;
+    live->owner = TRUE;
+
+    live->header->capacity = LIVE_RECORDS;
+    live->header->recordSize = sizeof(struct liveRecord);
+    live->header->shellPid = getpid();
+    live->header->interval = interval;
+    __atomic_store_n(&live->header->magic, LIVE_MAGIC, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+// Map another shell's segment read only, given its name or the PID of the shell
+// Returns -1 if it doesn't exist or isn't in the layout we expect
+int attachLiveStats(struct liveStats *live, char* name) {
+    struct stat info;
+
+    memset(live, 0, sizeof(struct liveStats));
+    if (name[0] == '/') {
+        snprintf(live->name, sizeof(live->name), "%s", name);
+    } else {
+        snprintf(live->name, sizeof(live->name), "%s%s", LIVE_NAME_PREFIX, name);
+    }
+
+    int fd = shm_open(live->name, O_RDONLY | O_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &info) == -1 || info.st_size < (off_t) sizeof(struct liveHeader)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    char* map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    live->header = (struct liveHeader*) map;
+    live->records = (struct liveRecord*) (map + sizeof(struct liveHeader));
+    live->mappedSize = info.st_size;
+    live->timerFd = -1;
+
+    // Refuse segments written in some other layout rather than misreading them
+    size_t size = sizeof(struct liveHeader) + live->header->capacity * sizeof(struct liveRecord);
+    if (__atomic_load_n(&live->header->magic, __ATOMIC_ACQUIRE) != LIVE_MAGIC || live->header->recordSize != sizeof(struct liveRecord) || size > live->mappedSize) {
+        munmap(map, info.st_size);
+        memset(live, 0, sizeof(struct liveStats));
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Unmap the segment, removing it if it is ours
+void closeLiveStats(struct liveStats *live) {
+    if (live->header == NULL) {
+        return;
+    }
+    munmap(live->header, live->mappedSize);
+    if (live->owner) {
+        shm_unlink(live->name);
+        close(live->timerFd);
+    }
+    memset(live, 0, sizeof(struct liveStats));
+}
+
+// Tick every interval while there are jobs to sample
+void startLiveTimer(struct liveStats *live) {
+    if (live->timerArmed) {
+        return;
+    }
+    struct itimerspec timer;
+    timer.it_interval.tv_sec = live->header->interval / 1000000000;
+    timer.it_interval.tv_nsec = live->header->interval % 1000000000;
+    timer.it_value = timer.it_interval;
+    timerfd_settime(live->timerFd, 0, &timer, NULL);
+    live->timerArmed = TRUE;
+}
+
+// Stop ticking once nothing is running, so an idle shell stays asleep
+void stopLiveTimer(struct liveStats *live) {
+    if (!live->timerArmed) {
+        return;
+    }
+    struct itimerspec timer;
+    memset(&timer, 0, sizeof(timer));
+    timerfd_settime(live->timerFd, 0, &timer, NULL);
+    live->timerArmed = FALSE;
+}
+
+// Copy a record into the given slot, with no locks and no system calls
+// There is only one writer, so making the sequence odd is enough to tell readers to retry
+void writeLiveRecord(struct liveStats *live, int index, struct liveRecord *record) {
+    if (index < 0 || index >= LIVE_RECORDS) {
+        return;
+    }
+    struct liveRecord *slot = &live->records[index];
+    uint64_t sequence = slot->sequence;
+
+    __atomic_store_n(&slot->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy((char*) slot + sizeof(uint64_t), (char*) record + sizeof(uint64_t), sizeof(struct liveRecord) - sizeof(uint64_t));
+    __atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+
+    if ((uint64_t) index >= live->header->highWater) {
+        __atomic_store_n(&live->header->highWater, index + 1, __ATOMIC_RELEASE);
+    }
+}
+
+// Mark a slot as empty once its job is gone
+void clearLiveRecord(struct liveStats *live, int index) {
+    struct liveRecord record;
+    memset(&record, 0, sizeof(record));
+    if (index >= 0 && index < LIVE_RECORDS && live->records[index].state != LIVE_EMPTY) {
+        writeLiveRecord(live, index, &record);
+    }
+}
+
+// Take a consistent copy of a record without ever blocking the shell
+// Returns TRUE if the slot holds a job
+int readLiveRecord(struct liveStats *live, int index, struct liveRecord *record) {
+    struct liveRecord *slot = &live->records[index];
+
+    for (int i = 0; i < LIVE_READ_RETRIES; i++) {
+        uint64_t before = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            // The shell is in the middle of writing it
+            if (i % 64 == 63) {
+                sched_yield();
+            }
+            continue;
+        }
+        memcpy(record, slot, sizeof(struct liveRecord));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        uint64_t after = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+
+        if (before == after) {
+            record->command[LIVE_COMMAND_SIZE - 1] = '\0';
+            return record->state != LIVE_EMPTY;
+        }
+    }
+    return FALSE;
+}
+
+// Read the CPU time in nanoseconds, including children it has waited for, and the resident size in kilobytes
+// of a running process from /proc/<pid>/stat
+// Returns -1 if the process is gone
+int sampleProcess(pid_t pid, long long *cpuTime, long long *rss) {
+    static long ticksPerSecond = 0;
+    static long pageSize = 0;
+    char fileName[64], buffer[1024];
+
+    if (ticksPerSecond == 0) {
+        ticksPerSecond = sysconf(_SC_CLK_TCK);
+        pageSize = sysconf(_SC_PAGESIZE);
+    }
+
+    snprintf(fileName, sizeof(fileName), "/proc/%i/stat", pid);
+    int fd = open(fileName, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (length <= 0) {
+        return -1;
+    }
+    buffer[length] = '\0';
+
+    // The command name can contain spaces and parentheses, so start after the last ')'
+    char* fields = strrchr(buffer, ')');
+    unsigned long long utime, stime, cutime, cstime, residentPages;
+    if (fields == NULL || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %llu %llu %*d %*d %*d %*d %*u %*u %llu", &utime, &stime, &cutime, &cstime, &residentPages) != 5) {
+        return -1;
+    }
+
+    *cpuTime = (long long) (utime + stime + cutime + cstime) * (1000000000LL / ticksPerSecond);
+    *rss = (long long) residentPages * (pageSize / 1024);
+    return 0;
+}
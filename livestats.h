@@ -0,0 +1,67 @@
+#ifndef LIVESTATS_H
+#define LIVESTATS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define LIVE_MAGIC 0x5348324C49564531ULL
+#define LIVE_RECORDS 8192
+#define LIVE_COMMAND_SIZE 64
+#define LIVE_NAME_PREFIX "/shell2-live."
+
+// What a live record describes
+#define LIVE_EMPTY 0
+#define LIVE_RUNNING 1
+#define LIVE_STOPPED 2
+
+// A snapshot of one running job, rewritten by the shell on every sample
+// The sequence is odd while the shell is writing, so a reader copies the record and retries if it changed
+struct liveRecord {
+    uint64_t sequence;
+    int32_t job;
+    int32_t pid;
+    int32_t state;
+    int32_t processCount;
+    int64_t startTime;
+    int64_t elapsed;
+    int64_t cpuTime;
+    int64_t rss;
+    int64_t sampleTime;
+    char command[LIVE_COMMAND_SIZE];
+};
+
+// The start of the shared memory segment, followed by LIVE_RECORDS records
+// Readers only need to look at the records below the high water mark
+struct liveHeader {
+    uint64_t magic;
+    uint64_t capacity;
+    uint64_t recordSize;
+    int64_t shellPid;
+    int64_t interval;
+    int64_t sampleTime;
+    uint64_t highWater;
+};
+
+// A mapped segment, either our own or another shell's
+// The owner also has the timer that says when to take the next sample
+struct liveStats {
+    struct liveHeader *header;
+    struct liveRecord *records;
+    size_t mappedSize;
+    char name[64];
+    int owner;
+    int timerFd;
+    int timerArmed;
+};
+
+int createLiveStats(struct liveStats *live, long long interval);
+int attachLiveStats(struct liveStats *live, char* name);
+void closeLiveStats(struct liveStats *live);
+void startLiveTimer(struct liveStats *live);
+void stopLiveTimer(struct liveStats *live);
+void writeLiveRecord(struct liveStats *live, int index, struct liveRecord *record);
+void clearLiveRecord(struct liveStats *live, int index);
+int readLiveRecord(struct liveStats *live, int index, struct liveRecord *record);
+int sampleProcess(pid_t pid, long long *cpuTime, long long *rss);
+
+#endif
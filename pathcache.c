@@ -0,0 +1,188 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "pathcache.h"
+
+unsigned int hashCommandName(char* name);
+char* resolveCommand(char* name, char* searchPath);
+void checkSearchPath(struct commandHash *hash);
+
+// Start with an empty cache
+void initCommandHash(struct commandHash *hash) {
+    memset(hash, 0, sizeof(struct commandHash));
+}
+
+// Simple string hash used to pick a bucket
+unsigned int hashCommandName(char* name) {
+    unsigned int value = 5381;
+    while (*name != '\0') {
+        value = (value * 33) ^ (unsigned char) *name++;
+    }
+    return value % COMMAND_HASH_BUCKETS;
+}
+
+// Walk the search path looking for an executable regular file with the given name
+char* resolveCommand(char* name, char* searchPath) {
+    struct stat info;
+    char* directory = searchPath;
+    int nameLength = strlen(name);
+
+    while (directory != NULL) {
+        char* end = strchr(directory, ':');
+        int length = (end == NULL) ? (int) strlen(directory) : (int) (end - directory);
+
+        // An empty entry means the current directory
+        char* candidate = malloc(length + nameLength + 3);
+        if (length == 0) {
+            sprintf(candidate, "./%s", name);
+        } else {
+            sprintf(candidate, "%.*s/%s", length, directory, name);
+        }
+
+        if (stat(candidate, &info) == 0 && S_ISREG(info.st_mode) && access(candidate, X_OK) == 0) {
+            return candidate;
+        }
+        free(candidate);
+
+        directory = (end == NULL) ? NULL : end + 1;
+    }
+
+    return NULL;
+}
+
+// Throw away every entry if PATH changed since they were resolved
+void checkSearchPath(struct commandHash *hash) {
+    char* searchPath = getenv("PATH");
+    if (searchPath == NULL) {
+        searchPath = "/bin:/usr/bin";
+    }
+
+    if (hash->searchPath == NULL || strcmp(hash->searchPath, searchPath) != 0) {
+        clearCommandHash(hash);
+        hash->searchPath = strdup(searchPath);
+    }
+}
+
+// Find the absolute path for a command, searching PATH only on a cache miss
+// Returns NULL when the caller should fall back to a normal PATH search
+char* lookupCommand(struct commandHash *hash, char* name) {
+    // Names with a slash are never searched for, so there is nothing to cache
+    if (strchr(name, '/') != NULL) {
+        return NULL;
+    }
+
+    checkSearchPath(hash);
+
+    unsigned int bucket = hashCommandName(name);
+    struct commandEntry *entry;
+    for (entry = hash->buckets[bucket]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0) {
+            entry->hits++;
+            hash->hits++;
+            return entry->path;
+        }
+    }
+
+    hash->misses++;
+    char* path = resolveCommand(name, hash->searchPath);
+    if (path == NULL) {
+        return NULL;
+    }
+
+    // Paths found through relative PATH entries change meaning after cd, so don't cache them
+    if (path[0] != '/') {
+        free(path);
+        return NULL;
+    }
+
+    entry = malloc(sizeof(struct commandEntry));
+    entry->name = strdup(name);
+    entry->path = path;
+    entry->hits = 1;
+    entry->next = hash->buckets[bucket];
+    hash->buckets[bucket] = entry;
+
+    return path;
+}
+
+// Drop the cached path for a single command, for example when it has disappeared
+void forgetCommand(struct commandHash *hash, char* name) {
+    struct commandEntry **link = &hash->buckets[hashCommandName(name)];
+    while (*link != NULL) {
+        struct commandEntry *entry = *link;
+        if (strcmp(entry->name, name) == 0) {
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            return;
+        }
+        link = &entry->next;
+    }
+}
+
+// Drop every cached path
+void clearCommandHash(struct commandHash *hash) {
+    for (int i = 0; i < COMMAND_HASH_BUCKETS; i++) {
+        while (hash->buckets[i] != NULL) {
+            struct commandEntry *entry = hash->buckets[i];
+            hash->buckets[i] = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+        }
+    }
+
+    free(hash->searchPath);
+    hash->searchPath = NULL;
+}
+
+// Print the cached commands along with the hit and miss counters
+void printCommandHash(struct commandHash *hash) {
+    int empty = 1;
+
+    for (int i = 0; i < COMMAND_HASH_BUCKETS; i++) {
+        for (struct commandEntry *entry = hash->buckets[i]; entry != NULL; entry = entry->next) {
+            if (empty) {
+                printf("hits\tcommand\n");
+                empty = 0;
+            }
+            printf("%4li\t%s\n", entry->hits, entry->path);
+        }
+    }
+
+    if (empty) {
+        printf("hash: hash table empty\n");
+    }
+    printf("Cache hits: %li\nCache misses: %li\n", hash->hits, hash->misses);
+}
+
+// Run the hash builtin: list the cache, clear it with -r, or look up the given names
+// Returns 0 on success and 1 if a name couldn't be found
+int runHashBuiltin(struct commandHash *hash, char** arguments) {
+    int result = 0;
+
+    if (arguments[1] == NULL) {
+        printCommandHash(hash);
+        return 0;
+    }
+
+    for (int i = 1; arguments[i] != NULL; i++) {
+        if (strcmp(arguments[i], "-r") == 0) {
+            clearCommandHash(hash);
+        } else if (strchr(arguments[i], '/') == NULL) {
+            // Resolve the name again even if it is already cached
+            forgetCommand(hash, arguments[i]);
+            if (lookupCommand(hash, arguments[i]) == NULL) {
+                printf("hash: %s: not found\n", arguments[i]);
+                result = 1;
+            }
+        }
+    }
+
+    return result;
+}
@@ -0,0 +1,29 @@
+#ifndef PATHCACHE_H
+#define PATHCACHE_H
+
+#define COMMAND_HASH_BUCKETS 64
+
+// A command name and the absolute path it was resolved to
+struct commandEntry {
+    char* name;
+    char* path;
+    long hits;
+    struct commandEntry *next;
+};
+
+// Cache of PATH lookups, like the hash builtin in bash
+struct commandHash {
+    struct commandEntry *buckets[COMMAND_HASH_BUCKETS];
+    char* searchPath;
+    long hits;
+    long misses;
+};
+
+void initCommandHash(struct commandHash *hash);
+char* lookupCommand(struct commandHash *hash, char* name);
+void forgetCommand(struct commandHash *hash, char* name);
+void clearCommandHash(struct commandHash *hash);
+void printCommandHash(struct commandHash *hash);
+int runHashBuiltin(struct commandHash *hash, char** arguments);
+
+#endif
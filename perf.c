@@ -0,0 +1,99 @@
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "perf.h"
+
+int openPerfEvent(int type, long long config, int pid);
+
+// Which event each counter uses
+static const int perfEventTypes[PERF_COUNTER_COUNT] = {
+    PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_SOFTWARE
+};
+static const long long perfEventConfigs[PERF_COUNTER_COUNT] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_SW_TASK_CLOCK
+};
+
+// Open a single counter for the given process that starts counting when it calls exec
+int openPerfEvent(int type, long long config, int pid) {
+    struct perf_event_attr attributes;
+    memset(&attributes, 0, sizeof(attributes));
+    attributes.size = sizeof(attributes);
+    attributes.type = type;
+    attributes.config = config;
+    attributes.disabled = 1;
+    attributes.enable_on_exec = 1;
+    attributes.inherit = 1;
+    attributes.exclude_kernel = 1;
+    attributes.exclude_hv = 1;
+    attributes.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    return syscall(SYS_perf_event_open, &attributes, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+// Attach the counters to a process that hasn't called exec yet
+// Hardware counters that aren't available are skipped, leaving just the software ones
+// Returns the number of counters that were opened
+int openPerfCounters(struct perfCounters *counters, int pid) {
+    static int warned = 0;
+    int opened = 0, error = 0;
+
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        counters->fds[i] = openPerfEvent(perfEventTypes[i], perfEventConfigs[i], pid);
+        if (counters->fds[i] != -1) {
+            opened++;
+        } else {
+            error = errno;
+        }
+    }
+
+    // Only complain once, the same counters will be missing for every command
+    if (opened < PERF_COUNTER_COUNT && !warned) {
+        printf("Some perf counters are not available, they will be skipped.\nError Number: %i\nError Message: %s\n", error, strerror(error));
+        warned = 1;
+    }
+
+    return opened;
+}
+
+// Read the final counter values once the process has been reaped
+// Counts are scaled up if the kernel had to multiplex the counters
+void readPerfCounters(struct perfCounters *counters, struct perfCounts *counts) {
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        unsigned long long data[3];
+        counts->values[i] = -1;
+
+        if (counters->fds[i] == -1 || read(counters->fds[i], data, sizeof(data)) != sizeof(data)) {
+            continue;
+        }
+
+        if (data[2] > 0 && data[2] < data[1]) {
+            counts->values[i] = (long long) ((double) data[0] * data[1] / data[2]);
+        } else {
+            counts->values[i] = data[0];
+        }
+    }
+}
+
+// Close every counter that was opened
+void closePerfCounters(struct perfCounters *counters) {
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        if (counters->fds[i] != -1) {
+            close(counters->fds[i]);
+            counters->fds[i] = -1;
+        }
+    }
+}
+
+// Instructions retired per CPU cycle, or -1 if either counter is missing
+double computeInstructionsPerCycle(struct perfCounts *counts) {
+    if (counts->values[PERF_CYCLES] <= 0 || counts->values[PERF_INSTRUCTIONS] < 0) {
+        return -1;
+    }
+    return (double) counts->values[PERF_INSTRUCTIONS] / counts->values[PERF_CYCLES];
+}
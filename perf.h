@@ -0,0 +1,27 @@
+#ifndef PERF_H
+#define PERF_H
+
+// The counters attached to each command
+#define PERF_CYCLES 0
+#define PERF_INSTRUCTIONS 1
+#define PERF_CACHE_MISSES 2
+#define PERF_BRANCH_MISSES 3
+#define PERF_TASK_CLOCK 4
+#define PERF_COUNTER_COUNT 5
+
+// Open perf_event_open counters for one command and its descendants
+struct perfCounters {
+    int fds[PERF_COUNTER_COUNT];
+};
+
+// Final counter values, with -1 for counters that couldn't be opened
+struct perfCounts {
+    long long values[PERF_COUNTER_COUNT];
+};
+
+int openPerfCounters(struct perfCounters *counters, int pid);
+void readPerfCounters(struct perfCounters *counters, struct perfCounts *counts);
+void closePerfCounters(struct perfCounters *counters);
+double computeInstructionsPerCycle(struct perfCounts *counts);
+
+#endif
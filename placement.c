@@ -0,0 +1,289 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <dirent.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "placement.h"
+
+#define TRUE 1
+#define FALSE 0
+
+int findNode(struct topology *topology, int node);
+int countNodeJobs(struct topology *topology, int index);
+
+// Start with a placement that leaves the command where it is
+void initPlacement(struct placement *placement) {
+    CPU_ZERO(&placement->cpus);
+    placement->node = -1;
+    placement->strict = FALSE;
+}
+
+// Returns TRUE if the placement changes where the command runs
+int hasPlacement(struct placement *placement) {
+    return CPU_COUNT(&placement->cpus) > 0 || placement->node >= 0;
+}
+
+// Read the NUMA nodes and their CPUs, keeping only the CPUs we are allowed to run on
+// Without /sys/devices/system/node, every allowed CPU is put in node 0
+// Returns -1 if our own affinity can't be read
+int loadTopology(struct topology *topology) {
+    char path[300], line[4096];
+
+    memset(topology, 0, sizeof(struct topology));
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &topology->allowed) == -1) {
+        return -1;
+    }
+
+    DIR* directory = opendir("/sys/devices/system/node");
+    struct dirent *entry;
+    while (directory != NULL && (entry = readdir(directory)) != NULL && topology->nodeCount < PLACEMENT_MAX_NODES) {
+        int node;
+        char extra;
+        if (sscanf(entry->d_name, "node%i%c", &node, &extra) != 1) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", entry->d_name);
+        FILE* file = fopen(path, "r");
+        if (file == NULL) {
+            continue;
+        }
+        cpu_set_t cpus;
+        int valid = (fgets(line, sizeof(line), file) != NULL);
+        fclose(file);
+        line[strcspn(line, "\n")] = '\0';
+
+        // Nodes with only memory, or only CPUs we can't use, have nothing to place jobs on
+        if (valid && parseCpuList(line, &cpus) == 0) {
+            CPU_AND(&cpus, &cpus, &topology->allowed);
+            if (CPU_COUNT(&cpus) > 0) {
+                topology->nodeIds[topology->nodeCount] = node;
+                topology->nodeCpus[topology->nodeCount++] = cpus;
+            }
+        }
+    }
+    if (directory != NULL) {
+        closedir(directory);
+    }
+
+    if (topology->nodeCount == 0) {
+        topology->nodeIds[0] = 0;
+        topology->nodeCpus[0] = topology->allowed;
+        topology->nodeCount = 1;
+    }
+    return 0;
+}
+
+// Find a node by its number
+// Returns its index in the topology, or -1 if there is no such node
+int findNode(struct topology *topology, int node) {
+    for (int i = 0; i < topology->nodeCount; i++) {
+        if (topology->nodeIds[i] == node) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Pin the placement to a list of CPUs
+// Returns -1 if the list doesn't parse or names a CPU we can't run on
+int placeOnCpus(struct topology *topology, char* list, struct placement *placement) {
+    cpu_set_t cpus, outside;
+
+    if (parseCpuList(list, &cpus) == -1 || CPU_COUNT(&cpus) == 0) {
+        printf("Invalid CPU list: %s\n", list);
+        return -1;
+    }
+    CPU_XOR(&outside, &cpus, &topology->allowed);
+    CPU_AND(&outside, &outside, &cpus);
+    if (CPU_COUNT(&outside) > 0) {
+        printf("Not every CPU in %s is available!\n", list);
+        return -1;
+    }
+    placement->cpus = cpus;
+    return 0;
+}
+
+// Bind the placement's memory to a node, running it on that node's CPUs unless it was given its own
+// Returns -1 if there is no such node
+int placeOnNode(struct topology *topology, int node, struct placement *placement) {
+    int index = findNode(topology, node);
+    if (index == -1) {
+        printf("There is no NUMA node %i with CPUs we can use!\n", node);
+        return -1;
+    }
+    if (CPU_COUNT(&placement->cpus) == 0) {
+        placement->cpus = topology->nodeCpus[index];
+    }
+    placement->node = node;
+    placement->strict = TRUE;
+    return 0;
+}
+
+// The jobs placed on a node's CPUs
+int countNodeJobs(struct topology *topology, int index) {
+    int jobs = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &topology->nodeCpus[index])) {
+            jobs += topology->cpuJobs[cpu];
+        }
+    }
+    return jobs;
+}
+
+// Put a job that wasn't given a placement on the least loaded CPU of the least loaded node,
+// counting jobs per CPU so a node with more CPUs takes more jobs
+// Its memory comes from that node by preference, so it can still spill over when the node is full
+void spreadPlacement(struct topology *topology, struct placement *placement) {
+    if (hasPlacement(placement)) {
+        return;
+    }
+
+    int bestNode = 0;
+    for (int i = 1; i < topology->nodeCount; i++) {
+        long long jobs = countNodeJobs(topology, i), bestJobs = countNodeJobs(topology, bestNode);
+        if (jobs * CPU_COUNT(&topology->nodeCpus[bestNode]) < bestJobs * CPU_COUNT(&topology->nodeCpus[i])) {
+            bestNode = i;
+        }
+    }
+
+    int bestCpu = -1;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &topology->nodeCpus[bestNode]) && (bestCpu == -1 || topology->cpuJobs[cpu] < topology->cpuJobs[bestCpu])) {
+            bestCpu = cpu;
+        }
+    }
+
+    CPU_SET(bestCpu, &placement->cpus);
+    placement->node = topology->nodeIds[bestNode];
+    placement->strict = FALSE;
+}
+
+// Count a running job on each of its CPUs
+void claimPlacement(struct topology *topology, struct placement *placement) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &placement->cpus)) {
+            topology->cpuJobs[cpu]++;
+        }
+    }
+}
+
+// Stop counting a job that has finished
+void releasePlacement(struct topology *topology, struct placement *placement) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &placement->cpus) && topology->cpuJobs[cpu] > 0) {
+            topology->cpuJobs[cpu]--;
+        }
+    }
+}
+
+// Parse a CPU list in the kernel's format, like "0-3,8,10-11"
+// Returns -1 if it doesn't make sense
+int parseCpuList(char* text, cpu_set_t *cpus) {
+    char* position = text;
+
+    CPU_ZERO(cpus);
+    while (*position != '\0') {
+        char* end;
+        long first = strtol(position, &end, 10);
+        long last = first;
+        if (end == position) {
+            return -1;
+        }
+        if (*end == '-') {
+            position = end + 1;
+            last = strtol(position, &end, 10);
+            if (end == position) {
+                return -1;
+            }
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, cpus);
+        }
+
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return -1;
+        }
+        position = end;
+    }
+    return 0;
+}
+
+// Write a CPU set out in the same format, with runs of CPUs as ranges
+void formatCpuList(cpu_set_t *cpus, char* buffer, size_t size) {
+    size_t length = 0;
+
+    buffer[0] = '\0';
+    for (int cpu = 0; cpu < CPU_SETSIZE && length < size; cpu++) {
+        if (!CPU_ISSET(cpu, cpus)) {
+            continue;
+        }
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, cpus)) {
+            last++;
+        }
+        char* separator = (length > 0) ? "," : "";
+        if (last > cpu) {
+            length += snprintf(buffer + length, size - length, "%s%i-%i", separator, cpu, last);
+        } else {
+            length += snprintf(buffer + length, size - length, "%s%i", separator, cpu);
+        }
+        cpu = last;
+    }
+}
+
+// Describe a placement for the job listing, like "CPUs 0-3, node 0"
+void formatPlacement(struct placement *placement, char* buffer, size_t size) {
+    char cpus[PLACEMENT_LIST_SIZE];
+
+    formatCpuList(&placement->cpus, cpus, sizeof(cpus));
+    if (placement->node >= 0) {
+        snprintf(buffer, size, "CPUs %s, node %i", cpus, placement->node);
+    } else {
+        snprintf(buffer, size, "CPUs %s", cpus);
+    }
+}
+
+// Parse a "place [--cpus list] [--node n] command" prefix into the placement
+// Returns the number of words to skip, 0 if there is no prefix, or -1 after printing the usage or the error
+int parsePlacementPrefix(char** arguments, struct topology *topology, struct placement *placement) {
+    char* cpus = NULL;
+    int node = -1;
+    int i = 1;
+
+    initPlacement(placement);
+    if (arguments[0] == NULL || strcmp(arguments[0], "place") != 0) {
+        return 0;
+    }
+
+    while (arguments[i] != NULL && arguments[i + 1] != NULL) {
+        if (strcmp(arguments[i], "--cpus") == 0) {
+            cpus = arguments[i + 1];
+        } else if (strcmp(arguments[i], "--node") == 0) {
+            node = atoi(arguments[i + 1]);
+        } else {
+            break;
+        }
+        i += 2;
+    }
+    if (arguments[i] == NULL || arguments[i][0] == '-' || (cpus == NULL && node == -1)) {
+        printf("Usage: place [--cpus list] [--node n] command [arguments...]\n");
+        return -1;
+    }
+
+    if (cpus != NULL && placeOnCpus(topology, cpus, placement) == -1) {
+        return -1;
+    }
+    if (node != -1 && placeOnNode(topology, node, placement) == -1) {
+        return -1;
+    }
+    return i;
+}
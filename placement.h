@@ -0,0 +1,46 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <sched.h>
+#include <stddef.h>
+
+// The most NUMA nodes that are tracked, and the highest node number a memory policy can name
+#define PLACEMENT_MAX_NODES 64
+#define PLACEMENT_MAX_NODE_ID 1024
+
+// Room for a formatted CPU list like "0-3,8,10-11"
+#define PLACEMENT_LIST_SIZE 256
+
+// Where a command runs: the CPUs it may use and the NUMA node its memory comes from
+// An empty CPU set leaves the affinity alone, and a node of -1 leaves the memory policy alone
+struct placement {
+    cpu_set_t cpus;
+    int node;
+    // Bind the memory to the node instead of just preferring it
+    int strict;
+};
+
+// The NUMA nodes and their CPUs from /sys/devices/system/node, limited to the CPUs we may use
+// Each CPU counts the running jobs placed on it, so new jobs can be spread onto the least loaded ones
+struct topology {
+    int nodeCount;
+    int nodeIds[PLACEMENT_MAX_NODES];
+    cpu_set_t nodeCpus[PLACEMENT_MAX_NODES];
+    cpu_set_t allowed;
+    int cpuJobs[CPU_SETSIZE];
+};
+
+void initPlacement(struct placement *placement);
+int hasPlacement(struct placement *placement);
+int loadTopology(struct topology *topology);
+int placeOnCpus(struct topology *topology, char* list, struct placement *placement);
+int placeOnNode(struct topology *topology, int node, struct placement *placement);
+void spreadPlacement(struct topology *topology, struct placement *placement);
+void claimPlacement(struct topology *topology, struct placement *placement);
+void releasePlacement(struct topology *topology, struct placement *placement);
+int parseCpuList(char* text, cpu_set_t *cpus);
+void formatCpuList(cpu_set_t *cpus, char* buffer, size_t size);
+void formatPlacement(struct placement *placement, char* buffer, size_t size);
+int parsePlacementPrefix(char** arguments, struct topology *topology, struct placement *placement);
+
+#endif
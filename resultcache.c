@@ -0,0 +1,440 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "resultcache.h"
+
+#define TRUE 1
+#define FALSE 0
+
+#define CACHE_COUNTERS_FILE "counters"
+#define CACHE_READ_SIZE 65536
+
+typedef unsigned __int128 cacheHash;
+
+// One stored result, for working out which ones to evict
+struct storedResult {
+    char name[RESULT_CACHE_KEY_SIZE];
+    struct timespec lastUsed;
+    long long size;
+};
+
+cacheHash hashBytes(cacheHash hash, const void* data, size_t length);
+cacheHash hashString(cacheHash hash, const char* string);
+int hashInputFile(cacheHash *hash, char* fileName, int byStat);
+void removeResult(char* directory, char* name);
+long long scanResults(char* directory, struct storedResult **results, int* count);
+void evictResults(char* directory, long long maxSize);
+int compareLastUsed(const void* first, const void* second);
+
+// The FNV-1a 128-bit offset basis and prime
+static const cacheHash cacheHashBasis = ((cacheHash) 0x6c62272e07bb0142ULL << 64) | 0x62b821756295c58dULL;
+static const cacheHash cacheHashPrime = ((cacheHash) 0x0000000001000000ULL << 64) | 0x000000000000013bULL;
+
+// Mix bytes into the hash
+cacheHash hashBytes(cacheHash hash, const void* data, size_t length) {
+    const unsigned char* bytes = data;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= cacheHashPrime;
+    }
+    return hash;
+}
+
+// Mix a string and its length into the hash, so "ab" "c" and "a" "bc" come out different
+cacheHash hashString(cacheHash hash, const char* string) {
+    size_t length = (string == NULL) ? (size_t) -1 : strlen(string);
+    hash = hashBytes(hash, &length, sizeof(length));
+    return (string == NULL) ? hash : hashBytes(hash, string, length);
+}
+
+// Mix an input file into the hash, by its contents or by where it is and when it last changed
+// Returns -1 if the file can't be read
+int hashInputFile(cacheHash *hash, char* fileName, int byStat) {
+    struct stat info;
+    char buffer[CACHE_READ_SIZE];
+
+    *hash = hashString(*hash, fileName);
+    if (byStat) {
+        if (stat(fileName, &info) == -1) {
+            return -1;
+        }
+        int64_t fingerprint[5] = {info.st_dev, info.st_ino, info.st_size, info.st_mtim.tv_sec, info.st_mtim.tv_nsec};
+        *hash = hashBytes(*hash, fingerprint, sizeof(fingerprint));
+        return 0;
+    }
+
+    int fd = open(fileName, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t length;
+    while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+        *hash = hashBytes(*hash, buffer, length);
+    }
+    close(fd);
+    return (length == -1) ? -1 : 0;
+}
+
+// Work out the key for a command from its arguments, working directory, chosen environment variables and inputs
+// Returns -1 if the working directory or one of the inputs can't be read, so the command can't be cached
+int computeCacheKey(char** arguments, struct cacheInputs *inputs, char* key) {
+    char directory[4096];
+    cacheHash hash = cacheHashBasis;
+
+    for (int i = 0; arguments[i] != NULL; i++) {
+        hash = hashString(hash, arguments[i]);
+    }
+    hash = hashString(hash, NULL);
+
+    if (getcwd(directory, sizeof(directory)) == NULL) {
+        return -1;
+    }
+    hash = hashString(hash, directory);
+
+    // An unset variable hashes differently from an empty one
+    for (int i = 0; i < inputs->variableCount; i++) {
+        hash = hashString(hash, inputs->variables[i]);
+        hash = hashString(hash, getenv(inputs->variables[i]));
+    }
+    for (int i = 0; i < inputs->fileCount; i++) {
+        if (hashInputFile(&hash, inputs->files[i], inputs->byStat) == -1) {
+            return -1;
+        }
+    }
+
+    snprintf(key, RESULT_CACHE_KEY_SIZE, "%016llx%016llx", (unsigned long long) (hash >> 64), (unsigned long long) hash);
+    return 0;
+}
+
+// Look up a command's result, opening its stored stdout and stderr
+// A hit marks the result as just used, so it is the last to be evicted
+// Returns TRUE on a hit
+int lookupCache(char* directory, char* key, struct cachedResult *result, int* outputFd, int* errorFd) {
+    char path[4096];
+
+    snprintf(path, sizeof(path), "%s/%s/result", directory, key);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return FALSE;
+    }
+    ssize_t length = read(fd, result, sizeof(struct cachedResult));
+    close(fd);
+    if (length != sizeof(struct cachedResult) || result->magic != RESULT_CACHE_MAGIC) {
+        return FALSE;
+    }
+
+    // The files are open before anything can evict them, so they stay readable
+    snprintf(path, sizeof(path), "%s/%s/stdout", directory, key);
+    *outputFd = open(path, O_RDONLY | O_CLOEXEC);
+    snprintf(path, sizeof(path), "%s/%s/stderr", directory, key);
+    *errorFd = open(path, O_RDONLY | O_CLOEXEC);
+    if (*outputFd == -1 || *errorFd == -1) {
+        if (*outputFd != -1) {
+            close(*outputFd);
+        }
+        if (*errorFd != -1) {
+            close(*errorFd);
+        }
+        return FALSE;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", directory, key);
+    utimensat(AT_FDCWD, path, NULL, 0);
+    return TRUE;
+}
+
+// Make a temporary directory in the store with the files the command's stdout and stderr go to
+// Returns NULL if the store can't be written to
+struct cacheEntry* beginCacheEntry(char* directory, char* key) {
+    static int entryCount = 0;
+    char path[4096];
+
+    if (mkdir(directory, 0755) == -1 && errno != EEXIST) {
+        return NULL;
+    }
+
+    struct cacheEntry *entry = calloc(1, sizeof(struct cacheEntry));
+    entry->directory = directory;
+    snprintf(entry->key, sizeof(entry->key), "%s", key);
+    asprintf(&entry->temporary, "%s/.%i.%i", directory, getpid(), ++entryCount);
+    if (mkdir(entry->temporary, 0755) == -1) {
+        free(entry->temporary);
+        free(entry);
+        return NULL;
+    }
+
+    snprintf(path, sizeof(path), "%s/stdout", entry->temporary);
+    entry->outputFd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    snprintf(path, sizeof(path), "%s/stderr", entry->temporary);
+    entry->errorFd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (entry->outputFd == -1 || entry->errorFd == -1) {
+        abortCacheEntry(entry);
+        return NULL;
+    }
+    return entry;
+}
+
+// Store the result next to the output and move the directory under its key, then evict down to maxSize
+// If another process stored the same key first, ours is thrown away
+void commitCacheEntry(struct cacheEntry *entry, struct cachedResult *result, long long maxSize) {
+    char path[4096];
+
+    result->magic = RESULT_CACHE_MAGIC;
+    snprintf(path, sizeof(path), "%s/result", entry->temporary);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 || write(fd, result, sizeof(struct cachedResult)) != sizeof(struct cachedResult)) {
+        if (fd != -1) {
+            close(fd);
+        }
+        abortCacheEntry(entry);
+        return;
+    }
+    close(fd);
+
+    snprintf(path, sizeof(path), "%s/%s", entry->directory, entry->key);
+    if (rename(entry->temporary, path) == -1) {
+        abortCacheEntry(entry);
+        return;
+    }
+
+    char* directory = entry->directory;
+    close(entry->outputFd);
+    close(entry->errorFd);
+    free(entry->temporary);
+    free(entry);
+    evictResults(directory, maxSize);
+}
+
+// Throw away a result that shouldn't be stored, like one from a command that was killed
+void abortCacheEntry(struct cacheEntry *entry) {
+    if (entry->outputFd != -1) {
+        close(entry->outputFd);
+    }
+    if (entry->errorFd != -1) {
+        close(entry->errorFd);
+    }
+    removeResult(entry->temporary, NULL);
+    free(entry->temporary);
+    free(entry);
+}
+
+// Remove a result's files and its directory, given the store and its name or just the directory
+void removeResult(char* directory, char* name) {
+    char path[4096], file[4200];
+    char* files[] = {"result", "stdout", "stderr"};
+
+    if (name == NULL) {
+        snprintf(path, sizeof(path), "%s", directory);
+    } else {
+        snprintf(path, sizeof(path), "%s/%s", directory, name);
+    }
+    for (int i = 0; i < 3; i++) {
+        snprintf(file, sizeof(file), "%s/%s", path, files[i]);
+        unlink(file);
+    }
+    rmdir(path);
+}
+
+// Copy stored output to where the command's output should go, with sendfile so it isn't copied through our memory
+void replayCachedOutput(int fd, long long size, int outputFd) {
+    char buffer[CACHE_READ_SIZE];
+    off_t offset = 0;
+
+    while (offset < size) {
+        ssize_t written = sendfile(outputFd, fd, &offset, size - offset);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written > 0) {
+            continue;
+        }
+        if (written == 0 || (errno != EINVAL && errno != ENOSYS)) {
+            return;
+        }
+
+        // Older kernels can only sendfile to sockets
+        ssize_t length = pread(fd, buffer, sizeof(buffer), offset);
+        if (length <= 0 || write(outputFd, buffer, length) != length) {
+            return;
+        }
+        offset += length;
+    }
+}
+
+// Find every stored result, with when it was last used and how much space it takes
+// Returns the total size
+long long scanResults(char* directory, struct storedResult **results, int* count) {
+    int capacity = 64;
+    long long total = 0;
+    struct stat info;
+    char path[4096];
+
+    *results = malloc(capacity * sizeof(struct storedResult));
+    *count = 0;
+    DIR* store = opendir(directory);
+    if (store == NULL) {
+        return 0;
+    }
+
+    // Temporary directories start with a dot, and results are named by their keys
+    struct dirent *dirEntry;
+    while ((dirEntry = readdir(store)) != NULL) {
+        if (dirEntry->d_name[0] == '.' || strlen(dirEntry->d_name) != RESULT_CACHE_KEY_SIZE - 1) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", directory, dirEntry->d_name);
+        if (stat(path, &info) == -1) {
+            continue;
+        }
+        if (*count == capacity) {
+            capacity *= 2;
+            *results = realloc(*results, capacity * sizeof(struct storedResult));
+        }
+        struct storedResult *result = &(*results)[(*count)++];
+        memcpy(result->name, dirEntry->d_name, RESULT_CACHE_KEY_SIZE);
+        result->lastUsed = info.st_mtim;
+        result->size = info.st_blocks * 512;
+
+        char* files[] = {"result", "stdout", "stderr"};
+        for (int i = 0; i < 3; i++) {
+            char file[4200];
+            snprintf(file, sizeof(file), "%s/%s", path, files[i]);
+            if (stat(file, &info) == 0) {
+                result->size += info.st_blocks * 512;
+            }
+        }
+        total += result->size;
+    }
+    closedir(store);
+    return total;
+}
+
+// Oldest use first
+int compareLastUsed(const void* first, const void* second) {
+    const struct storedResult *a = first, *b = second;
+    if (a->lastUsed.tv_sec != b->lastUsed.tv_sec) {
+        return (a->lastUsed.tv_sec > b->lastUsed.tv_sec) - (a->lastUsed.tv_sec < b->lastUsed.tv_sec);
+    }
+    return (a->lastUsed.tv_nsec > b->lastUsed.tv_nsec) - (a->lastUsed.tv_nsec < b->lastUsed.tv_nsec);
+}
+
+// Remove the least recently used results until the store fits in maxSize
+void evictResults(char* directory, long long maxSize) {
+    struct storedResult *results;
+    int count;
+
+    long long total = scanResults(directory, &results, &count);
+    if (total > maxSize) {
+        qsort(results, count, sizeof(struct storedResult), compareLastUsed);
+        for (int i = 0; i < count && total > maxSize; i++) {
+            removeResult(directory, results[i].name);
+            total -= results[i].size;
+        }
+    }
+    free(results);
+}
+
+// Add a hit, and the time it saved, or a miss to the store's totals
+void countCacheResult(char* directory, int hit, long long savedTime) {
+    struct cacheCounters counters;
+    char path[4096];
+
+    snprintf(path, sizeof(path), "%s/%s", directory, CACHE_COUNTERS_FILE);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return;
+    }
+
+    // Other processes using the store update the same totals
+    flock(fd, LOCK_EX);
+    if (pread(fd, &counters, sizeof(counters), 0) != sizeof(counters)) {
+        memset(&counters, 0, sizeof(counters));
+    }
+    if (hit) {
+        counters.hits++;
+        counters.savedTime += savedTime;
+    } else {
+        counters.misses++;
+    }
+    pwrite(fd, &counters, sizeof(counters), 0);
+    close(fd);
+}
+
+// Print the store's totals and how much it holds
+void printCacheCounters(char* directory) {
+    struct cacheCounters counters;
+    struct storedResult *results;
+    char path[4096];
+    int count;
+
+    memset(&counters, 0, sizeof(counters));
+    snprintf(path, sizeof(path), "%s/%s", directory, CACHE_COUNTERS_FILE);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        if (pread(fd, &counters, sizeof(counters), 0) != sizeof(counters)) {
+            memset(&counters, 0, sizeof(counters));
+        }
+        close(fd);
+    }
+    long long total = scanResults(directory, &results, &count);
+    free(results);
+
+    printf("Result cache %s: %i results, %lli kilobytes\n", directory, count, total / 1024);
+    printf("Hits: %lli\n", counters.hits);
+    printf("Misses: %lli\n", counters.misses);
+    printf("Time saved: %.3f milliseconds\n", counters.savedTime / 1000000.0);
+}
+
+// Append a file name or variable name to a list of cache inputs
+void addCacheInput(char*** list, int* count, char* value) {
+    *list = realloc(*list, (*count + 1) * sizeof(char*));
+    (*list)[(*count)++] = value;
+}
+
+// Parse a "cached [-i file]... [-e name]... [-s] command" prefix, adding the files and variables to the inputs
+// -s fingerprints the files by stat instead of their contents
+// Returns the number of words to skip, 0 if there is no prefix, or -1 after printing the usage and freeing the lists
+int parseCachePrefix(char** arguments, struct cacheInputs *inputs) {
+    int i = 1;
+
+    if (arguments[0] == NULL || strcmp(arguments[0], "cached") != 0) {
+        return 0;
+    }
+
+    while (arguments[i] != NULL && arguments[i][0] == '-') {
+        if (strcmp(arguments[i], "-i") == 0 && arguments[i + 1] != NULL) {
+            addCacheInput(&inputs->files, &inputs->fileCount, arguments[i + 1]);
+            i += 2;
+        } else if (strcmp(arguments[i], "-e") == 0 && arguments[i + 1] != NULL) {
+            addCacheInput(&inputs->variables, &inputs->variableCount, arguments[i + 1]);
+            i += 2;
+        } else if (strcmp(arguments[i], "-s") == 0) {
+            inputs->byStat = TRUE;
+            i++;
+        } else {
+            break;
+        }
+    }
+    if (arguments[i] == NULL || arguments[i][0] == '-') {
+        printf("Usage: cached [-i file] [-e name] [-s] command [arguments...]\n");
+        free(inputs->files);
+        free(inputs->variables);
+        inputs->files = NULL;
+        inputs->variables = NULL;
+        inputs->fileCount = 0;
+        inputs->variableCount = 0;
+        return -1;
+    }
+    return i;
+}
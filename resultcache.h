@@ -0,0 +1,62 @@
+#ifndef RESULTCACHE_H
+#define RESULTCACHE_H
+
+#include <sys/time.h>
+#include <sys/resource.h>
+
+// How big the store can get before the least recently used results are evicted
+#define RESULT_CACHE_DEFAULT_SIZE (256LL << 20)
+
+// The key is a 128-bit FNV-1a hash, written out in hex
+#define RESULT_CACHE_KEY_SIZE 33
+
+#define RESULT_CACHE_MAGIC 0x52434331
+
+// What a command did, kept next to its output
+struct cachedResult {
+    int magic;
+    int status;
+    long long wallTime;
+    long long outputSize;
+    long long errorSize;
+    struct rusage stats;
+};
+
+// A result being written, in a temporary directory until it is committed under its key
+struct cacheEntry {
+    char* directory;
+    char key[RESULT_CACHE_KEY_SIZE];
+    char* temporary;
+    int outputFd;
+    int errorFd;
+};
+
+// Totals kept in the store, updated by every process using it
+struct cacheCounters {
+    long long hits;
+    long long misses;
+    long long savedTime;
+};
+
+// What goes into a command's key besides its arguments and working directory
+// Inputs are fingerprinted by content, or by device, inode, size and mtime when byStat is set
+struct cacheInputs {
+    char** files;
+    int fileCount;
+    char** variables;
+    int variableCount;
+    int byStat;
+};
+
+int computeCacheKey(char** arguments, struct cacheInputs *inputs, char* key);
+int lookupCache(char* directory, char* key, struct cachedResult *result, int* outputFd, int* errorFd);
+struct cacheEntry* beginCacheEntry(char* directory, char* key);
+void commitCacheEntry(struct cacheEntry *entry, struct cachedResult *result, long long maxSize);
+void abortCacheEntry(struct cacheEntry *entry);
+void replayCachedOutput(int fd, long long size, int outputFd);
+void countCacheResult(char* directory, int hit, long long savedTime);
+void printCacheCounters(char* directory);
+void addCacheInput(char*** list, int* count, char* value);
+int parseCachePrefix(char** arguments, struct cacheInputs *inputs);
+
+#endif
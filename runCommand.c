@@ -1,101 +1,1085 @@
+#define _GNU_SOURCE
 #include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <errno.h>
+#include <signal.h>
+#include <time.h>
 
-long computeTimeDifference(struct timeval beforeTime, struct timeval afterTime);
-void printChildStatistics(struct rusage childStats, struct timeval beforeTime, struct timeval afterTime);
+#include "launch.h"
+#include "perf.h"
+#include "stats.h"
+#include "bench.h"
+#include "timeout.h"
+#include "server.h"
+#include "graph.h"
+#include "resultcache.h"
+#include "placement.h"
+
+// A command from a batch file, or a task from a graph file, that is currently running
+struct batchSlot {
+	int pid;
+	int task;
+	char* line;
+	char** arguments;
+	struct timespec startTime;
+	struct perfCounters counters;
+	struct deadline deadline;
+	int pidFd;
+	struct placement placement;
+};
+
+void printUsage(char* programName);
+int runBatch(char* fileName, int maxJobs, int perf, struct deadline *deadline, struct placement *placement, struct topology *spread, struct statsOutput *statsOutput);
+int waitForBatchSlot(struct batchSlot *slots, int maxJobs, int timerFd);
+char** splitCommandLine(char* line);
+int runBench(char** arguments, int runs, int warmup, struct deadline *deadline, char* connectPath, struct statsOutput *statsOutput);
+int benchmarkRuns(char** arguments, int warmup, struct deadline *deadline, int method, int serverFd, struct benchResults *results);
+int runRemoteCommand(char* connectPath, char** arguments, struct deadline *deadline, struct statsOutput *statsOutput);
+int runGraph(char* fileName, int maxJobs, int perf, int keepGoing, struct deadline *deadline, struct placement *placement, struct topology *spread, struct statsOutput *statsOutput);
+int replayCachedResult(char* directory, char* key, char** arguments, struct statsOutput *statsOutput);
+void finishCachedCommand(char* directory, struct cacheEntry *entry, long long maxSize, struct commandRecord *record);
+struct placement* placeCommand(struct placement *given, struct topology *spread, struct placement *placement);
+void recordPlacement(struct commandRecord *record, struct placement *placement, char* buffer);
 
 int main(int argc, char* argv[]) {
+	static struct option longOptions[] = {
+		{"batch", required_argument, NULL, 'b'},
+		{"jobs", required_argument, NULL, 'j'},
+		{"stats", required_argument, NULL, 's'},
+		{"stats-file", required_argument, NULL, 'f'},
+		{"stats-fd", required_argument, NULL, 'd'},
+		{"perf", no_argument, NULL, 'p'},
+		{"bench", no_argument, NULL, 'B'},
+		{"runs", required_argument, NULL, 'n'},
+		{"warmup", required_argument, NULL, 'w'},
+		{"timeout", required_argument, NULL, 't'},
+		{"kill-after", required_argument, NULL, 'k'},
+		{"server", required_argument, NULL, 'S'},
+		{"helpers", required_argument, NULL, 'H'},
+		{"connect", required_argument, NULL, 'c'},
+		{"graph", required_argument, NULL, 'g'},
+		{"keep-going", no_argument, NULL, 'K'},
+		{"cache", required_argument, NULL, 'C'},
+		{"cache-input", required_argument, NULL, 'I'},
+		{"cache-env", required_argument, NULL, 'E'},
+		{"cache-size", required_argument, NULL, 'Z'},
+		{"cache-by-stat", no_argument, NULL, 'M'},
+		{"cache-stats", no_argument, NULL, 'T'},
+		{"cpus", required_argument, NULL, 'P'},
+		{"node", required_argument, NULL, 'N'},
+		{"spread", no_argument, NULL, 'D'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+	char* batchFile = NULL;
+	char* graphFile = NULL;
+	int keepGoing = 0;
+	char* cacheDirectory = NULL;
+	struct cacheInputs cacheInputs = {NULL, 0, NULL, 0, 0};
+	long long cacheSize = RESULT_CACHE_DEFAULT_SIZE;
+	int cacheStats = 0;
+	char* cpuList = NULL;
+	int node = -1;
+	int spread = 0;
+	char* statsFormat = NULL;
+	char* statsFile = NULL;
+	int statsFd = -1;
+	int perf = 0;
+	int bench = 0, runs = 10, warmup = 1;
+	int maxJobs = sysconf(_SC_NPROCESSORS_ONLN);
+	long long timeout = 0, killAfter = 0;
+	char* serverPath = NULL;
+	char* connectPath = NULL;
+	int helpers = SERVER_DEFAULT_HELPERS;
+	int option;
+
+	// Parse the options in front of the command, stopping at the command itself
+	while ((option = getopt_long(argc, argv, "+b:j:n:h", longOptions, NULL)) != -1) {
+		switch (option) {
+		case 'b':
+			batchFile = optarg;
+			break;
+		case 'j':
+			maxJobs = atoi(optarg);
+			if (maxJobs < 1) {
+				printf("The number of jobs must be at least 1!\n");
+				exit(1);
+			}
+			break;
+		case 's':
+			statsFormat = optarg;
+			break;
+		case 'f':
+			statsFile = optarg;
+			break;
+		case 'd':
+			statsFd = atoi(optarg);
+			break;
+		case 'p':
+			perf = 1;
+			break;
+		case 'B':
+			bench = 1;
+			break;
+		case 'n':
+			runs = atoi(optarg);
+			if (runs < 1) {
+				printf("The number of runs must be at least 1!\n");
+				exit(1);
+			}
+			break;
+		case 'w':
+			warmup = atoi(optarg);
+			break;
+		case 't':
+		case 'k':
+			if (parseDuration(optarg, option == 't' ? &timeout : &killAfter) == -1) {
+				printf("Invalid duration: %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'S':
+			serverPath = optarg;
+			break;
+		case 'H':
+			helpers = atoi(optarg);
+			if (helpers < 1) {
+				printf("The number of helpers must be at least 1!\n");
+				exit(1);
+			}
+			break;
+		case 'c':
+			connectPath = optarg;
+			break;
+		case 'g':
+			graphFile = optarg;
+			break;
+		case 'K':
+			keepGoing = 1;
+			break;
+		case 'C':
+			cacheDirectory = optarg;
+			break;
+		case 'I':
+			addCacheInput(&cacheInputs.files, &cacheInputs.fileCount, optarg);
+			break;
+		case 'E':
+			addCacheInput(&cacheInputs.variables, &cacheInputs.variableCount, optarg);
+			break;
+		case 'Z':
+			cacheSize = atoll(optarg) << 20;
+			if (cacheSize <= 0) {
+				printf("The cache size must be at least 1 megabyte!\n");
+				exit(1);
+			}
+			break;
+		case 'M':
+			cacheInputs.byStat = 1;
+			break;
+		case 'T':
+			cacheStats = 1;
+			break;
+		case 'P':
+			cpuList = optarg;
+			break;
+		case 'N':
+			node = atoi(optarg);
+			if (node < 0) {
+				printf("The NUMA node can't be negative!\n");
+				exit(1);
+			}
+			break;
+		case 'D':
+			spread = 1;
+			break;
+		default:
+			printUsage(argv[0]);
+			exit(option == 'h' ? 0 : 1);
+		}
+	}
+
+	// Run as the server, keeping helpers forked ahead of time for clients started with --connect
+	if (serverPath != NULL) {
+		return runServer(serverPath, helpers);
+	}
+
+	// The server starts the command, so there is no chance to attach counters before exec
+	if (connectPath != NULL && (perf || batchFile != NULL || graphFile != NULL)) {
+		printf("--connect can't be combined with --perf, --batch or --graph!\n");
+		exit(1);
+	}
+
+	// The result cache only stands in for running a single command
+	if (cacheDirectory != NULL && (bench || batchFile != NULL || graphFile != NULL || connectPath != NULL)) {
+		printf("--cache can't be combined with --bench, --batch, --graph or --connect!\n");
+		exit(1);
+	}
+	if (cacheStats) {
+		if (cacheDirectory == NULL) {
+			printf("--cache-stats needs --cache to say which cache!\n");
+			exit(1);
+		}
+		printCacheCounters(cacheDirectory);
+		return 0;
+	}
+
+	// Placing commands needs the CPUs and NUMA nodes we can run on
+	// Commands started by a server or benchmarked run wherever they are started from
+	struct topology topology;
+	struct placement placement;
+	initPlacement(&placement);
+	if (cpuList != NULL || node != -1 || spread) {
+		if (bench || connectPath != NULL) {
+			printf("--cpus, --node and --spread can't be combined with --bench or --connect!\n");
+			exit(1);
+		}
+		if (loadTopology(&topology) == -1) {
+			printf("Unable to read the CPU topology!\nError Number: %i\nError Message: %s\n", errno, strerror(errno));
+			exit(1);
+		}
+		if (cpuList != NULL && placeOnCpus(&topology, cpuList, &placement) == -1) {
+			exit(1);
+		}
+		if (node != -1 && placeOnNode(&topology, node, &placement) == -1) {
+			exit(1);
+		}
+	}
+
+	// Set up where the statistics for each command get written
+	struct statsOutput statsOutput;
+	if (openStatsOutput(&statsOutput, statsFormat, statsFile, statsFd, 0) == -1) {
+		exit(1);
+	}
+	statsOutput.perf = perf;
+
+	// Every command gets the same timeout, counted from its own launch
+	struct deadline deadline;
+	initDeadline(&deadline, timeout, killAfter);
+
+	// Run every command in the batch file instead of a single command
+	if (batchFile != NULL) {
+		return runBatch(batchFile, maxJobs, perf, &deadline, &placement, spread ? &topology : NULL, &statsOutput);
+	}
+
+	// Run the tasks in the graph file, each once the tasks it depends on have succeeded
+	if (graphFile != NULL) {
+		return runGraph(graphFile, maxJobs, perf, keepGoing, &deadline, &placement, spread ? &topology : NULL, &statsOutput);
+	}
+
 	// Check to see if a command was actually specified
-	if (argc < 2) {
+	if (optind >= argc) {
 		// No command specified, so print an error and exit
 		printf("You must specify the command to run!\n");
 		exit(1);
 	}
 
 	// Extract the command name and the list of arguments
-	char* commandName = argv[1];
-	char** arguments = &argv[1];
+	char* commandName = argv[optind];
+	char** arguments = &argv[optind];
+
+	// Run the command repeatedly and summarize the measurements instead of running it once
+	if (bench) {
+		return runBench(arguments, runs, warmup, &deadline, connectPath, &statsOutput);
+	}
+
+	// Have a running server start the command instead of starting it ourselves
+	if (connectPath != NULL) {
+		return runRemoteCommand(connectPath, arguments, &deadline, &statsOutput);
+	}
 	
-	// Fork a child process and get its PID
-	int pid = fork();
+	// With a result cache, a hit replays the stored output instead of running the command,
+	// and a miss runs it with its output going into a new result
+	struct cacheEntry *cacheEntry = NULL;
+	if (cacheDirectory != NULL) {
+		char key[RESULT_CACHE_KEY_SIZE];
+		if (computeCacheKey(arguments, &cacheInputs, key) == -1) {
+			printf("Unable to read the cache inputs, running the command without the cache!\nError Number: %i\nError Message: %s\n", errno, strerror(errno));
+		} else if (replayCachedResult(cacheDirectory, key, arguments, &statsOutput)) {
+			return 0;
+		} else if ((cacheEntry = beginCacheEntry(cacheDirectory, key)) == NULL) {
+			printf("Unable to write to the result cache, running the command without it!\nError Number: %i\nError Message: %s\n", errno, strerror(errno));
+		}
+	}
+
+	int status;
+	struct timespec beforeTime, afterTime;
+	struct rusage childStats;
+
+	// Get the time information before starting the command, so launching it is counted too
+	clock_gettime(CLOCK_MONOTONIC, &beforeTime);
+
+	// Start the command in a child process and get its PID
+	struct launchOptions options;
+	struct perfCounters counters;
+	initLaunchOptions(&options);
+	options.hold = perf;
+	if (cacheEntry != NULL) {
+		options.outputFd = cacheEntry->outputFd;
+		options.errorFd = cacheEntry->errorFd;
+	}
+	if (hasPlacement(&placement)) {
+		options.placement = &placement;
+	}
+	int pid = launchCommand(commandName, arguments, &options);
+
+	// Check if the command failed to start
+	if (pid == -1) {
+		exit(1);
+	}
+
+	// Attach the counters while the child is held, so they start counting at exec
+	if (perf) {
+		openPerfCounters(&counters, pid);
+		releaseCommand(&options);
+	}
+
+	// Wait for the child to finish running the command, collecting its own statistics
+	// The child is sent SIGTERM, then SIGKILL, if it runs past the timeout
+	startDeadline(&deadline, beforeTime);
+	waitWithDeadline(pid, &deadline, &status, &childStats);
+
+	// Get the time right after the child process finished
+	clock_gettime(CLOCK_MONOTONIC, &afterTime);
 
-	// Determine whether we are in the parent or child process
-	if (pid != 0) {
-		// We are in the parent process
+	// Print the statistics, even if the command failed or was killed
+	struct commandRecord record = {.pid = pid, .command = commandName, .arguments = arguments, .status = status, .stats = childStats, .startTime = beforeTime, .endTime = afterTime, .timedOut = deadline.timedOut, .node = -1};
+	struct perfCounts counts;
+	char cpus[PLACEMENT_LIST_SIZE];
+	if (perf) {
+		readPerfCounters(&counters, &counts);
+		closePerfCounters(&counters);
+		record.perf = &counts;
+	}
+	recordPlacement(&record, &placement, cpus);
+	if (cacheEntry != NULL) {
+		finishCachedCommand(cacheDirectory, cacheEntry, cacheSize, &record);
+	}
+	writeStatsRecord(&statsOutput, &record);
+	
+	return 0;
+}
+
+// Print out how to use the program
+void printUsage(char* programName) {
+	printf("Usage: %s command [arguments...]\n", programName);
+	printf("       %s --batch file [-j jobs]\n", programName);
+	printf("       %s --graph file [-j jobs] [--keep-going]\n", programName);
+	printf("       %s --bench [-n runs] [--warmup runs] command [arguments...]\n", programName);
+	printf("       %s --server socket [--helpers n]\n", programName);
+	printf("       %s --connect socket [--bench] command [arguments...]\n", programName);
+	printf("       %s --cache dir [--cache-input file] [--cache-env name] command [arguments...]\n", programName);
+	printf("Options go before the command:\n");
+	printf("  -b, --batch file  Run each line of file (or - for stdin) as a command\n");
+	printf("  -j, --jobs n      Run at most n batch commands or graph tasks at once (default: number of cores)\n");
+	printf("  --graph file      Run the \"name: dependencies ; command\" tasks in file, each after its dependencies\n");
+	printf("  --keep-going      Keep running the graph tasks that don't depend on a failed one\n");
+	printf("  --stats format    Write statistics as human, json or csv (default: $STATS_FORMAT or human)\n");
+	printf("  --stats-file path Append statistics to path instead of stdout (default: $STATS_FILE)\n");
+	printf("  --stats-fd n      Write statistics to descriptor n instead of stdout (default: $STATS_FD)\n");
+	printf("  --perf            Count cycles, instructions, cache and branch misses with perf_event_open\n");
+	printf("  --bench           Run the command repeatedly and summarize the statistics\n");
+	printf("  -n, --runs n      Number of measured benchmark runs (default: 10)\n");
+	printf("  --warmup n        Number of unmeasured runs before the benchmark (default: 1)\n");
+	printf("  --timeout time    Send SIGTERM to a command still running after time (like 10, 1.5s, 500ms, 2m)\n");
+	printf("  --kill-after time Send SIGKILL if it is still running this long after the SIGTERM\n");
+	printf("  --server socket   Listen on a Unix socket and run commands sent with --connect\n");
+	printf("  --helpers n       Number of helper processes the server keeps forked (default: %i)\n", SERVER_DEFAULT_HELPERS);
+	printf("  --connect socket  Have the server on socket run the command, with --bench compare it with forking\n");
+	printf("  --cache dir       Replay the output and exit status of an earlier identical run from the cache in dir\n");
+	printf("  --cache-input file  Include the contents of file in the cache key (can be repeated)\n");
+	printf("  --cache-env name  Include environment variable name in the cache key (can be repeated)\n");
+	printf("  --cache-by-stat   Fingerprint the inputs by inode, size and mtime instead of their contents\n");
+	printf("  --cache-size mb   Evict the least recently used results past this size (default: %lli)\n", RESULT_CACHE_DEFAULT_SIZE >> 20);
+	printf("  --cache-stats     Print the hits, misses and time saved by the cache and exit\n");
+	printf("  --cpus list       Run the command, or each batch or graph command, on these CPUs, like 0-3,8\n");
+	printf("  --node n          Run on the CPUs of NUMA node n and take memory only from it\n");
+	printf("  --spread          Put each batch or graph command on the least loaded core, spreading them across NUMA nodes\n");
+}
+
+// Run every command in the batch file with at most maxJobs running at once
+// Returns 0 if every command succeeded and 1 otherwise
+int runBatch(char* fileName, int maxJobs, int perf, struct deadline *deadline, struct placement *placement, struct topology *spread, struct statsOutput *statsOutput) {
+	FILE* input = stdin;
+	if (strcmp(fileName, "-") != 0) {
+		input = fopen(fileName, "r");
+		if (input == NULL) {
+			printf("Unable to open %s!\nError Number: %i\nError Message: %s\n", fileName, errno, strerror(errno));
+			return 1;
+		}
+	}
+
+	struct batchSlot *slots = calloc(maxJobs, sizeof(struct batchSlot));
+	int running = 0, reachedEOF = 0, failed = 0, completed = 0, timedOut = 0;
+	long latencyCapacity = 1024;
+	long* latencies = malloc(latencyCapacity * sizeof(long));
+	struct timespec batchStart, batchEnd;
+	struct launchOptions options;
+
+	initLaunchOptions(&options);
+	options.hold = perf;
+	clock_gettime(CLOCK_MONOTONIC, &batchStart);
+
+	// With a timeout, one timer is kept armed for the earliest deadline of the running commands
+	int timerFd = -1;
+	if (deadline->timeout > 0) {
+		timerFd = openDeadlineTimer();
+		if (timerFd == -1) {
+			printf("Unable to enforce the timeout!\nError Number: %i\nError Message: %s\n", errno, strerror(errno));
+		}
+	}
+
+	while (!reachedEOF || running > 0) {
+		// Fill every free slot with the next command in the file
+		while (!reachedEOF && running < maxJobs) {
+			char* line = NULL;
+			size_t lineSize = 0;
+			if (getline(&line, &lineSize, input) == -1) {
+				free(line);
+				reachedEOF = 1;
+				break;
+			}
+
+			// Skip blank lines and comments
+			char** arguments = splitCommandLine(line);
+			if (arguments[0] == NULL || arguments[0][0] == '#') {
+				free(arguments);
+				free(line);
+				continue;
+			}
+
+			struct timespec startTime;
+			struct placement commandPlacement;
+			options.placement = placeCommand(placement, spread, &commandPlacement);
+			clock_gettime(CLOCK_MONOTONIC, &startTime);
+			int pid = launchCommand(arguments[0], arguments, &options);
+			if (pid == -1) {
+				if (spread != NULL) {
+					releasePlacement(spread, &commandPlacement);
+				}
+				failed++;
+				free(arguments);
+				free(line);
+				continue;
+			}
+
+			// Find a free slot for the new command
+			int slot = 0;
+			while (slots[slot].pid != 0) {
+				slot++;
+			}
+
+			// Attach the counters while the child is held, so they start counting at exec
+			if (perf) {
+				openPerfCounters(&slots[slot].counters, pid);
+				releaseCommand(&options);
+			}
+			slots[slot].pid = pid;
+			slots[slot].placement = commandPlacement;
+			slots[slot].line = line;
+			slots[slot].arguments = arguments;
+			slots[slot].startTime = startTime;
+			slots[slot].deadline = *deadline;
+			startDeadline(&slots[slot].deadline, startTime);
+			slots[slot].pidFd = (timerFd != -1) ? openPidFd(pid) : -1;
+			running++;
+		}
+
+		if (running == 0) {
+			continue;
+		}
+
+		// Sleep until one of the running commands finishes, enforcing their deadlines meanwhile
 		int status;
-		struct timeval beforeTime, afterTime;
+		struct rusage childStats;
+		int pid;
+		if (timerFd != -1) {
+			pid = wait4(slots[waitForBatchSlot(slots, maxJobs, timerFd)].pid, &status, 0, &childStats);
+		} else {
+			pid = wait4(-1, &status, 0, &childStats);
+		}
+		if (pid == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
 
-		// Get the time information before running the command
-		gettimeofday(&beforeTime, NULL);
+		struct timespec endTime;
+		clock_gettime(CLOCK_MONOTONIC, &endTime);
 
-		// Wait for the child to finish running the command
-		waitpid(pid, &status, 0);
+		int slot = 0;
+		while (slot < maxJobs && slots[slot].pid != pid) {
+			slot++;
+		}
+		if (slot == maxJobs) {
+			continue;
+		}
 
-		// If the child terminated normally, print the statistics
-		if (WEXITSTATUS(status) == 0) {
-			// Get the time right after the child process finished
-			gettimeofday(&afterTime, NULL);
-			
-			// Get the statistics of the child process that just finished
-			struct rusage childStats;
-			getrusage(RUSAGE_CHILDREN, &childStats);
+		// Print the statistics for the command that just finished
+		struct commandRecord record = {.pid = pid, .command = slots[slot].arguments[0], .arguments = slots[slot].arguments, .status = status, .stats = childStats, .startTime = slots[slot].startTime, .endTime = endTime, .timedOut = slots[slot].deadline.timedOut, .node = -1};
+		struct perfCounts counts;
+		char cpus[PLACEMENT_LIST_SIZE];
+		if (perf) {
+			readPerfCounters(&slots[slot].counters, &counts);
+			closePerfCounters(&slots[slot].counters);
+			record.perf = &counts;
+		}
+		recordPlacement(&record, &slots[slot].placement, cpus);
+		if (spread != NULL) {
+			releasePlacement(spread, &slots[slot].placement);
+		}
+		if (statsOutput->format == STATS_HUMAN) {
+			fprintf(statsOutput->file, "Command \"%s\" with PID %i has finished.\n", record.command, pid);
+			writeStatsRecord(statsOutput, &record);
+			fprintf(statsOutput->file, "\n");
+		} else {
+			writeStatsRecord(statsOutput, &record);
+		}
 
-			// Print the statistics
-			printChildStatistics(childStats, beforeTime, afterTime);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			failed++;
 		}
-	
-	} else {
-		// We are in the child process
-		// Run the command and get its result
-		int result = execvp(commandName, arguments);
-
-		// Check if the command failed
-		if (result == -1) {
-			// The command failed, so print out he error number and exit
-			printf("Invalid command!\nError Number: %i\n", errno);
-			exit(1);
+		if (record.timedOut) {
+			timedOut++;
+		}
+
+		// Remember the latency for the summary
+		if (completed == latencyCapacity) {
+			latencyCapacity *= 2;
+			latencies = realloc(latencies, latencyCapacity * sizeof(long));
 		}
+		latencies[completed++] = computeTimeDifference(slots[slot].startTime, endTime) / 1000;
+
+		free(slots[slot].arguments);
+		free(slots[slot].line);
+		if (slots[slot].pidFd != -1) {
+			close(slots[slot].pidFd);
+		}
+		slots[slot].pid = 0;
+		running--;
 	}
-	
+
+	clock_gettime(CLOCK_MONOTONIC, &batchEnd);
+	if (input != stdin) {
+		fclose(input);
+	}
+
+	// Print the summary for the whole batch
+	long totalTime = computeTimeDifference(batchStart, batchEnd) / 1000;
+	qsort(latencies, completed, sizeof(long), compareLongs);
+
+	printf("Commands run: %i\n", completed);
+	printf("Commands failed: %i\n", failed);
+	if (deadline->timeout > 0) {
+		printf("Commands timed out: %i\n", timedOut);
+	}
+	printf("Total wall-clock time: %li milliseconds\n", totalTime / 1000);
+	printf("Throughput: %.2f commands/second\n", totalTime > 0 ? completed * 1000000.0 / totalTime : 0.0);
+	printf("Latency p50: %.3f milliseconds\n", computePercentile(latencies, completed, 50) / 1000.0);
+	printf("Latency p99: %.3f milliseconds\n", computePercentile(latencies, completed, 99) / 1000.0);
+
+	if (timerFd != -1) {
+		close(timerFd);
+	}
+	free(latencies);
+	free(slots);
+	return failed > 0;
+}
+
+// Run the tasks in a graph file on at most maxJobs workers, each once all of its dependencies have succeeded
+// Ready tasks start longest chain first, a failure stops new tasks from starting unless keepGoing is set,
+// and the critical path is printed at the end
+// Returns 0 if every task ran and succeeded and 1 otherwise
+int runGraph(char* fileName, int maxJobs, int perf, int keepGoing, struct deadline *deadline, struct placement *placement, struct topology *spread, struct statsOutput *statsOutput) {
+	struct taskGraph graph;
+	if (loadGraph(&graph, fileName) == -1) {
+		return 1;
+	}
+
+	struct batchSlot *slots = calloc(maxJobs, sizeof(struct batchSlot));
+	int running = 0, failed = 0, completed = 0, skipped = 0, timedOut = 0, stopping = 0;
+	struct timespec graphStart, graphEnd;
+	struct launchOptions options;
+
+	initLaunchOptions(&options);
+	options.hold = perf;
+
+	// With a timeout, one timer is kept armed for the earliest deadline of the running tasks
+	int timerFd = -1;
+	if (deadline->timeout > 0) {
+		timerFd = openDeadlineTimer();
+		if (timerFd == -1) {
+			printf("Unable to enforce the timeout!\nError Number: %i\nError Message: %s\n", errno, strerror(errno));
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &graphStart);
+	startGraph(&graph, graphStart);
+
+	while (1) {
+		// Give every free worker the ready task with the longest chain after it
+		while (!stopping && running < maxJobs && graph.readyCount > 0) {
+			int task = takeReadyTask(&graph);
+			char** arguments = graph.tasks[task].arguments;
+
+			struct placement taskPlacement;
+			options.placement = placeCommand(placement, spread, &taskPlacement);
+			clock_gettime(CLOCK_MONOTONIC, &graph.tasks[task].startTime);
+			int pid = launchCommand(arguments[0], arguments, &options);
+			if (pid == -1) {
+				if (spread != NULL) {
+					releasePlacement(spread, &taskPlacement);
+				}
+				failed++;
+				skipped += finishTask(&graph, task, 0, graph.tasks[task].startTime);
+				stopping = !keepGoing;
+				continue;
+			}
+
+			// Find a free slot for the new task
+			int slot = 0;
+			while (slots[slot].pid != 0) {
+				slot++;
+			}
+
+			// Attach the counters while the child is held, so they start counting at exec
+			if (perf) {
+				openPerfCounters(&slots[slot].counters, pid);
+				releaseCommand(&options);
+			}
+			slots[slot].pid = pid;
+			slots[slot].placement = taskPlacement;
+			slots[slot].task = task;
+			slots[slot].arguments = arguments;
+			slots[slot].startTime = graph.tasks[task].startTime;
+			slots[slot].deadline = *deadline;
+			startDeadline(&slots[slot].deadline, slots[slot].startTime);
+			slots[slot].pidFd = (timerFd != -1) ? openPidFd(pid) : -1;
+			running++;
+		}
+
+		if (running == 0) {
+			break;
+		}
+
+		// Sleep until one of the running tasks finishes, enforcing their deadlines meanwhile
+		int status;
+		struct rusage childStats;
+		int pid;
+		if (timerFd != -1) {
+			pid = wait4(slots[waitForBatchSlot(slots, maxJobs, timerFd)].pid, &status, 0, &childStats);
+		} else {
+			pid = wait4(-1, &status, 0, &childStats);
+		}
+		if (pid == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		struct timespec endTime;
+		clock_gettime(CLOCK_MONOTONIC, &endTime);
+
+		int slot = 0;
+		while (slot < maxJobs && slots[slot].pid != pid) {
+			slot++;
+		}
+		if (slot == maxJobs) {
+			continue;
+		}
+		struct graphTask *task = &graph.tasks[slots[slot].task];
+
+		// Print the statistics for the task that just finished
+		struct commandRecord record = {.pid = pid, .command = task->arguments[0], .arguments = task->arguments, .status = status, .stats = childStats, .startTime = task->startTime, .endTime = endTime, .timedOut = slots[slot].deadline.timedOut, .node = -1};
+		struct perfCounts counts;
+		char cpus[PLACEMENT_LIST_SIZE];
+		if (perf) {
+			readPerfCounters(&slots[slot].counters, &counts);
+			closePerfCounters(&slots[slot].counters);
+			record.perf = &counts;
+		}
+		recordPlacement(&record, &slots[slot].placement, cpus);
+		if (spread != NULL) {
+			releasePlacement(spread, &slots[slot].placement);
+		}
+		if (statsOutput->format == STATS_HUMAN) {
+			fprintf(statsOutput->file, "Task \"%s\" with PID %i has finished.\n", task->name, pid);
+			writeStatsRecord(statsOutput, &record);
+			fprintf(statsOutput->file, "\n");
+		} else {
+			writeStatsRecord(statsOutput, &record);
+		}
+		completed++;
+		if (record.timedOut) {
+			timedOut++;
+		}
+
+		// A failure skips everything after it, and unless we keep going, stops anything new from starting
+		int succeeded = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+		skipped += finishTask(&graph, slots[slot].task, succeeded, endTime);
+		if (!succeeded) {
+			failed++;
+			if (!keepGoing && !stopping) {
+				printf("Task %s failed, waiting for the running tasks to finish.\n", task->name);
+				stopping = 1;
+			}
+		}
+
+		if (slots[slot].pidFd != -1) {
+			close(slots[slot].pidFd);
+		}
+		slots[slot].pid = 0;
+		running--;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &graphEnd);
+
+	// Print the summary for the whole graph
+	int notStarted = 0;
+	for (int i = 0; i < graph.count; i++) {
+		if (graph.tasks[i].state == TASK_WAITING || graph.tasks[i].state == TASK_READY) {
+			notStarted++;
+		}
+	}
+	printf("Tasks run: %i of %i\n", completed, graph.count);
+	printf("Tasks failed: %i\n", failed);
+	if (skipped > 0) {
+		printf("Tasks skipped after a failed dependency: %i\n", skipped);
+	}
+	if (notStarted > 0) {
+		printf("Tasks not started: %i\n", notStarted);
+	}
+	if (deadline->timeout > 0) {
+		printf("Tasks timed out: %i\n", timedOut);
+	}
+	printf("Total wall-clock time: %.3f milliseconds\n", computeTimeDifference(graphStart, graphEnd) / 1000000.0);
+	printCriticalPath(&graph, graphStart, graphEnd);
+
+	if (timerFd != -1) {
+		close(timerFd);
+	}
+	int result = (failed > 0 || completed < graph.count);
+	free(slots);
+	freeGraph(&graph);
+	return result;
+}
+
+// Sleep until one of the running batch commands exits, signalling any that run past their deadlines
+// Commands without a pidfd are woken for by the shared SIGCHLD signalfd, and if poll stops working,
+// by waiting for SIGCHLD itself until the next deadline
+// Returns the slot of a command that has exited and can be reaped
+int waitForBatchSlot(struct batchSlot *slots, int maxJobs, int timerFd) {
+	struct pollfd *fds = malloc((maxJobs + 2) * sizeof(struct pollfd));
+	int *fdSlots = malloc(maxJobs * sizeof(int));
+	int exited = -1, pollFailed = 0;
+
+	while (exited == -1) {
+		struct timespec now, earliest;
+		int count = 0, found = 0, childSignals = 0;
+
+		// Send whatever signals are due and arm the timer for the next deadline
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		for (int slot = 0; slot < maxJobs; slot++) {
+			if (slots[slot].pid == 0) {
+				continue;
+			}
+			int signalNumber = nextDeadlineSignal(&slots[slot].deadline, now);
+			if (signalNumber != 0) {
+				kill(slots[slot].pid, signalNumber);
+				if (signalNumber == SIGTERM) {
+					kill(slots[slot].pid, SIGCONT);
+				}
+			}
+			keepEarliestDeadline(&slots[slot].deadline, &earliest, &found);
+
+			// Without a pidfd, look before sleeping, since it may have exited before SIGCHLD was blocked
+			if (slots[slot].pidFd == -1 || pollFailed) {
+				childSignals = 1;
+				if (exited == -1 && hasExited(slots[slot].pid)) {
+					exited = slot;
+				}
+				continue;
+			}
+			fds[count].fd = slots[slot].pidFd;
+			fds[count].events = POLLIN;
+			fdSlots[count++] = slot;
+		}
+		if (exited != -1) {
+			break;
+		}
+
+		if (pollFailed) {
+			waitForChildSignal(found ? &earliest : NULL);
+			continue;
+		}
+		int signalFd = childSignals ? openChildSignalFd() : -1;
+		setDeadlineTimer(timerFd, found ? &earliest : NULL);
+		fds[count].fd = timerFd;
+		fds[count].events = POLLIN;
+		fds[count + 1].fd = signalFd;
+		fds[count + 1].events = POLLIN;
+
+		if (poll(fds, count + 2, -1) == -1) {
+			pollFailed = (errno != EINTR);
+			continue;
+		}
+		for (int i = 0; i < count && exited == -1; i++) {
+			if (fds[i].revents & POLLIN) {
+				exited = fdSlots[i];
+			}
+		}
+		if (fds[count].revents & POLLIN) {
+			unsigned long long expirations;
+			read(timerFd, &expirations, sizeof(expirations));
+		}
+		if (fds[count + 1].revents & POLLIN) {
+			drainChildSignals(signalFd);
+		}
+	}
+
+	free(fds);
+	free(fdSlots);
+	return exited;
+}
+
+// Run the command warmup + runs times and write a summary of the measured runs
+// With a server, the same runs are made through it too, and the baseline always uses fork, so the server is
+// compared with the plain fork path its pre-forked helpers replace
+// Returns 0 if every run succeeded and 1 otherwise
+int runBench(char** arguments, int runs, int warmup, struct deadline *deadline, char* connectPath, struct statsOutput *statsOutput) {
+	struct benchResults results[2];
+	int serverFd = -1, failed = 0, started = 0, aborted = 0;
+
+	if (connectPath != NULL) {
+		serverFd = connectServer(connectPath);
+		if (serverFd == -1) {
+			return 1;
+		}
+	}
+
+	for (int path = 0; path < (serverFd == -1 ? 1 : 2) && !aborted; path++) {
+		results[path].arguments = arguments;
+		results[path].label = (serverFd == -1) ? NULL : (path == 0 ? "fork" : "server");
+		results[path].runs = runs;
+		for (int i = 0; i < BENCH_METRIC_COUNT; i++) {
+			results[path].samples[i] = malloc(runs * sizeof(long));
+		}
+		started++;
+
+		int method = (serverFd == -1) ? launchMethodFromEnv() : LAUNCH_FORK;
+		if (benchmarkRuns(arguments, warmup, deadline, method, path == 0 ? -1 : serverFd, &results[path]) == -1) {
+			aborted = 1;
+			continue;
+		}
+		writeBenchResults(statsOutput, &results[path]);
+		failed |= results[path].failures > 0;
+	}
+
+	if (serverFd != -1) {
+		if (!aborted) {
+			writeBenchComparison(statsOutput, &results[0], &results[1]);
+		}
+		close(serverFd);
+	}
+	for (int path = 0; path < started; path++) {
+		for (int i = 0; i < BENCH_METRIC_COUNT; i++) {
+			free(results[path].samples[i]);
+		}
+	}
+	return failed || aborted;
+}
+
+// Make the runs for one benchmark, launching the command ourselves with the given method or, given a server, through it
+// The command's stdout goes to /dev/null so printing it doesn't skew the measurements
+// Returns -1 if the command couldn't be started
+int benchmarkRuns(char** arguments, int warmup, struct deadline *deadline, int method, int serverFd, struct benchResults *results) {
+	int runs = results->runs;
+	results->runs = 0;
+	results->warmup = warmup;
+	results->failures = 0;
+
+	struct launchOptions options;
+	initLaunchOptions(&options);
+	options.method = method;
+	options.outputFd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	int fds[3] = {STDIN_FILENO, options.outputFd, STDERR_FILENO};
+
+	for (int i = 0; i < warmup + runs; i++) {
+		int status;
+		struct timespec beforeTime, afterTime;
+		struct rusage childStats;
+		struct deadline runDeadline = *deadline;
+
+		clock_gettime(CLOCK_MONOTONIC, &beforeTime);
+		startDeadline(&runDeadline, beforeTime);
+		if (serverFd == -1) {
+			int pid = launchCommand(arguments[0], arguments, &options);
+			if (pid == -1) {
+				close(options.outputFd);
+				return -1;
+			}
+			waitWithDeadline(pid, &runDeadline, &status, &childStats);
+		} else {
+			struct serverReply reply;
+			if (submitCommand(serverFd, arguments, fds, &runDeadline, &reply) == -1) {
+				printf("Lost the connection to the server!\n");
+				close(options.outputFd);
+				return -1;
+			}
+			if (reply.error != 0) {
+				printLaunchError(reply.error);
+				close(options.outputFd);
+				return -1;
+			}
+			status = reply.status;
+			childStats = reply.stats;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &afterTime);
+
+		// Warmup runs fill the caches but aren't measured
+		if (i < warmup) {
+			continue;
+		}
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			results->failures++;
+		}
+
+		int run = results->runs++;
+		results->samples[BENCH_WALL][run] = computeTimeDifference(beforeTime, afterTime) / 1000;
+		results->samples[BENCH_USER][run] = timevalToMicroseconds(childStats.ru_utime);
+		results->samples[BENCH_SYSTEM][run] = timevalToMicroseconds(childStats.ru_stime);
+		results->samples[BENCH_MINOR_FAULTS][run] = childStats.ru_minflt;
+		results->samples[BENCH_MAJOR_FAULTS][run] = childStats.ru_majflt;
+	}
+
+	close(options.outputFd);
 	return 0;
 }
 
-// Compute the difference between the two specified timevals
-long computeTimeDifference(struct timeval beforeTime, struct timeval afterTime) {
-	// Get the seconds difference and convert to microseconds
-	long difference = (long) ((afterTime.tv_sec - beforeTime.tv_sec) * 1000000);
+// Run a single command through the server and write its statistics, like running it directly
+// Returns 0 once the command has run, or 1 if the server couldn't run it
+int runRemoteCommand(char* connectPath, char** arguments, struct deadline *deadline, struct statsOutput *statsOutput) {
+	struct timespec beforeTime, afterTime;
+	struct serverReply reply;
+	int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
 
-	// Get the microseconds difference
-	long microDifference = (long) (afterTime.tv_usec - beforeTime.tv_usec);
+	// Connecting is part of launching, so it is counted too
+	clock_gettime(CLOCK_MONOTONIC, &beforeTime);
+	int serverFd = connectServer(connectPath);
+	if (serverFd == -1) {
+		return 1;
+	}
+	startDeadline(deadline, beforeTime);
+	if (submitCommand(serverFd, arguments, fds, deadline, &reply) == -1) {
+		printf("Lost the connection to the server!\n");
+		return 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &afterTime);
+	close(serverFd);
 
-	// Correct the difference when the after microseconds > before microseconds
-	if (microDifference < 0) {
-		microDifference += 1000000;
+	if (reply.error != 0) {
+		printLaunchError(reply.error);
+		return 1;
 	}
 
-	// Add the corrected microsecond difference to the total
-	difference += microDifference;
+	struct commandRecord record = {.pid = reply.pid, .command = arguments[0], .arguments = arguments, .status = reply.status, .stats = reply.stats, .startTime = beforeTime, .endTime = afterTime, .timedOut = deadline->timedOut, .node = -1};
+	writeStatsRecord(statsOutput, &record);
+	return 0;
+}
+
+// Look up the command in the result cache, and on a hit write out its stored output and statistics
+// Returns 1 on a hit, and 0 if the command has to be run
+int replayCachedResult(char* directory, char* key, char** arguments, struct statsOutput *statsOutput) {
+	struct cachedResult result;
+	struct timespec beforeTime, afterTime;
+	int outputFd, errorFd;
+
+	clock_gettime(CLOCK_MONOTONIC, &beforeTime);
+	if (!lookupCache(directory, key, &result, &outputFd, &errorFd)) {
+		return 0;
+	}
+	replayCachedOutput(outputFd, result.outputSize, STDOUT_FILENO);
+	replayCachedOutput(errorFd, result.errorSize, STDERR_FILENO);
+	close(outputFd);
+	close(errorFd);
+	clock_gettime(CLOCK_MONOTONIC, &afterTime);
+
+	// Nothing ran, so there is no usage to report, just the time the real run would have taken
+	long long savedTime = result.wallTime - computeTimeDifference(beforeTime, afterTime);
+	countCacheResult(directory, 1, savedTime);
+
+	struct rusage noStats;
+	memset(&noStats, 0, sizeof(noStats));
+	struct commandRecord record = {.command = arguments[0], .arguments = arguments, .status = result.status, .stats = noStats, .startTime = beforeTime, .endTime = afterTime, .cache = CACHE_HIT, .savedTime = savedTime, .node = -1};
+	writeStatsRecord(statsOutput, &record);
+	return 1;
+}
+
+// Pass on the output of a command run on a cache miss, and store its result
+// Commands that were killed or timed out aren't stored, since running them again could turn out differently
+void finishCachedCommand(char* directory, struct cacheEntry *entry, long long maxSize, struct commandRecord *record) {
+	struct cachedResult result;
+
+	memset(&result, 0, sizeof(result));
+	result.status = record->status;
+	result.wallTime = computeTimeDifference(record->startTime, record->endTime);
+	result.outputSize = lseek(entry->outputFd, 0, SEEK_END);
+	result.errorSize = lseek(entry->errorFd, 0, SEEK_END);
+	result.stats = record->stats;
 
-	// Convert to milliseconds and return the result
-	return (difference / 1000);
+	replayCachedOutput(entry->outputFd, result.outputSize, STDOUT_FILENO);
+	replayCachedOutput(entry->errorFd, result.errorSize, STDERR_FILENO);
+
+	if (WIFEXITED(record->status) && !record->timedOut) {
+		commitCacheEntry(entry, &result, maxSize);
+	} else {
+		abortCacheEntry(entry);
+	}
+	countCacheResult(directory, 0, 0);
+	record->cache = CACHE_MISS;
 }
 
-// Print the statistics about the child process with the given rusage data
-void printChildStatistics(struct rusage childStats, struct timeval beforeTime, struct timeval afterTime) {
-	long difference = computeTimeDifference(beforeTime, afterTime);
-	long userCPUTime = (childStats.ru_utime.tv_sec * 1000) + (childStats.ru_utime.tv_usec / 1000);
-	long sysCPUTime = (childStats.ru_stime.tv_sec * 1000) + (childStats.ru_stime.tv_usec / 1000);
-
-	printf("Wall-Clock time: %li milliseconds\n", difference);
-	printf("User CPU time: %li milliseconds\n", userCPUTime);
-	printf("System CPU time: %li milliseconds\n", sysCPUTime);
-	printf("Voluntary context switches: %li\n", childStats.ru_nvcsw);
-	printf("Involuntary context switches: %li\n", childStats.ru_nivcsw);
-	printf("Page faults: %li\n", childStats.ru_minflt + childStats.ru_majflt);
-	printf("Page faults that could be satisfied with unreclaimed pages: %li\n", childStats.ru_majflt);
+// Work out where a batch or graph command runs: where --cpus and --node say, or with --spread, on the least loaded core
+// Returns the placement to launch with, or NULL to leave the command where we are
+struct placement* placeCommand(struct placement *given, struct topology *spread, struct placement *placement) {
+	*placement = *given;
+	if (spread != NULL) {
+		spreadPlacement(spread, placement);
+		claimPlacement(spread, placement);
+	}
+	return hasPlacement(placement) ? placement : NULL;
 }
 
+// Add where a command ran to its record, with its CPUs written out in the buffer
+void recordPlacement(struct commandRecord *record, struct placement *placement, char* buffer) {
+	if (hasPlacement(placement)) {
+		formatCpuList(&placement->cpus, buffer, PLACEMENT_LIST_SIZE);
+		record->cpus = buffer;
+		record->node = placement->node;
+	}
+}
+
+// Split a command line on whitespace in place, returning a NULL terminated argument list
+char** splitCommandLine(char* line) {
+	char** arguments = malloc((strlen(line) / 2 + 2) * sizeof(char*));
+	int count = 0;
+
+	for (char* argument = strtok(line, " \t\n"); argument != NULL; argument = strtok(NULL, " \t\n")) {
+		arguments[count++] = argument;
+	}
+	arguments[count] = NULL;
+
+	return arguments;
+}
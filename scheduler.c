@@ -0,0 +1,282 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/timerfd.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "scheduler.h"
+#include "stats.h"
+
+#define TRUE 1
+#define FALSE 0
+
+#define INITIAL_QUEUE_SIZE 64
+
+int goesBefore(struct queuedJob *first, struct queuedJob *second);
+void siftUp(struct scheduler *scheduler, int index);
+void siftDown(struct scheduler *scheduler, int index);
+double readPressure(char* fileName);
+int compareQueuedJobs(const void* first, const void* second);
+
+// Start with an empty queue and a timer that isn't armed
+// Returns -1 if the timer couldn't be created
+int initScheduler(struct scheduler *scheduler) {
+    memset(scheduler, 0, sizeof(struct scheduler));
+    scheduler->capacity = INITIAL_QUEUE_SIZE;
+    scheduler->heap = malloc(scheduler->capacity * sizeof(struct queuedJob*));
+    scheduler->nextId = 1;
+    scheduler->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    return (scheduler->timerFd == -1) ? -1 : 0;
+}
+
+// Add a job to the queue, copying its arguments
+// Its key is the time it was submitted pushed back by its niceness, so it doesn't change while it waits
+struct queuedJob* enqueueJob(struct scheduler *scheduler, char** arguments, int argumentCount, int nice, struct placement *placement, struct deadline *deadline) {
+    struct queuedJob *queued = malloc(sizeof(struct queuedJob));
+
+    queued->id = scheduler->nextId++;
+    queued->nice = nice;
+    clock_gettime(CLOCK_MONOTONIC, &queued->submitTime);
+    queued->key = queued->submitTime.tv_sec * 1000000000LL + queued->submitTime.tv_nsec + nice * SCHEDULER_AGING;
+    queued->arguments = duplicateArguments(arguments);
+    queued->argumentCount = argumentCount;
+    queued->deadline = *deadline;
+    queued->placement = *placement;
+
+    if (scheduler->count == scheduler->capacity) {
+        scheduler->capacity *= 2;
+        scheduler->heap = realloc(scheduler->heap, scheduler->capacity * sizeof(struct queuedJob*));
+    }
+    scheduler->heap[scheduler->count++] = queued;
+    siftUp(scheduler, scheduler->count - 1);
+    return queued;
+}
+
+// Take the job whose turn it is off the queue
+// Returns NULL if the queue is empty
+struct queuedJob* dequeueJob(struct scheduler *scheduler) {
+    if (scheduler->count == 0) {
+        return NULL;
+    }
+    struct queuedJob *queued = scheduler->heap[0];
+    scheduler->heap[0] = scheduler->heap[--scheduler->count];
+    siftDown(scheduler, 0);
+    return queued;
+}
+
+// Free a job taken off the queue
+void freeQueuedJob(struct queuedJob *queued) {
+    freeArguments(queued->arguments);
+    free(queued);
+}
+
+// Jobs with the same key go in the order they were submitted
+int goesBefore(struct queuedJob *first, struct queuedJob *second) {
+    return first->key < second->key || (first->key == second->key && first->id < second->id);
+}
+
+// Move a new job up the heap until its parent goes before it
+void siftUp(struct scheduler *scheduler, int index) {
+    struct queuedJob **heap = scheduler->heap;
+    while (index > 0 && goesBefore(heap[index], heap[(index - 1) / 2])) {
+        struct queuedJob *swap = heap[index];
+        heap[index] = heap[(index - 1) / 2];
+        heap[(index - 1) / 2] = swap;
+        index = (index - 1) / 2;
+    }
+}
+
+// Move a job down the heap until both of its children go after it
+void siftDown(struct scheduler *scheduler, int index) {
+    struct queuedJob **heap = scheduler->heap;
+    while (1) {
+        int smallest = index;
+        int left = 2 * index + 1, right = 2 * index + 2;
+        if (left < scheduler->count && goesBefore(heap[left], heap[smallest])) {
+            smallest = left;
+        }
+        if (right < scheduler->count && goesBefore(heap[right], heap[smallest])) {
+            smallest = right;
+        }
+        if (smallest == index) {
+            return;
+        }
+        struct queuedJob *swap = heap[index];
+        heap[index] = heap[smallest];
+        heap[smallest] = swap;
+        index = smallest;
+    }
+}
+
+// Tick while jobs are waiting, since the load can drop without any of our jobs finishing
+void startSchedulerTimer(struct scheduler *scheduler) {
+    if (scheduler->timerArmed) {
+        return;
+    }
+    struct itimerspec timer;
+    timer.it_interval.tv_sec = SCHEDULER_TICK / 1000000000;
+    timer.it_interval.tv_nsec = SCHEDULER_TICK % 1000000000;
+    timer.it_value = timer.it_interval;
+    timerfd_settime(scheduler->timerFd, 0, &timer, NULL);
+    scheduler->timerArmed = TRUE;
+}
+
+// Stop ticking once the queue is empty
+void stopSchedulerTimer(struct scheduler *scheduler) {
+    if (!scheduler->timerArmed) {
+        return;
+    }
+    struct itimerspec timer;
+    memset(&timer, 0, sizeof(timer));
+    timerfd_settime(scheduler->timerFd, 0, &timer, NULL);
+    scheduler->timerArmed = FALSE;
+}
+
+// Read the 10 second "some" average from a PSI file
+// Returns -1 if the kernel doesn't have it
+double readPressure(char* fileName) {
+    double pressure = -1;
+    FILE* file = fopen(fileName, "re");
+    if (file == NULL) {
+        return -1;
+    }
+    if (fscanf(file, "some avg10=%lf", &pressure) != 1) {
+        pressure = -1;
+    }
+    fclose(file);
+    return pressure;
+}
+
+// Take a snapshot of the CPUs we can use, the run queue, the pressure and the free memory
+// Anything that can't be read is left looking idle, so it never holds jobs back
+void readSystemLoad(struct systemLoad *load) {
+    cpu_set_t cpus;
+    char line[256];
+
+    memset(load, 0, sizeof(struct systemLoad));
+    load->cores = (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) ? CPU_COUNT(&cpus) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (load->cores < 1) {
+        load->cores = 1;
+    }
+
+    // The fourth field is the number of runnable tasks, which counts us too
+    FILE* file = fopen("/proc/loadavg", "re");
+    if (file != NULL) {
+        if (fscanf(file, "%lf %*f %*f %i/", &load->load, &load->runnable) != 2) {
+            load->runnable = 1;
+        }
+        fclose(file);
+    }
+    if (load->runnable > 0) {
+        load->runnable--;
+    }
+
+    load->cpuPressure = readPressure("/proc/pressure/cpu");
+    load->memoryPressure = readPressure("/proc/pressure/memory");
+
+    file = fopen("/proc/meminfo", "re");
+    if (file != NULL) {
+        while (fgets(line, sizeof(line), file) != NULL) {
+            sscanf(line, "MemTotal: %lli", &load->totalMemory);
+            sscanf(line, "MemAvailable: %lli", &load->availableMemory);
+        }
+        fclose(file);
+    }
+}
+
+// Decide whether one more job can start, given how many of our jobs are running and how many
+// have been started since the load was read
+// With none running a job always starts, so the queue can't get stuck behind someone else's load
+int admitJob(struct systemLoad *load, int running, int admitted) {
+    if (running == 0) {
+        return TRUE;
+    }
+    if (load->totalMemory > 0 && load->availableMemory * 100 < load->totalMemory * SCHEDULER_MEMORY_RESERVE) {
+        return FALSE;
+    }
+    if (load->memoryPressure > SCHEDULER_MEMORY_PRESSURE || load->cpuPressure > SCHEDULER_CPU_PRESSURE) {
+        return FALSE;
+    }
+    return load->runnable + admitted < load->cores;
+}
+
+// Queued jobs are listed in the order they will start
+int compareQueuedJobs(const void* first, const void* second) {
+    struct queuedJob *a = *(struct queuedJob**) first;
+    struct queuedJob *b = *(struct queuedJob**) second;
+    return goesBefore(a, b) ? -1 : goesBefore(b, a);
+}
+
+// Print the waiting jobs, next one first, and what the machine looks like to the scheduler
+void printQueuedJobs(struct scheduler *scheduler) {
+    struct systemLoad load;
+    struct timespec now;
+
+    if (scheduler->count == 0) {
+        return;
+    }
+    struct queuedJob **sorted = malloc(scheduler->count * sizeof(struct queuedJob*));
+    memcpy(sorted, scheduler->heap, scheduler->count * sizeof(struct queuedJob*));
+    qsort(sorted, scheduler->count, sizeof(struct queuedJob*), compareQueuedJobs);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = 0; i < scheduler->count; i++) {
+        struct queuedJob *queued = sorted[i];
+        printf("[q%li] queued %.1fs nice %i", queued->id, computeTimeDifference(queued->submitTime, now) / 1e9, queued->nice);
+        for (int j = 0; queued->arguments[j] != NULL; j++) {
+            printf(" %s", queued->arguments[j]);
+        }
+        printf("\n");
+    }
+    free(sorted);
+
+    readSystemLoad(&load);
+    printf("Load %.2f, %i runnable on %i cores", load.load, load.runnable, load.cores);
+    if (load.cpuPressure >= 0) {
+        printf(", CPU pressure %.1f%%, memory pressure %.1f%%", load.cpuPressure, load.memoryPressure);
+    }
+    if (load.totalMemory > 0) {
+        printf(", %lli%% of memory available", load.availableMemory * 100 / load.totalMemory);
+    }
+    printf("\n");
+}
+
+// Pull a "nice [-n adjustment]" prefix off the command, like nice(1)
+// Returns the number of arguments to skip, or -1 after printing the usage
+int parseNicePrefix(char** arguments, int* nice) {
+    char* end;
+    int i = 1;
+
+    *nice = 0;
+    if (arguments[0] == NULL || strcmp(arguments[0], "nice") != 0) {
+        return 0;
+    }
+
+    *nice = SCHEDULER_DEFAULT_NICE;
+    int valid = TRUE;
+    if (arguments[i] != NULL && strcmp(arguments[i], "-n") == 0) {
+        valid = (arguments[i + 1] != NULL);
+        if (valid) {
+            *nice = strtol(arguments[i + 1], &end, 10);
+            valid = (end != arguments[i + 1] && *end == '\0');
+        }
+        i += 2;
+    }
+    if (!valid || arguments[i] == NULL) {
+        printf("Usage: nice [-n adjustment] command [arguments...]\n");
+        return -1;
+    }
+
+    // Clamp it the way the kernel would
+    if (*nice < -20) {
+        *nice = -20;
+    } else if (*nice > 19) {
+        *nice = 19;
+    }
+    return i;
+}
@@ -0,0 +1,69 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <time.h>
+
+#include "timeout.h"
+#include "placement.h"
+
+// The niceness "nice command" runs with, like nice(1)
+#define SCHEDULER_DEFAULT_NICE 10
+
+// How often the queue is looked at again while jobs are waiting
+#define SCHEDULER_TICK 250000000LL
+
+// Each level of niceness counts as this much extra waiting, so nice jobs go later but still go
+#define SCHEDULER_AGING 1000000000LL
+
+// Jobs wait while less than this percentage of memory is available
+#define SCHEDULER_MEMORY_RESERVE 10
+
+// Jobs wait while the 10 second PSI "some" averages are above these percentages
+#define SCHEDULER_CPU_PRESSURE 50.0
+#define SCHEDULER_MEMORY_PRESSURE 10.0
+
+// A background job waiting for its turn, with its arguments copied out of the input line
+struct queuedJob {
+    long id;
+    int nice;
+    long long key;
+    struct timespec submitTime;
+    char** arguments;
+    int argumentCount;
+    struct deadline deadline;
+    struct placement placement;
+};
+
+// A priority queue of waiting jobs, smallest key first, and the timer that says when to look again
+struct scheduler {
+    struct queuedJob **heap;
+    int count;
+    int capacity;
+    long nextId;
+    int timerFd;
+    int timerArmed;
+};
+
+// What the machine is doing, the pressure values are -1 when the kernel doesn't have PSI
+struct systemLoad {
+    int cores;
+    double load;
+    int runnable;
+    double cpuPressure;
+    double memoryPressure;
+    long long availableMemory;
+    long long totalMemory;
+};
+
+int initScheduler(struct scheduler *scheduler);
+struct queuedJob* enqueueJob(struct scheduler *scheduler, char** arguments, int argumentCount, int nice, struct placement *placement, struct deadline *deadline);
+struct queuedJob* dequeueJob(struct scheduler *scheduler);
+void freeQueuedJob(struct queuedJob *queued);
+void startSchedulerTimer(struct scheduler *scheduler);
+void stopSchedulerTimer(struct scheduler *scheduler);
+void readSystemLoad(struct systemLoad *load);
+int admitJob(struct systemLoad *load, int running, int admitted);
+void printQueuedJobs(struct scheduler *scheduler);
+int parseNicePrefix(char** arguments, int* nice);
+
+#endif
@@ -0,0 +1,572 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include "server.h"
+#include "timeout.h"
+
+#define TRUE 1
+#define FALSE 0
+
+extern char **environ;
+
+// A pre-forked helper, idle until it is handed a connection, then waiting for the client's request,
+// and then the command it ran
+struct serverHelper {
+    int pid;
+    int controlFd;
+    int connectionFd;
+};
+
+// Every helper and what the server is waiting on
+struct serverState {
+    int listenFd;
+    int signalFd;
+    struct serverHelper *helpers;
+    int helperCount;
+    int helperCapacity;
+    int idleTarget;
+    int idleCount;
+};
+
+int startHelper(struct serverState *server);
+void runHelper(int controlFd);
+void assignConnection(struct serverState *server, int connectionFd);
+int trustedPeer(int connectionFd);
+void reapHelpers(struct serverState *server);
+int sendFd(int socketFd, int fd);
+int receiveFds(int socketFd, void* buffer, size_t length, int* fds, int maxFds);
+int readFully(int fd, void* buffer, size_t length);
+int writeFully(int fd, void* buffer, size_t length);
+
+// Listen on the socket and run the commands clients send, keeping helperCount helpers forked ahead of time
+// Runs until SIGINT, SIGTERM or SIGHUP, and returns 1 if the server couldn't start
+int runServer(char* socketPath, int helperCount) {
+    struct serverState server;
+    struct sockaddr_un address;
+    sigset_t mask;
+
+    memset(&server, 0, sizeof(server));
+    server.idleTarget = helperCount;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        printf("The socket path is too long!\n");
+        return 1;
+    }
+    strcpy(address.sun_path, socketPath);
+
+    // A socket left behind by a server that was killed would stop us binding
+    unlink(socketPath);
+    server.listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    // Commands run as us, so only we may connect, from the moment the socket exists
+    mode_t oldMask = umask(0077);
+    int bound = (server.listenFd != -1 && bind(server.listenFd, (struct sockaddr*) &address, sizeof(address)) == 0);
+    umask(oldMask);
+    if (!bound || chmod(socketPath, 0600) == -1 || listen(server.listenFd, 128) == -1) {
+        printf("Unable to listen on %s!\nError Number: %i\nError Message: %s\n", socketPath, errno, strerror(errno));
+        return 1;
+    }
+
+    // Helpers exiting and requests to stop all arrive through one signalfd
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    server.signalFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (server.signalFd == -1) {
+        printf("Unable to set up signal handling!\nError Number: %i\nError Message: %s\n", errno, strerror(errno));
+        unlink(socketPath);
+        return 1;
+    }
+
+    // A client that hangs up early shouldn't take the server with it
+    signal(SIGPIPE, SIG_IGN);
+
+    while (server.idleCount < server.idleTarget && startHelper(&server) != -1) {
+    }
+    printf("Listening on %s with %i helpers.\n", socketPath, server.idleCount);
+    fflush(stdout);
+
+    // Requests go straight from the client to its helper, so the server only wakes up
+    // for new connections and for commands that finish
+    int running = TRUE;
+    while (running) {
+        struct pollfd fds[2] = {{server.listenFd, POLLIN, 0}, {server.signalFd, POLLIN, 0}};
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            while (read(server.signalFd, &info, sizeof(info)) == sizeof(info)) {
+                if (info.ssi_signo != SIGCHLD) {
+                    running = FALSE;
+                }
+            }
+            reapHelpers(&server);
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int connectionFd = accept4(server.listenFd, NULL, NULL, SOCK_CLOEXEC);
+            if (connectionFd != -1 && trustedPeer(connectionFd)) {
+                assignConnection(&server, connectionFd);
+            } else if (connectionFd != -1) {
+                close(connectionFd);
+            }
+        }
+
+        // Replace the helpers that were used, now that their clients are on their way
+        while (server.idleCount < server.idleTarget && startHelper(&server) != -1) {
+        }
+    }
+
+    // Idle helpers exit once their control socket closes, running commands are left to finish
+    unlink(socketPath);
+    for (int i = 0; i < server.helperCount; i++) {
+        close(server.helpers[i].controlFd);
+        if (server.helpers[i].connectionFd != -1) {
+            close(server.helpers[i].connectionFd);
+        }
+    }
+    close(server.listenFd);
+    close(server.signalFd);
+    free(server.helpers);
+    printf("Server stopped.\n");
+    return 0;
+}
+
+// Fork a helper that waits on a socketpair to be handed a connection
+// Returns -1 if the fork failed
+int startHelper(struct serverState *server) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) == -1) {
+        return -1;
+    }
+
+    int pid = fork();
+    if (pid == -1) {
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        // Only the helper's own control socket is any use to it
+        close(pair[0]);
+        close(server->listenFd);
+        close(server->signalFd);
+        for (int i = 0; i < server->helperCount; i++) {
+            close(server->helpers[i].controlFd);
+            if (server->helpers[i].connectionFd != -1) {
+                close(server->helpers[i].connectionFd);
+            }
+        }
+        runHelper(pair[1]);
+    }
+
+    close(pair[1]);
+    if (server->helperCount == server->helperCapacity) {
+        server->helperCapacity = (server->helperCapacity == 0) ? 16 : server->helperCapacity * 2;
+        server->helpers = realloc(server->helpers, server->helperCapacity * sizeof(struct serverHelper));
+    }
+    struct serverHelper *helper = &server->helpers[server->helperCount++];
+    helper->pid = pid;
+    helper->controlFd = pair[0];
+    helper->connectionFd = -1;
+    server->idleCount++;
+    return 0;
+}
+
+// The helper side: wait for a connection, read the request from it, and become the command
+// The fork has already happened, so all that is left on the client's path is reading the request and exec
+// If exec fails the error goes back to the server on the control socket
+void runHelper(int controlFd) {
+    int connectionFd, error = EPROTO;
+    int fds[3] = {-1, -1, -1};
+    struct serverRequest request;
+    char byte;
+
+    // The server closing the control socket means it is shutting down
+    if (receiveFds(controlFd, &byte, 1, &connectionFd, 1) != 1) {
+        _exit(0);
+    }
+
+    // So does the client closing the connection instead of sending another command
+    int received = receiveFds(connectionFd, &request, sizeof(request), fds, 3);
+    if (received == -1) {
+        _exit(0);
+    }
+
+    // Every string takes at least its NUL, so counts the length can't hold are a broken request,
+    // and checking them here keeps the sizes below from wrapping
+    size_t stringCount = (size_t) request.argumentCount + request.environmentCount;
+    char* strings = NULL;
+    char** arguments = NULL;
+    if (received == 3 && request.magic == SERVER_MAGIC && request.length > 0 && stringCount < request.length) {
+        strings = malloc((size_t) request.length + 1);
+        arguments = malloc((stringCount + 2) * sizeof(char*));
+    }
+    if (strings != NULL && arguments != NULL) {
+        char** environment = arguments + request.argumentCount + 1;
+
+        if (readFully(connectionFd, strings, request.length) == 0) {
+            // The working directory, then the arguments and the environment, each NUL terminated
+            strings[request.length] = '\0';
+            char* current = strings + strlen(strings) + 1;
+            char* end = strings + request.length;
+            size_t found = 0;
+            for (; found < stringCount && current < end; found++) {
+                arguments[found + (found >= request.argumentCount)] = current;
+                current += strlen(current) + 1;
+            }
+            arguments[request.argumentCount] = NULL;
+            environment[request.environmentCount] = NULL;
+
+            // Tell the client which PID to signal if its deadline passes
+            if (request.flags & SERVER_SEND_PID) {
+                struct serverReply reply;
+                memset(&reply, 0, sizeof(reply));
+                reply.pid = getpid();
+                writeFully(connectionFd, &reply, sizeof(reply));
+            }
+
+            // Move the client's descriptors out of the way before putting them in place
+            for (int i = 0; i < 3; i++) {
+                fds[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, 3);
+            }
+            for (int i = 0; i < 3; i++) {
+                dup2(fds[i], i);
+            }
+            close(connectionFd);
+
+            // Put back what the server changed, so the command starts like any other child
+            sigset_t emptyMask;
+            sigemptyset(&emptyMask);
+            signal(SIGPIPE, SIG_DFL);
+            sigprocmask(SIG_SETMASK, &emptyMask, NULL);
+
+            if (found == stringCount && request.argumentCount > 0 && chdir(strings) == 0) {
+                environ = environment;
+                execvp(arguments[0], arguments);
+            }
+            error = (found == stringCount && request.argumentCount > 0) ? errno : EPROTO;
+        }
+    }
+
+    write(controlFd, &error, sizeof(error));
+    _exit(127);
+}
+
+// Check that the client is running as the same user as the server, in case the socket's permissions were changed
+// Returns TRUE if its commands may be run
+int trustedPeer(int connectionFd) {
+    struct ucred credentials;
+    socklen_t length = sizeof(credentials);
+
+    if (getsockopt(connectionFd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == -1) {
+        return FALSE;
+    }
+    return credentials.uid == getuid();
+}
+
+// Hand a connection to an idle helper, which sleeps until the client sends its next command
+void assignConnection(struct serverState *server, int connectionFd) {
+    // Every helper is busy, so this command pays for its own fork
+    if (server->idleCount == 0 && startHelper(server) == -1) {
+        struct serverReply reply;
+        memset(&reply, 0, sizeof(reply));
+        reply.finished = TRUE;
+        reply.error = errno;
+        send(connectionFd, &reply, sizeof(reply), MSG_NOSIGNAL);
+        close(connectionFd);
+        return;
+    }
+
+    struct serverHelper *helper = server->helpers;
+    while (helper->connectionFd != -1) {
+        helper++;
+    }
+    if (sendFd(helper->controlFd, connectionFd) == -1) {
+        close(connectionFd);
+        return;
+    }
+    helper->connectionFd = connectionFd;
+    server->idleCount--;
+}
+
+// Reap every helper that has exited and send its client the status and statistics
+// The connection then goes to another helper, since the client may send another command
+void reapHelpers(struct serverState *server) {
+    int status, pid;
+    struct rusage stats;
+
+    while ((pid = wait4(-1, &status, WNOHANG, &stats)) > 0) {
+        int index = 0;
+        while (index < server->helperCount && server->helpers[index].pid != pid) {
+            index++;
+        }
+        if (index == server->helperCount) {
+            continue;
+        }
+        struct serverHelper helper = server->helpers[index];
+        server->helpers[index] = server->helpers[--server->helperCount];
+
+        if (helper.connectionFd == -1) {
+            // An idle helper died on its own
+            server->idleCount--;
+            close(helper.controlFd);
+            continue;
+        }
+
+        struct serverReply reply;
+        memset(&reply, 0, sizeof(reply));
+        reply.pid = pid;
+        reply.finished = TRUE;
+        reply.status = status;
+        reply.stats = stats;
+
+        // The helper only writes to the control socket if exec failed
+        int error;
+        if (recv(helper.controlFd, &error, sizeof(error), MSG_DONTWAIT) == sizeof(error)) {
+            reply.error = error;
+        }
+        close(helper.controlFd);
+
+        // Sending fails if the client hung up, which is also why a helper exits without running anything
+        if (send(helper.connectionFd, &reply, sizeof(reply), MSG_NOSIGNAL) == sizeof(reply)) {
+            assignConnection(server, helper.connectionFd);
+        } else {
+            close(helper.connectionFd);
+        }
+    }
+}
+
+// Connect to a running server
+// Returns the connected socket, or -1 after printing an error
+int connectServer(char* socketPath) {
+    struct sockaddr_un address;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath, sizeof(address.sun_path) - 1);
+
+    int serverFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (serverFd == -1 || connect(serverFd, (struct sockaddr*) &address, sizeof(address)) == -1) {
+        printf("Unable to connect to %s!\nError Number: %i\nError Message: %s\n", socketPath, errno, strerror(errno));
+        if (serverFd != -1) {
+            close(serverFd);
+        }
+        return -1;
+    }
+    return serverFd;
+}
+
+// Have the server run a command with our working directory, environment and the given stdin, stdout and stderr
+// The deadline is enforced from here by signalling the PID the server sends back
+// Returns -1 if the server couldn't be reached, otherwise reply has the status and statistics
+int submitCommand(int serverFd, char** arguments, int fds[3], struct deadline *deadline, struct serverReply *reply) {
+    struct serverRequest request;
+    char* directory = getcwd(NULL, 0);
+    size_t length = strlen(directory) + 1;
+
+    // Lay out every string back to back, so the request is a single write
+    memset(&request, 0, sizeof(request));
+    request.magic = SERVER_MAGIC;
+    for (int i = 0; arguments[i] != NULL; i++) {
+        length += strlen(arguments[i]) + 1;
+        request.argumentCount++;
+    }
+    for (int i = 0; environ[i] != NULL; i++) {
+        length += strlen(environ[i]) + 1;
+        request.environmentCount++;
+    }
+    request.length = length;
+    request.flags = deadline->armed ? SERVER_SEND_PID : 0;
+
+    char* strings = malloc(length);
+    char* current = stpcpy(strings, directory) + 1;
+    for (int i = 0; arguments[i] != NULL; i++) {
+        current = stpcpy(current, arguments[i]) + 1;
+    }
+    for (int i = 0; environ[i] != NULL; i++) {
+        current = stpcpy(current, environ[i]) + 1;
+    }
+    free(directory);
+
+    // The descriptors travel with the first byte of the request
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec parts[2] = {{&request, sizeof(request)}, {strings, length}};
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    memset(control, 0, sizeof(control));
+    message.msg_iov = parts;
+    message.msg_iovlen = 2;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(3 * sizeof(int));
+    memcpy(CMSG_DATA(header), fds, 3 * sizeof(int));
+
+    ssize_t sent = sendmsg(serverFd, &message, MSG_NOSIGNAL);
+    int result = -1;
+    if (sent >= (ssize_t) sizeof(request) && writeFully(serverFd, strings + (sent - sizeof(request)), length - (sent - sizeof(request))) == 0) {
+        result = readFully(serverFd, reply, sizeof(struct serverReply));
+    }
+    free(strings);
+    if (result == -1) {
+        return -1;
+    }
+
+    // Sleep until the final reply comes, signalling the command if it runs past its deadline
+    int timerFd = (deadline->armed && !reply->finished) ? openDeadlineTimer() : -1;
+    while (timerFd != -1) {
+        struct pollfd pollFds[2] = {{serverFd, POLLIN, 0}, {timerFd, POLLIN, 0}};
+
+        setDeadlineTimer(timerFd, deadline->armed ? &deadline->expires : NULL);
+        if (poll(pollFds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (pollFds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            break;
+        }
+
+        struct timespec now;
+        unsigned long long expirations;
+        read(timerFd, &expirations, sizeof(expirations));
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        // A stopped command has to be continued to act on SIGTERM
+        int signalNumber = nextDeadlineSignal(deadline, now);
+        if (signalNumber != 0) {
+            kill(reply->pid, signalNumber);
+            if (signalNumber == SIGTERM) {
+                kill(reply->pid, SIGCONT);
+            }
+        }
+    }
+    if (timerFd != -1) {
+        close(timerFd);
+    }
+
+    if (!reply->finished && readFully(serverFd, reply, sizeof(struct serverReply)) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+// Send a descriptor over a Unix socket
+int sendFd(int socketFd, int fd) {
+    char byte = 0;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec part = {&byte, 1};
+    struct msghdr message;
+
+    memset(&message, 0, sizeof(message));
+    memset(control, 0, sizeof(control));
+    message.msg_iov = &part;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &fd, sizeof(int));
+
+    return (sendmsg(socketFd, &message, MSG_NOSIGNAL) == 1) ? 0 : -1;
+}
+
+// Read exactly length bytes and the descriptors that came with them, which are close-on-exec
+// Returns how many descriptors were received, or -1 if the socket closed first
+int receiveFds(int socketFd, void* buffer, size_t length, int* fds, int maxFds) {
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec part = {buffer, length};
+    struct msghdr message;
+    ssize_t received;
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &part;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE(maxFds * sizeof(int));
+
+    while ((received = recvmsg(socketFd, &message, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR) {
+    }
+    if (received <= 0) {
+        return -1;
+    }
+
+    int count = 0;
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    if (header != NULL && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+        count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(header), count * sizeof(int));
+    }
+
+    // The rest of a stream message can arrive separately
+    if ((size_t) received < length && readFully(socketFd, (char*) buffer + received, length - received) == -1) {
+        return -1;
+    }
+    return count;
+}
+
+// Read exactly length bytes
+// Returns -1 if the descriptor closed or failed first
+int readFully(int fd, void* buffer, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t count = read(fd, (char*) buffer + done, length - done);
+        if (count == -1 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return -1;
+        }
+        done += count;
+    }
+    return 0;
+}
+
+// Write exactly length bytes
+// Returns -1 if the write failed
+int writeFully(int fd, void* buffer, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t count = send(fd, (char*) buffer + done, length - done, MSG_NOSIGNAL);
+        if (count == -1 && errno == EINTR) {
+            continue;
+        }
+        if (count == -1) {
+            return -1;
+        }
+        done += count;
+    }
+    return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdint.h>
+#include <sys/resource.h>
+
+#include "timeout.h"
+
+#define SERVER_MAGIC 0x52434d31
+#define SERVER_DEFAULT_HELPERS 4
+
+// Request flags
+// The client only needs to hear that its command started if it has a deadline to enforce
+#define SERVER_SEND_PID 1
+
+// Sent by the client, followed by the working directory, the arguments and the environment as
+// NUL terminated strings, with the client's stdin, stdout and stderr attached
+struct serverRequest {
+    uint32_t magic;
+    uint32_t argumentCount;
+    uint32_t environmentCount;
+    uint32_t length;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+// Sent back once the command has been reaped, and first once it has started if the client asked for its PID
+struct serverReply {
+    int32_t pid;
+    int32_t finished;
+    int32_t status;
+    int32_t error;
+    struct rusage stats;
+};
+
+int runServer(char* socketPath, int helperCount);
+int connectServer(char* socketPath);
+int submitCommand(int serverFd, char** arguments, int fds[3], struct deadline *deadline, struct serverReply *reply);
+
+#endif
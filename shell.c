@@ -8,69 +8,78 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <errno.h>
+#include <signal.h>
+#include <time.h>
 
-long computeTimeDifference(struct timeval beforeTime, struct timeval afterTime);
-void printChildStatistics(struct rusage childStats, struct rusage prevStats, int usePrevStats, struct timeval beforeTime, struct timeval afterTime);
+#include "launch.h"
+#include "perf.h"
+#include "pathcache.h"
+#include "stats.h"
+#include "input.h"
+#include "timeout.h"
 
 int main(int argc, char* argv[]) {
-    struct rusage prevStats;
-    int prevStatsInitialized = 0;
+    int perf = 0;
+
+    // The only option is --perf, which attaches hardware counters to every command
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--perf") == 0) {
+            perf = 1;
+        } else {
+            printf("Usage: %s [--perf]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    // Cache of command name to absolute path lookups
+    struct commandHash commandHash;
+    initCommandHash(&commandHash);
+
+    // Statistics go to stdout unless STATS_FORMAT, STATS_FILE or STATS_FD say otherwise
+    struct statsOutput statsOutput;
+    if (openStatsOutput(&statsOutput, NULL, NULL, -1, 1) == -1) {
+        exit(1);
+    }
+    statsOutput.perf = perf;
+
+    // Commands are read in large blocks, or mapped if stdin is a file
+    struct inputReader input;
+    if (initInputReader(&input, STDIN_FILENO) == -1) {
+        perror("initInputReader");
+        exit(1);
+    }
 
     while (1) {
-        printf("-> ");
+        // Push out buffered statistics before waiting on the user
+        flushStatsOutput(&statsOutput);
 
-        char userInput[129];
+        printf("-> ");
+        fflush(stdout);
 
-        // If fgets returns NULL, then we reached the end of file
-        if (fgets(userInput, 129, stdin) == NULL) {
+        // If readLine returns NULL, then we reached the end of file
+        char* userInput = readLine(&input);
+        if (userInput == NULL) {
             printf("\n");
             exit(0);
         }
 
-        if (strlen(userInput) == 1 && userInput[strlen(userInput) - 1] == '\n') {
+        // Split the line in place, there is no limit on its length or the number of arguments
+        int argumentCount;
+        char** arguments = splitArguments(&input, userInput, &argumentCount);
+
+        if (argumentCount == 0) {
             // No command specified, so print an error and exit
             printf("You must specify the command to run!\n");
             continue;
         }
 
-        // If the last user input character isn't a new line then:
-        // - The string is more than 128 characters, or
-        // - We reached the end of file
-        if (userInput[strlen(userInput)-1] != '\n') {
-            int tooLong = 0;
-            char nextChar;
-
-            // Loop until we reach the end of line or end of file
-            while (((nextChar = getchar()) != '\n') && (nextChar != EOF)) {
-                tooLong = 1;
-            }
-
-            // Check to see if the end of line was reached
-            // If so, print an error and ask for new user input
-            if (tooLong) {
-                printf("Commands must be 128 characters or less!\n");
-                continue;
-            }
-        }
-
-        // Replace the new line character with a null terminator
-        userInput[strlen(userInput)-1] = '\0';
-
-        char* arguments[33];
-        char* argument = strtok(userInput, " \n");
-        int i;
-
-        // Read in the arguments using strtok()
-        for (i = 0; i < 33; i++) {
-            arguments[i] = argument;
-            argument = strtok(NULL, " \n");
-        }
-
-        if (arguments[32] != NULL) {
-            // There are too many arguments provided
-            printf("You are only allowed to use 32 arguments!\n");
+        // A "timeout duration" prefix puts a deadline on the command that follows it
+        struct deadline deadline;
+        int skipped = parseTimeoutPrefix(arguments, &deadline);
+        if (skipped == -1) {
             continue;
         }
+        arguments += skipped;
 
         // Extract the command name and the list of arguments
         char* commandName = arguments[0];
@@ -81,108 +90,65 @@ int main(int argc, char* argv[]) {
             exit(0);   
         }
 
+        // If the user typed the hash command, show or update the command path cache
+        if (strcmp(commandName, "hash") == 0) {
+            runHashBuiltin(&commandHash, arguments);
+            continue;
+        }
+
         // If the user typed the cd command, switch to the specified directory
         if (strcmp(commandName, "cd") == 0) {
             chdir(arguments[1]);
             continue;
         }
 
-        // Fork a child process and get its PID
-        int pid = fork();
-
-        // Determine whether we are in the parent or child process
-        if (pid != 0) {
-            // We are in the parent process
-            int status;
-            struct timeval beforeTime, afterTime;
+        int status;
+        struct timespec beforeTime, afterTime;
+        struct rusage childStats;
 
-            // Get the time information before running the command
-            gettimeofday(&beforeTime, NULL);
+        // Get the time information before starting the command, so launching it is counted too
+        clock_gettime(CLOCK_MONOTONIC, &beforeTime);
 
-            // Wait for the child to finish running the command
-            waitpid(pid, &status, 0);
+        // Start the command in a child process and get its PID
+        struct launchOptions options;
+        struct perfCounters counters;
+        initLaunchOptions(&options);
+        options.path = lookupCommand(&commandHash, commandName);
+        options.hold = perf;
+        int pid = launchCommand(commandName, arguments, &options);
 
-            // If the child terminated normally, print the statistics
-            if (WEXITSTATUS(status) == 0) {
-                // Get the time right after the child process finished
-                gettimeofday(&afterTime, NULL);
+        // Drop the cached path if the command wasn't there anymore
+        if (options.pathStale) {
+            forgetCommand(&commandHash, commandName);
+        }
 
-                // Get the statistics of the child process that just finished
-                struct rusage childStats;
-                getrusage(RUSAGE_CHILDREN, &childStats);
+        // Check if the command failed to start
+        if (pid == -1) {
+            continue;
+        }
 
-                // Print the statistics
-                printChildStatistics(childStats, prevStats, prevStatsInitialized, beforeTime, afterTime);
+        // Attach the counters while the child is held, so they start counting at exec
+        if (perf) {
+            openPerfCounters(&counters, pid);
+            releaseCommand(&options);
+        }
 
-                // Save the old stats into prevStats
-                prevStats = childStats;
+        // Wait for the child to finish running the command, collecting its own statistics
+        startDeadline(&deadline, beforeTime);
+        waitWithDeadline(pid, &deadline, &status, &childStats);
 
-                prevStatsInitialized = 1;
-            }
+        // Get the time right after the child process finished
+        clock_gettime(CLOCK_MONOTONIC, &afterTime);
 
-        } else {
-            // We are in the child process
-            // Run the command and get its result
-            int result = execvp(commandName, arguments);
-
-            // Check if the command failed
-            if (result == -1) {
-                // The command failed, so print out he error number and exit
-                printf("Invalid command!\nError Number: %i\nError Message: %s\n", errno, strerror(errno));
-                exit(1);
-            }
+        // Print the statistics, even if the command failed or was killed
+        struct commandRecord record = {.pid = pid, .command = commandName, .arguments = arguments, .status = status, .stats = childStats, .startTime = beforeTime, .endTime = afterTime, .timedOut = deadline.timedOut, .node = -1};
+        struct perfCounts counts;
+        if (perf) {
+            readPerfCounters(&counters, &counts);
+            closePerfCounters(&counters);
+            record.perf = &counts;
         }
+        writeStatsRecord(&statsOutput, &record);
     }
     return 0;
 }
-
-// Compute the difference between the two specified timevals
-long computeTimeDifference(struct timeval beforeTime, struct timeval afterTime) {
-    // Get the seconds difference and convert to microseconds
-    long difference = (long) ((afterTime.tv_sec - beforeTime.tv_sec) * 1000000);
-
-    // Get the microseconds difference
-    long microDifference = (long) (afterTime.tv_usec - beforeTime.tv_usec);
-
-    // Correct the difference when the after microseconds > before microseconds
-    if (microDifference < 0) {
-        microDifference += 1000000;
-    }
-
-    // Add the corrected microsecond difference to the total
-    difference += microDifference;
-
-    // Convert to milliseconds and return the result
-    return (difference / 1000);
-}
-
-// Print the statistics about the child process with the given rusage data
-void printChildStatistics(struct rusage childStats, struct rusage prevStats, int usePrevStats, struct timeval beforeTime, struct timeval afterTime) {
-    long difference, userCPUTime, sysCPUTime, volContext, involContext, pageFaults, unrecPageFaults;
-    difference = computeTimeDifference(beforeTime, afterTime);
-    if (usePrevStats) {
-        userCPUTime = ((childStats.ru_utime.tv_sec - prevStats.ru_utime.tv_sec) * 1000) + ((childStats.ru_utime.tv_usec - prevStats.ru_utime.tv_usec) / 1000);
-        sysCPUTime = ((childStats.ru_stime.tv_sec - prevStats.ru_stime.tv_sec) * 1000) + ((childStats.ru_stime.tv_usec - prevStats.ru_stime.tv_usec) / 1000);
-        volContext = childStats.ru_nvcsw - prevStats.ru_nvcsw;
-        involContext = childStats.ru_nivcsw - prevStats.ru_nivcsw;
-        pageFaults = childStats.ru_majflt - prevStats.ru_majflt;
-        unrecPageFaults = childStats.ru_minflt - prevStats.ru_minflt;
-    } else {
-        userCPUTime = (childStats.ru_utime.tv_sec * 1000) + (childStats.ru_utime.tv_usec / 1000);
-        sysCPUTime = (childStats.ru_stime.tv_sec * 1000) + (childStats.ru_stime.tv_usec / 1000);
-        volContext = childStats.ru_nvcsw;
-        involContext = childStats.ru_nivcsw;
-        pageFaults = childStats.ru_majflt;
-        unrecPageFaults = childStats.ru_minflt;
-    }
-
-    printf("\n***********************************************************************\n");
-    printf("Wall-Clock time: %li milliseconds\n", difference);
-    printf("User CPU time: %li milliseconds\n", userCPUTime);
-    printf("System CPU time: %li milliseconds\n", sysCPUTime);
-    printf("Voluntary context switches: %li\n", volContext);
-    printf("Involuntary context switches: %li\n", involContext);
-    printf("Page faults: %li\n", pageFaults);
-    printf("Page faults that could be satisfied with unreclaimed pages: %li\n", unrecPageFaults);
-    printf("***********************************************************************\n\n");
-}
@@ -1,112 +1,399 @@
+#define _GNU_SOURCE
 #include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <poll.h>
+#include <signal.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
+
+#include "launch.h"
+#include "perf.h"
+#include "cgroup.h"
+#include "input.h"
+#include "history.h"
+#include "timeout.h"
+#include "livestats.h"
+#include "scheduler.h"
+#include "capture.h"
+#include "resultcache.h"
+#include "placement.h"
+#include "pathcache.h"
+#include "stats.h"
 
 #define TRUE 1
 #define FALSE 0
 
-struct job {
+#define INITIAL_JOB_SLOTS 64
+#define SCRIPT_OUTPUT_BUFFER_SIZE 65536
+#define LIVE_DEFAULT_INTERVAL 250000000LL
+
+// A single process of a job, one for each stage of a pipeline
+struct process {
     int pid;
     char* command;
-    struct timeval startTime;
+    char** arguments;
+    int slot;
+    int finished;
+    int stopped;
+    int status;
+    long long stoppedTime;
+    struct rusage stats;
+    struct timespec endTime;
+    struct perfCounters counters;
+    struct perfCounts counts;
+    struct process *hashNext;
 };
 
-struct jobList {
-    struct job *job;
-    struct jobList *nextJob;
+// A job made up of one or more processes, stored in the job table slot matching its job number
+// Time spent stopped is kept separately so it can be left out of the wall-clock times
+struct job {
+    char* command;
+    char* cgroup;
+    struct timespec startTime;
+    struct process *processes;
+    int processCount;
+    int remaining;
+    int pgid;
+    int stopped;
+    int stoppedCount;
+    struct timespec stopTime;
+    long long stoppedTime;
+    int savedModes;
+    struct termios terminalModes;
+    struct deadline deadline;
+    long long queueWait;
+    struct capture *capture;
+    struct cacheEntry *cacheEntry;
+    int cache;
+    struct placement placement;
 };
 
-long computeTimeDifference(struct timeval beforeTime, struct timeval afterTime);
-void printChildStatistics(struct rusage childStats, struct timeval beforeTime, struct timeval afterTime);
-struct jobList* storeBackgroundJob(struct jobList *jobs, int pid, char* command, struct timeval startTime);
-void printBackgroundJobs(struct jobList *jobs, int index);
-void processBackgroundJobs(struct jobList *jobs, struct jobList **firstJob);
-void printJobInfo(struct jobList *current, struct jobList *target, int index);
-void removeBackgroundJob(struct jobList *target, struct jobList **current);
+// Slot-reusing table of background jobs with a PID to process hash
+struct jobTable {
+    struct job *slots;
+    int capacity;
+    int count;
+    int *freeSlots;
+    int freeCount;
+    struct process **pidBuckets;
+    long finishedCount;
+    int stoppedJobs;
+    int deadlineJobs;
+};
 
-int main(int argc, char* argv[]) {
-    struct jobList *backgroundJobs = malloc(sizeof(struct jobList));
+// A parsed command line, with a NULL terminated argument list for each stage
+// The arrays grow to fit the longest command so far and are reused for every command
+struct pipeline {
+    char** stageArguments;
+    char*** stages;
+    int capacity;
+    int stageCount;
+    char* inputFile;
+    char* outputFile;
+    int appendOutput;
+};
 
-    while (1) {
+void writeProcessRecord(struct job *job, struct process *process);
+struct jobTable* createJobTable(int capacity);
+void growJobTable(struct jobTable *jobs);
+void hashJobProcesses(struct jobTable *jobs, int slot);
+int findJobSlot(struct jobTable *jobs, int pid, struct process **process);
+int storeBackgroundJob(struct jobTable *jobs, struct job *job);
+void printBackgroundJobs(struct jobTable *jobs);
+void printJobInfo(struct jobTable *jobs, int slot);
+void printJobStatistics(struct job *job);
+void freeJob(struct job *job);
+int reapChildren(struct jobTable *jobs, struct job *foreground);
+void processBackgroundJobs(struct jobTable *jobs);
+void removeBackgroundJob(struct jobTable *jobs, int slot);
+int parsePipeline(char** arguments, int argumentCount, struct pipeline *pipeline);
+int launchPipeline(struct pipeline *pipeline, struct job *job, struct commandHash *commandHash, int inBackground, int nice, struct placement *placement, struct cacheEntry *cacheEntry);
+void runLimitBuiltin(char** arguments);
+int setupChildSignal();
+void drainChildSignal();
+int waitForChildEvent(int fd);
+void waitForBackgroundJobs(struct jobTable *jobs);
+void waitForJobEvent(struct jobTable *jobs);
+void runWaitBuiltin(struct jobTable *jobs, char** arguments);
+void openJobHistory();
+void setupJobControl(int fd);
+int updateJobState(struct job *job);
+void runForegroundJob(struct jobTable *jobs, struct job *job);
+struct job takeBackgroundJob(struct jobTable *jobs, int slot);
+int findJobArgument(struct jobTable *jobs, char* argument);
+int signalJob(struct job *job, int signalNumber);
+int parseSignal(char* name);
+void runJobControlBuiltin(struct jobTable *jobs, char** arguments);
+long long processWallTime(struct job *job, struct process *process);
+void enforceDeadlines(struct jobTable *jobs, struct job *foreground);
+void recordJobHistory(struct job *job);
+void waitForInput(int fd, void* context);
+void publishLiveJob(struct job *job, int index, struct timespec now);
+void sampleLiveJobs(struct jobTable *jobs, struct job *foreground);
+void removeLiveStats();
+void queueBackgroundJob(char** arguments, int argumentCount, int nice, struct placement *placement, struct deadline *deadline);
+void dispatchQueuedJobs(struct jobTable *jobs);
+void drainCaptures();
+void pauseCapture(struct capture *capture);
+void resumeCapture();
+void runOutputBuiltin(struct jobTable *jobs, char** arguments);
+int replayCachedJob(char** arguments, char* key);
+void finishCachedJob(struct job *job);
 
-        /*****************************
-        * User Prompt and User Input *
-        *****************************/
+// File descriptor that becomes readable whenever a child changes state
+int childSignalFd = -1;
 
-        printf("-> ");
+// Timer armed for the earliest job deadline, polled along with the signalfd
+int deadlineTimerFd = -1;
 
-        char userInput[129];
+// Where the statistics for each finished command get written
+struct statsOutput statsOutput;
 
-        // If fgets returns NULL, then we reached the end of file
-        if (fgets(userInput, 129, stdin) == NULL) {
-            processBackgroundJobs(backgroundJobs, &backgroundJobs);
-            if (!(backgroundJobs->job == NULL && backgroundJobs->nextJob == NULL)) {
-                printf("There are still background jobs that haven't completed.\n");
-                printf("Waiting for them to complete.\n\n");
-                while (!(backgroundJobs->job == NULL && backgroundJobs->nextJob == NULL)) {
-                    processBackgroundJobs(backgroundJobs, &backgroundJobs);
-                }
-            }
-            printf("\n");
-            exit(0);
+// Whether perf counters are attached to every command
+int perfEnabled = FALSE;
+
+// How background jobs are limited and accounted, and the limits they get
+int cgroupMode = CGROUP_OFF;
+struct cgroupLimits jobLimits;
+
+// Every finished job is appended to the history file, unless it couldn't be opened
+struct history history;
+int historyEnabled = FALSE;
+
+// How many background jobs can run at once, or 0 for no limit
+int maxJobs = 0;
+
+// Whether to print prompts and flush after every line, or run a script as fast as possible
+int interactive = TRUE;
+
+// Running jobs are published to shared memory for jobtop, sampled on a timer while anything runs
+struct liveStats liveStats;
+int liveEnabled = FALSE;
+int liveSampleDue = FALSE;
+
+// With --schedule, background jobs wait in a queue until the load leaves room for them
+struct scheduler scheduler;
+int schedulingEnabled = FALSE;
+int scheduleDue = FALSE;
+
+// With --capture, each background job's output is collected and printed in one piece when it finishes
+// The pipes it is read from are in an epoll set, polled along with the signalfd
+struct captureSettings captureSettings = {CAPTURE_DEFAULT_LIMIT, CAPTURE_TRUNCATE};
+int captureEnabled = FALSE;
+int captureEpollFd = -1;
+int captureDue = FALSE;
+// The foreground job's capture while stdout is too full to take its output, which is out of the epoll set until it drains
+struct capture *blockedCapture = NULL;
+
+// With --cache, commands run with a "cached" prefix replay an earlier identical run from the store
+char* cacheDirectory = NULL;
+long long cacheSize = RESULT_CACHE_DEFAULT_SIZE;
+
+// The CPUs and NUMA nodes jobs can be placed on, with --spread putting each background job on the least loaded core
+struct topology topology;
+int spreadEnabled = FALSE;
+
+// Cache of command name to absolute path lookups
+struct commandHash commandHash;
+
+// Set when each job gets its own process group and the terminal is handed to the foreground job
+int jobControl = FALSE;
+int terminalFd = -1;
+struct termios shellModes;
+
+int main(int argc, char* argv[]) {
+    char* commandString = NULL;
+    char* scriptFile = NULL;
+    int forceInteractive = -1;
+    long long liveInterval = LIVE_DEFAULT_INTERVAL;
+
+    // --perf attaches hardware counters to every command
+    // --cgroup puts every background job in its own cgroup
+    // -i and --non-interactive override the check for a terminal
+    // -c runs the given commands and a file name runs a script instead of reading stdin
+    // -j limits how many background jobs run at once
+    // --live publishes running jobs for jobtop, and --live-interval sets how often they are sampled
+    // --schedule queues background jobs and starts them as the load allows
+    // --capture collects the output of background jobs, --capture-limit sets how much is kept in memory,
+    // and --capture-spill keeps the rest in a temporary file instead of dropping it
+    // --spread places each background job on its own core, spread across the NUMA nodes
+    // --cache keeps the results of cached commands in a directory, and --cache-size sets how big it can get in megabytes
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--perf") == 0) {
+            perfEnabled = TRUE;
+        } else if ((strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jobs") == 0) && i + 1 < argc) {
+            maxJobs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cgroup") == 0) {
+            cgroupMode = CGROUP_V2;
+        } else if (strcmp(argv[i], "--live") == 0) {
+            liveEnabled = TRUE;
+        } else if (strcmp(argv[i], "--live-interval") == 0 && i + 1 < argc && parseDuration(argv[i + 1], &liveInterval) == 0 && liveInterval >= 1000000) {
+            liveEnabled = TRUE;
+            i++;
+        } else if (strcmp(argv[i], "--schedule") == 0) {
+            schedulingEnabled = TRUE;
+        } else if (strcmp(argv[i], "--capture") == 0) {
+            captureEnabled = TRUE;
+        } else if (strcmp(argv[i], "--capture-limit") == 0 && i + 1 < argc && parseCaptureSize(argv[i + 1], &captureSettings.limit) == 0) {
+            captureEnabled = TRUE;
+            i++;
+        } else if (strcmp(argv[i], "--capture-spill") == 0) {
+            captureEnabled = TRUE;
+            captureSettings.mode = CAPTURE_SPILL;
+        } else if (strcmp(argv[i], "--spread") == 0) {
+            spreadEnabled = TRUE;
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            cacheDirectory = argv[++i];
+        } else if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc && atoll(argv[i + 1]) > 0) {
+            cacheSize = atoll(argv[++i]) << 20;
+        } else if (strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "--interactive") == 0) {
+            forceInteractive = TRUE;
+        } else if (strcmp(argv[i], "--non-interactive") == 0) {
+            forceInteractive = FALSE;
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc && scriptFile == NULL) {
+            commandString = argv[++i];
+        } else if (argv[i][0] != '-' && commandString == NULL && scriptFile == NULL) {
+            scriptFile = argv[i];
+        } else {
+            printf("Usage: %s [--perf] [--cgroup] [--live] [--live-interval duration] [--schedule] [--capture] [--capture-limit size] [--capture-spill] [--spread] [--cache dir] [--cache-size mb] [-j jobs] [-i | --non-interactive] [-c commands | script]\n", argv[0]);
+            exit(1);
         }
+    }
 
-        if (strlen(userInput) == 1 && userInput[strlen(userInput) - 1] == '\n') {
-            // No command specified, so print an error and exit
-            printf("You must specify the command to run!\n");
-            continue;
+    // Commands come from the -c string, the script, or stdin
+    struct inputReader input;
+    int inputReady;
+    if (commandString != NULL) {
+        inputReady = initInputReaderString(&input, commandString);
+    } else if (scriptFile != NULL) {
+        int scriptFd = open(scriptFile, O_RDONLY | O_CLOEXEC);
+        if (scriptFd == -1) {
+            printf("Unable to open %s!\nError Number: %i\nError Message: %s\n", scriptFile, errno, strerror(errno));
+            exit(1);
         }
+        inputReady = initInputReader(&input, scriptFd);
+    } else {
+        inputReady = initInputReader(&input, STDIN_FILENO);
+    }
+    if (inputReady == -1) {
+        perror("initInputReader");
+        exit(1);
+    }
 
-        // If the last user input character isn't a new line then:
-        // - The string is more than 128 characters, or
-        // - We reached the end of file
-        if (userInput[strlen(userInput)-1] != '\n') {
-            int tooLong = 0;
-            char nextChar;
+    // Only prompt when a person is typing, and otherwise collect our own output in a large buffer
+    interactive = (forceInteractive != -1) ? forceInteractive : (input.fd == STDIN_FILENO && isatty(STDIN_FILENO));
+    if (!interactive) {
+        setvbuf(stdout, NULL, _IOFBF, SCRIPT_OUTPUT_BUFFER_SIZE);
+    } else if (input.fd == STDIN_FILENO) {
+        setupJobControl(STDIN_FILENO);
+    }
 
-            // Loop until we reach the end of line or end of file
-            while (((nextChar = getchar()) != '\n') && (nextChar != EOF)) {
-                tooLong = 1;
-            }
+    // Fall back to setrlimit if we can't make our own cgroups
+    if (cgroupMode == CGROUP_V2) {
+        if (setupCgroupParent() == -1) {
+            printf("Cgroups aren't available, falling back to setrlimit.\nError Number: %i\nError Message: %s\n", errno, strerror(errno));
+            cgroupMode = CGROUP_RLIMIT;
+        } else {
+            atexit(removeCgroupParent);
+        }
+    }
 
-            // Check to see if the end of line was reached
-            // If so, print an error and ask for new user input
-            if (tooLong) {
-                printf("Commands must be 128 characters or less!\n");
-                continue;
-            }
+    // Placement with "place" or --spread only uses the CPUs we were started with
+    if (loadTopology(&topology) == -1) {
+        printf("Unable to read the CPU topology, jobs can't be placed!\nError Number: %i\nError Message: %s\n", errno, strerror(errno));
+        spreadEnabled = FALSE;
+    }
+
+    struct jobTable *backgroundJobs = createJobTable(INITIAL_JOB_SLOTS);
+    initCommandHash(&commandHash);
+
+    // Statistics go to stdout unless STATS_FORMAT, STATS_FILE or STATS_FD say otherwise
+    if (openStatsOutput(&statsOutput, NULL, NULL, -1, TRUE) == -1) {
+        exit(1);
+    }
+    statsOutput.perf = perfEnabled;
+
+    openJobHistory();
+
+    if (liveEnabled) {
+        if (createLiveStats(&liveStats, liveInterval) == -1) {
+            printf("Unable to publish live job statistics!\nError Number: %i\nError Message: %s\n", errno, strerror(errno));
+            liveEnabled = FALSE;
+        } else {
+            atexit(removeLiveStats);
         }
+    }
 
-        // Replace the new line character with a null terminator
-        userInput[strlen(userInput)-1] = '\0';
+    if (schedulingEnabled && initScheduler(&scheduler) == -1) {
+        printf("Unable to set up the job scheduler!\nError Number: %i\nError Message: %s\n", errno, strerror(errno));
+        schedulingEnabled = FALSE;
+    }
 
-        char* arguments[33];
-        char* argument = strtok(userInput, " \n");
-        int lastArg = 0, foundLastArg = 0;
+    if (captureEnabled) {
+        captureEpollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (captureEpollFd == -1) {
+            printf("Unable to capture the output of background jobs!\nError Number: %i\nError Message: %s\n", errno, strerror(errno));
+            captureEnabled = FALSE;
+        }
+    }
 
-        // Read in the arguments using strtok()
-        for (int i = 0; i < 33; i++) {
-            arguments[i] = argument;
-            argument = strtok(NULL, " \n");
-            if (argument == NULL && !foundLastArg) {
-                foundLastArg = TRUE;
-                lastArg = i;
-            }
+    // Route SIGCHLD through a signalfd so the shell can sleep until a job finishes
+    childSignalFd = setupChildSignal();
+    deadlineTimerFd = openDeadlineTimer();
+    if (childSignalFd == -1 || deadlineTimerFd == -1) {
+        printf("Unable to set up child signal handling!\nError Number: %i\nError Message: %s\n", errno, strerror(errno));
+        exit(1);
+    }
+
+    // Commands are read in large blocks, or mapped if they come from a file
+    // Background jobs are reported while the reader waits for more input
+    input.wait = waitForInput;
+    input.waitContext = backgroundJobs;
+
+    struct pipeline pipeline;
+    memset(&pipeline, 0, sizeof(pipeline));
+
+    while (1) {
+
+        /*****************************
+        * User Prompt and User Input *
+        *****************************/
+
+        // Report any background jobs that finished while the last command ran
+        processBackgroundJobs(backgroundJobs);
+
+        // Make sure the prompt and statistics are out before we go to sleep waiting for input
+        if (interactive) {
+            printf("-> ");
+            flushStatsOutput(&statsOutput);
+            fflush(stdout);
         }
 
-        if (arguments[32] != NULL) {
-            // There are too many arguments provided
-            printf("You are only allowed to use 32 arguments!\n");
-            continue;
+        // If readLine returns NULL, then we reached the end of file
+        char* userInput = readLine(&input);
+        if (userInput == NULL) {
+            waitForBackgroundJobs(backgroundJobs);
+            if (interactive) {
+                printf("\n");
+            }
+            exit(0);
         }
 
+        // Split the line in place, there is no limit on its length or the number of arguments
+        int argumentCount;
+        char** arguments = splitArguments(&input, userInput, &argumentCount);
+
         /*******************
         * Special Commands *
         *******************/
@@ -114,99 +401,204 @@ int main(int argc, char* argv[]) {
         int inBackground = FALSE;
 
         // Check to see if this is a background command
-        if (strcmp(arguments[lastArg], "&") == 0) {
-            arguments[lastArg] = NULL;
+        if (argumentCount > 0 && strcmp(arguments[argumentCount - 1], "&") == 0) {
+            arguments[--argumentCount] = NULL;
             inBackground = TRUE;
         }
 
         // Extract the command name and the list of arguments
         char* commandName = arguments[0];
 
+        if (commandName == NULL) {
+            printf("You must specify the command to run!\n");
+            continue;
+        }
+
         // If the user typed the exit command, exit the shell
         if (strcmp(commandName, "exit") == 0) {
-            processBackgroundJobs(backgroundJobs, &backgroundJobs);
-            if (!(backgroundJobs->job == NULL && backgroundJobs->nextJob == NULL)) {
-                printf("There are still background jobs that haven't completed.\n");
-                printf("Waiting for them to complete.\n\n");
-                while (!(backgroundJobs->job == NULL && backgroundJobs->nextJob == NULL)) {
-                    processBackgroundJobs(backgroundJobs, &backgroundJobs);
-                }
-            }
+            waitForBackgroundJobs(backgroundJobs);
             printf("Goodbye!\n");
             exit(0);   
         }
 
+        // If the user typed the hash command, show or update the command path cache
+        if (strcmp(commandName, "hash") == 0) {
+            runHashBuiltin(&commandHash, arguments);
+            continue;
+        }
+
+        // If the user typed the limit command, show or change the limits for new background jobs
+        if (strcmp(commandName, "limit") == 0) {
+            runLimitBuiltin(arguments);
+            continue;
+        }
+
         // If the user typed the cd command, switch to the specified directory
         if (strcmp(commandName, "cd") == 0) {
-            processBackgroundJobs(backgroundJobs, &backgroundJobs);
+            processBackgroundJobs(backgroundJobs);
             chdir(arguments[1]);
             continue;
         }
 
         // If the user typed the jobs command, display the list of background jobs
         if (strcmp(commandName, "jobs") == 0) {
-            processBackgroundJobs(backgroundJobs, &backgroundJobs);
-            printBackgroundJobs(backgroundJobs, 1);
+            processBackgroundJobs(backgroundJobs);
+            printBackgroundJobs(backgroundJobs);
+            if (schedulingEnabled) {
+                printQueuedJobs(&scheduler);
+            }
             continue;
         }
 
-        /**********************************
-        * Forking and Running the Command *
-        **********************************/
+        // If the user typed fg, bg, kill or stop, move or signal a job
+        if (strcmp(commandName, "fg") == 0 || strcmp(commandName, "bg") == 0 || strcmp(commandName, "kill") == 0 || strcmp(commandName, "stop") == 0) {
+            runJobControlBuiltin(backgroundJobs, arguments);
+            continue;
+        }
 
-        // Fork a child process and get its PID
-        int pid = fork();
+        // If the user typed the wait command, block until the given jobs finish
+        if (strcmp(commandName, "wait") == 0) {
+            runWaitBuiltin(backgroundJobs, arguments);
+            continue;
+        }
 
-        // Determine whether we are in the parent or child process
-        if (pid != 0) {
-            // We are in the parent process
-            int status, result, showStats = TRUE;
-            struct timeval beforeTime, afterTime;
-            struct rusage childStats;
+        // If the user typed the output command, show what a background job has written so far
+        if (strcmp(commandName, "output") == 0) {
+            runOutputBuiltin(backgroundJobs, arguments);
+            continue;
+        }
 
-            // Check to see if any of the background jobs finished
-            processBackgroundJobs(backgroundJobs, &backgroundJobs);
+        // If the user typed the cache command, show the hits, misses and time saved by the result cache
+        if (strcmp(commandName, "cache") == 0) {
+            if (cacheDirectory != NULL) {
+                printCacheCounters(cacheDirectory);
+            } else {
+                printf("The result cache isn't turned on.\n");
+            }
+            continue;
+        }
 
-            // Get the time information before running the command
-            gettimeofday(&beforeTime, NULL);
+        // If the user typed the stats command, show the per-command totals from the job history
+        if (strcmp(commandName, "stats") == 0) {
+            if (historyEnabled) {
+                printHistoryStats(&history, arguments[1]);
+            } else {
+                printf("The job history isn't available.\n");
+            }
+            continue;
+        }
 
-            // Wait for the child to finish running the command
-            if (!inBackground) {
-                result = wait4(pid, &status, 0, &childStats);
+        // If the user typed the maxjobs command, show or change the background job limit
+        if (strcmp(commandName, "maxjobs") == 0) {
+            if (arguments[1] != NULL) {
+                maxJobs = atoi(arguments[1]);
+            } else if (maxJobs > 0) {
+                printf("At most %i background jobs run at once.\n", maxJobs);
             } else {
-                result = wait4(pid, &status, WNOHANG, &childStats);
-                if (result <= 0) {
-                    // Background task isn't done, so store it in the linked list
-                    struct jobList *newJob = storeBackgroundJob(backgroundJobs, pid, commandName, beforeTime);
+                printf("There is no limit on background jobs.\n");
+            }
+            continue;
+        }
 
-                    // Print the info about the newly created job
-                    printJobInfo(backgroundJobs, newJob, 1);
+        /************************************
+        * Launching and Running the Command *
+        ************************************/
 
-                    // Don't show the statistics since it hasn't finished
-                    showStats = FALSE;
-                }
+        // A "nice" prefix lowers the job's priority, a "place" prefix pins it to CPUs or a NUMA node,
+        // and a "timeout duration" prefix puts a deadline on the whole job
+        struct deadline deadline;
+        struct placement placement;
+        int nice;
+        int niceSkipped = parseNicePrefix(arguments, &nice);
+        if (niceSkipped == -1) {
+            continue;
+        }
+        int placeSkipped = parsePlacementPrefix(arguments + niceSkipped, &topology, &placement);
+        if (placeSkipped == -1) {
+            continue;
+        }
+        niceSkipped += placeSkipped;
+        int skipped = parseTimeoutPrefix(arguments + niceSkipped, &deadline);
+        if (skipped == -1) {
+            continue;
+        }
+        skipped += niceSkipped;
+
+        // A "cached" prefix looks the command up in the result cache, keyed on everything after it
+        struct cacheInputs cacheInputs = {NULL, 0, NULL, 0, FALSE};
+        int cacheSkipped = parseCachePrefix(arguments + skipped, &cacheInputs);
+        if (cacheSkipped == -1) {
+            continue;
+        }
+        skipped += cacheSkipped;
+
+        // Split the command into pipeline stages and redirections
+        if (!parsePipeline(arguments + skipped, argumentCount - skipped, &pipeline)) {
+            free(cacheInputs.files);
+            free(cacheInputs.variables);
+            continue;
+        }
+
+        // Only foreground commands with their output going to the shell are cached, and a redirected input counts as an input
+        // On a hit the stored output is replayed, and on a miss the output goes into a new result
+        struct cacheEntry *cacheEntry = NULL;
+        if (cacheSkipped > 0 && (cacheDirectory == NULL || inBackground || pipeline.outputFile != NULL)) {
+            printf("Only foreground commands without an output redirection are cached, and only with --cache.\n");
+        } else if (cacheSkipped > 0) {
+            char key[RESULT_CACHE_KEY_SIZE];
+            if (pipeline.inputFile != NULL) {
+                addCacheInput(&cacheInputs.files, &cacheInputs.fileCount, pipeline.inputFile);
+            }
+            if (computeCacheKey(arguments + skipped, &cacheInputs, key) == -1) {
+                printf("Unable to read the cache inputs, running the command without the cache!\nError Number: %i\nError Message: %s\n", errno, strerror(errno));
+            } else if (replayCachedJob(arguments + skipped, key)) {
+                free(cacheInputs.files);
+                free(cacheInputs.variables);
+                continue;
+            } else if ((cacheEntry = beginCacheEntry(cacheDirectory, key)) == NULL) {
+                printf("Unable to write to the result cache, running the command without it!\nError Number: %i\nError Message: %s\n", errno, strerror(errno));
             }
+        }
+        free(cacheInputs.files);
+        free(cacheInputs.variables);
 
-            // If the child terminated normally, print the statistics
-            if (showStats && WEXITSTATUS(status) == 0) {
-                // Get the time right after the child process finished
-                gettimeofday(&afterTime, NULL);
+        // The scheduler decides when a queued job starts, and checks the job limit itself
+        if (inBackground && schedulingEnabled) {
+            queueBackgroundJob(arguments + skipped, argumentCount - skipped, nice, &placement, &deadline);
+            processBackgroundJobs(backgroundJobs);
+            continue;
+        }
 
-                // Print the statistics
-                printChildStatistics(childStats, beforeTime, afterTime);
+        // Once every job slot is taken, a new background job waits for one to finish
+        if (inBackground) {
+            processBackgroundJobs(backgroundJobs);
+            while (maxJobs > 0 && backgroundJobs->count - backgroundJobs->stoppedJobs >= maxJobs) {
+                waitForJobEvent(backgroundJobs);
             }
+        }
+
+        // Anything we buffered has to come out before the command's own output
+        fflush(stdout);
+
+        // Start one child process per stage, connected by pipes
+        struct job job;
+        if (launchPipeline(&pipeline, &job, &commandHash, inBackground, nice, &placement, cacheEntry) == 0) {
+            continue;
+        }
+        job.deadline = deadline;
+        startDeadline(&job.deadline, job.startTime);
 
+        if (!inBackground) {
+            runForegroundJob(backgroundJobs, &job);
         } else {
-            // We are in the child process
-            // Run the command and get its result
-            int result = execvp(commandName, arguments);
+            // Store the job in the job table, it gets reported once it is reaped
+            int slot = storeBackgroundJob(backgroundJobs, &job);
 
-            // Check if the command failed
-            if (result == -1) {
-                // The command failed, so print out he error number and exit
-                printf("Invalid command!\nError Number: %i\nError Message: %s\n", errno, strerror(errno));
-                exit(1);
-            }
+            // Print the info about the newly created job
+            printJobInfo(backgroundJobs, slot);
+
+            // Check to see if any of the background jobs finished, including this one
+            processBackgroundJobs(backgroundJobs);
         }
     }
     return 0;
@@ -216,126 +608,1404 @@ int main(int argc, char* argv[]) {
 * Functions *
 ************/
 
-// Add a new job to the linked list of existing background jobs
-struct jobList* storeBackgroundJob(struct jobList *jobs, int pid, char* command, struct timeval startTime) {
-    // Malloc a new job and set its PID and command
-    struct job *newJob = malloc(sizeof(struct job));
-    newJob->pid = pid;
-    newJob->command = strdup(command);
-    newJob->startTime = startTime;
-
-    // Check to see if there is already a job in the job list
-    if (jobs->job != NULL) {
-        // If there is a job already, find the last job
-        struct jobList *current = jobs;
-        while (current->nextJob != NULL) {
-            current = current->nextJob;
-        }
-
-        // Malloc a new jobList and set it as the next job in the linked list
-        struct jobList *newJobList = malloc(sizeof(struct jobList));
-        newJobList->job = newJob;
-        newJobList->nextJob = NULL;
-
-        current->nextJob = newJobList;
-        return newJobList;
-    } else {
-        // This is the first job, so just set the values of the specified jobList
-        jobs->job = newJob;
-        jobs->nextJob = NULL;
-        return jobs;
+// Allocate an empty job table with the given number of slots
+struct jobTable* createJobTable(int capacity) {
+    struct jobTable *jobs = malloc(sizeof(struct jobTable));
+    jobs->slots = calloc(capacity, sizeof(struct job));
+    jobs->capacity = capacity;
+    jobs->count = 0;
+    jobs->finishedCount = 0;
+    jobs->stoppedJobs = 0;
+    jobs->deadlineJobs = 0;
+    jobs->freeSlots = malloc(capacity * sizeof(int));
+    jobs->pidBuckets = calloc(capacity, sizeof(struct process*));
+
+    // Hand out the lowest slots first by stacking the free list in reverse
+    jobs->freeCount = capacity;
+    for (int i = 0; i < capacity; i++) {
+        jobs->freeSlots[i] = capacity - 1 - i;
+    }
+
+    return jobs;
+}
+
+// Double the number of slots once every slot is in use, rehashing the live jobs
+void growJobTable(struct jobTable *jobs) {
+    int oldCapacity = jobs->capacity;
+    int capacity = oldCapacity * 2;
+
+    jobs->slots = realloc(jobs->slots, capacity * sizeof(struct job));
+    memset(&jobs->slots[oldCapacity], 0, oldCapacity * sizeof(struct job));
+    jobs->freeSlots = realloc(jobs->freeSlots, capacity * sizeof(int));
+    jobs->capacity = capacity;
+
+    // The new slots are all free
+    jobs->freeCount = 0;
+    for (int i = capacity - 1; i >= oldCapacity; i--) {
+        jobs->freeSlots[jobs->freeCount++] = i;
+    }
+
+    // The bucket count changed, so every live process has to be rehashed
+    free(jobs->pidBuckets);
+    jobs->pidBuckets = calloc(capacity, sizeof(struct process*));
+    for (int i = 0; i < oldCapacity; i++) {
+        hashJobProcesses(jobs, i);
+    }
+}
+
+// Link every process of the job in the given slot into its PID bucket
+void hashJobProcesses(struct jobTable *jobs, int slot) {
+    struct job *job = &jobs->slots[slot];
+    for (int i = 0; i < job->processCount; i++) {
+        struct process *process = &job->processes[i];
+        int bucket = process->pid % jobs->capacity;
+        process->slot = slot;
+        process->hashNext = jobs->pidBuckets[bucket];
+        jobs->pidBuckets[bucket] = process;
+    }
+}
+
+// Find the slot of the background job that owns the given PID, or -1 if it isn't a background job
+int findJobSlot(struct jobTable *jobs, int pid, struct process **process) {
+    struct process *current = jobs->pidBuckets[pid % jobs->capacity];
+    while (current != NULL && current->pid != pid) {
+        current = current->hashNext;
+    }
+    if (current == NULL) {
+        return -1;
     }
+
+    *process = current;
+    return current->slot;
+}
+
+// Move a launched job into the job table and return its slot, which is its job number minus one
+int storeBackgroundJob(struct jobTable *jobs, struct job *job) {
+    if (jobs->freeCount == 0) {
+        growJobTable(jobs);
+    }
+
+    // Reuse the most recently freed slot
+    int slot = jobs->freeSlots[--jobs->freeCount];
+    jobs->slots[slot] = *job;
+    hashJobProcesses(jobs, slot);
+
+    jobs->count++;
+    if (job->stopped) {
+        jobs->stoppedJobs++;
+    }
+    if (job->deadline.timeout > 0) {
+        jobs->deadlineJobs++;
+    }
+
+    if (liveEnabled) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        publishLiveJob(&jobs->slots[slot], slot + 1, now);
+    }
+    return slot;
 }
 
 // Print the list of background jobs
-void printBackgroundJobs(struct jobList *current, int index) {
-    if (current != NULL && current->job != NULL) {
-        printf("[%i] %i %s\n", index, current->job->pid, current->job->command);
-        printBackgroundJobs(current->nextJob, index + 1);
-    }
-}
-
-void printJobInfo(struct jobList *current, struct jobList *target, int index) {
-    if (current == target) {
-        printf("[%i] %i %s\n", index, target->job->pid, target->job->command);
-    } else if (current != NULL) {
-        printJobInfo(current->nextJob, target, index + 1);
-    }
-}
-
-void processBackgroundJobs(struct jobList *jobs, struct jobList **firstJob) {
-    if ((jobs != NULL) && (jobs->job != NULL)) {
-        int status, result;
-        struct rusage stats;
-        struct timeval endTime;
-        result = wait4(jobs->job->pid, &status, WNOHANG, &stats);
-        if (result > 0) {
-            // Print the stats
-            gettimeofday(&endTime, NULL);
-            printf("Job \"%s\" with PID %i has finished.\n", jobs->job->command, jobs->job->pid);
-            printChildStatistics(stats, jobs->job->startTime, endTime);
-            // Remove from linked list
-            removeBackgroundJob(jobs, firstJob);
-        }
-        processBackgroundJobs(jobs->nextJob, firstJob);
-    }
-}
-
-void removeBackgroundJob(struct jobList *target, struct jobList **current) {
-    if ((*current)->nextJob == NULL) {
-        // There is only one item in the list
-        (*current)->job = NULL;
-    } else if (target == (*current)) {
-        // We are removing the first item
-        *current = (*current)->nextJob;
-    } else if (target == (*current)->nextJob) {
-        (*current)->nextJob = target->nextJob;
-        free(target->job->command);
-        free(target->job);
-        free(target);
-    } else {
-        removeBackgroundJob(target, &(*current)->nextJob);
+void printBackgroundJobs(struct jobTable *jobs) {
+    for (int slot = 0, found = 0; found < jobs->count; slot++) {
+        if (jobs->slots[slot].processes != NULL) {
+            printJobInfo(jobs, slot);
+            found++;
+        }
+    }
+}
+
+// Print the job number, the PID of the last stage, the command, and where it was placed
+void printJobInfo(struct jobTable *jobs, int slot) {
+    struct job *job = &jobs->slots[slot];
+    char placement[PLACEMENT_LIST_SIZE + 32] = "";
+    if (hasPlacement(&job->placement)) {
+        char description[PLACEMENT_LIST_SIZE + 16];
+        formatPlacement(&job->placement, description, sizeof(description));
+        snprintf(placement, sizeof(placement), " (%s)", description);
+    }
+    printf("[%i] %i %s%s%s\n", slot + 1, job->processes[job->processCount - 1].pid, job->command, placement, job->stopped ? " (stopped)" : "");
+}
+
+// Wall-clock time of a finished process in nanoseconds, leaving out the time its job was stopped
+long long processWallTime(struct job *job, struct process *process) {
+    return computeTimeDifference(job->startTime, process->endTime) - process->stoppedTime;
+}
+
+// Write the statistics record for one process of a finished job
+void writeProcessRecord(struct job *job, struct process *process) {
+    // Start the clock later by the time the job was stopped, so it isn't counted
+    struct timespec startTime = job->startTime;
+    startTime.tv_sec += process->stoppedTime / 1000000000;
+    startTime.tv_nsec += process->stoppedTime % 1000000000;
+    if (startTime.tv_nsec >= 1000000000) {
+        startTime.tv_sec++;
+        startTime.tv_nsec -= 1000000000;
+    }
+
+    struct commandRecord record = {.pid = process->pid, .command = process->command, .arguments = process->arguments, .status = process->status, .stats = process->stats, .startTime = startTime, .endTime = process->endTime, .timedOut = job->deadline.timedOut, .queueWait = job->queueWait, .cache = job->cache, .node = -1};
+    char cpus[PLACEMENT_LIST_SIZE];
+    if (perfEnabled) {
+        record.perf = &process->counts;
+    }
+    if (hasPlacement(&job->placement)) {
+        formatCpuList(&job->placement.cpus, cpus, sizeof(cpus));
+        record.cpus = cpus;
+        record.node = job->placement.node;
+    }
+    writeStatsRecord(&statsOutput, &record);
+}
+
+// Print the statistics for a finished job, with a section for each stage of a pipeline
+// The stage headers go with the records, so they end up wherever the statistics do
+void printJobStatistics(struct job *job) {
+    if (job->processCount == 1) {
+        writeProcessRecord(job, &job->processes[0]);
+        return;
+    }
+
+    long long wallTime = 0;
+    for (int i = 0; i < job->processCount; i++) {
+        struct process *process = &job->processes[i];
+        if (statsOutput.format == STATS_HUMAN) {
+            fprintf(statsOutput.file, "Stage %i \"%s\" with PID %i has finished.\n", i + 1, process->command, process->pid);
+        }
+        writeProcessRecord(job, process);
+
+        if (processWallTime(job, process) > wallTime) {
+            wallTime = processWallTime(job, process);
+        }
+    }
+    if (statsOutput.format == STATS_HUMAN) {
+        fprintf(statsOutput.file, "Pipeline wall-clock time: %.3f milliseconds\n\n", wallTime / 1000000.0);
+    }
+}
+
+// Free everything a job owns
+void freeJob(struct job *job) {
+    for (int i = 0; i < job->processCount; i++) {
+        free(job->processes[i].command);
+        freeArguments(job->processes[i].arguments);
+    }
+    free(job->processes);
+    free(job->command);
+    if (job->cacheEntry != NULL) {
+        abortCacheEntry(job->cacheEntry);
+        job->cacheEntry = NULL;
+    }
+    if (hasPlacement(&job->placement)) {
+        releasePlacement(&topology, &job->placement);
+        initPlacement(&job->placement);
+    }
+    if (job->capture != NULL) {
+        if (blockedCapture == job->capture) {
+            blockedCapture = NULL;
+        }
+        closeCapture(job->capture);
+        job->capture = NULL;
+    }
+    if (job->cgroup != NULL) {
+        removeJobCgroup(job->cgroup);
+        free(job->cgroup);
+        job->cgroup = NULL;
+    }
+    job->processes = NULL;
+    job->processCount = 0;
+}
+
+// Record the exit status and statistics of a finished process
+void finishProcess(struct job *job, struct process *process, int status, struct rusage *stats) {
+    process->finished = TRUE;
+    process->status = status;
+    process->stats = *stats;
+    clock_gettime(CLOCK_MONOTONIC, &process->endTime);
+    job->remaining--;
+    if (process->stopped) {
+        process->stopped = FALSE;
+        job->stoppedCount--;
+    }
+    process->stoppedTime = job->stoppedTime + (job->stopped ? computeTimeDifference(job->stopTime, process->endTime) : 0);
+
+    // The inherited counts are complete once the process has been reaped
+    if (perfEnabled) {
+        readPerfCounters(&process->counters, &process->counts);
+        closePerfCounters(&process->counters);
+    }
+}
+
+// Work out whether the job is stopped, which is when every process still running is stopped
+// Returns 1 if the job just stopped, -1 if it just started running again, and 0 otherwise
+int updateJobState(struct job *job) {
+    int stopped = (job->remaining > 0 && job->stoppedCount == job->remaining);
+    struct timespec now;
+
+    if (stopped == job->stopped) {
+        return 0;
+    }
+    job->stopped = stopped;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (stopped) {
+        job->stopTime = now;
+        return 1;
+    }
+    job->stoppedTime += computeTimeDifference(job->stopTime, now);
+    return -1;
+}
+
+// Reap every child that has finished, reporting background jobs as they complete
+// Stopped and continued children are tracked too
+// Returns TRUE once every process of the foreground job has been reaped, or the job has stopped
+int reapChildren(struct jobTable *jobs, struct job *foreground) {
+    int status, pid;
+    struct rusage stats;
+
+    // Collect the output first, so a job that just finished has all of its output in place
+    if (captureDue) {
+        drainCaptures();
+    }
+
+    // One syscall per child event, no matter how many jobs are still running
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &stats)) > 0) {
+        struct process *process = NULL;
+        struct job *job = foreground;
+        int slot = -1;
+
+        // The foreground job only has a handful of stages, so just scan them
+        if (foreground != NULL) {
+            for (int i = 0; i < foreground->processCount; i++) {
+                if (foreground->processes[i].pid == pid) {
+                    process = &foreground->processes[i];
+                }
+            }
+        }
+        if (process == NULL) {
+            slot = findJobSlot(jobs, pid, &process);
+            if (slot == -1) {
+                continue;
+            }
+            job = &jobs->slots[slot];
+        }
+
+        if (WIFSTOPPED(status) || WIFCONTINUED(status)) {
+            int stopped = WIFSTOPPED(status);
+            if (process->stopped != stopped) {
+                process->stopped = stopped;
+                job->stoppedCount += stopped ? 1 : -1;
+            }
+        } else {
+            finishProcess(job, process, status, &stats);
+        }
+
+        // Keep count of the stopped background jobs and say when one stops
+        int change = updateJobState(job);
+        if (slot != -1) {
+            jobs->stoppedJobs += change;
+            if (change == 1) {
+                printf("[%i] Stopped %s\n", slot + 1, job->command);
+            }
+        }
+
+        if (slot != -1 && job->remaining == 0) {
+            // Print the stats, with the headers going wherever the records do
+            if (statsOutput.format == STATS_HUMAN && job->processCount == 1) {
+                fprintf(statsOutput.file, "Job \"%s\" with PID %i has finished.\n", job->command, pid);
+            } else if (statsOutput.format == STATS_HUMAN) {
+                fprintf(statsOutput.file, "Job \"%s\" has finished.\n", job->command);
+            }
+            if (job->capture != NULL) {
+                drainCapture(job->capture, &captureSettings);
+                writeCapture(job->capture, stdout);
+            }
+            if (job->cacheEntry != NULL) {
+                finishCachedJob(job);
+            }
+            printJobStatistics(job);
+
+            // The cgroup covers every process the job started, not just the ones we reaped
+            if (job->cgroup != NULL && statsOutput.format == STATS_HUMAN) {
+                struct cgroupStats cgroupStats;
+                readCgroupStats(job->cgroup, &cgroupStats);
+                printCgroupStats(statsOutput.file, &cgroupStats);
+                fprintf(statsOutput.file, "\n");
+            }
+            recordJobHistory(job);
+
+            // Remove from the job table, which may make room for a queued job
+            removeBackgroundJob(jobs, slot);
+            if (schedulingEnabled && scheduler.count > 0) {
+                scheduleDue = TRUE;
+            }
+        }
     }
+
+    if (scheduleDue) {
+        dispatchQueuedJobs(jobs);
+    }
+
+    enforceDeadlines(jobs, foreground);
+
+    if (liveSampleDue) {
+        sampleLiveJobs(jobs, foreground);
+    }
+
+    return foreground != NULL && (foreground->remaining == 0 || foreground->stopped);
 }
 
-// Compute the difference between the two specified timevals
-long computeTimeDifference(struct timeval beforeTime, struct timeval afterTime) {
-    // Get the seconds difference and convert to microseconds
-    long difference = (long) ((afterTime.tv_sec - beforeTime.tv_sec) * 1000000);
+// Signal the jobs that have run past their deadlines, and arm the timer for the next deadline
+void enforceDeadlines(struct jobTable *jobs, struct job *foreground) {
+    static int timerArmed = FALSE;
+    struct timespec now, earliest;
+    int found = FALSE;
+
+    if (!timerArmed && jobs->deadlineJobs == 0 && (foreground == NULL || foreground->deadline.timeout == 0)) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (int slot = -1, seen = 0; slot < jobs->capacity && (slot == -1 || seen < jobs->deadlineJobs); slot++) {
+        struct job *job = (slot == -1) ? foreground : &jobs->slots[slot];
+        if (job == NULL || job->processes == NULL || job->deadline.timeout == 0) {
+            continue;
+        }
+        if (slot != -1) {
+            seen++;
+        }
+        if (job->remaining == 0) {
+            continue;
+        }
+
+        // A stopped job has to be continued to act on SIGTERM
+        int signalNumber = nextDeadlineSignal(&job->deadline, now);
+        if (signalNumber != 0) {
+            signalJob(job, signalNumber);
+            if (signalNumber == SIGTERM) {
+                signalJob(job, SIGCONT);
+            }
+        }
+        keepEarliestDeadline(&job->deadline, &earliest, &found);
+    }
+
+    setDeadlineTimer(deadlineTimerFd, found ? &earliest : NULL);
+    timerArmed = found;
+}
 
-    // Get the microseconds difference
-    long microDifference = (long) (afterTime.tv_usec - beforeTime.tv_usec);
+// Report and remove any background jobs that have finished, take a live sample if one is due,
+// and start any queued jobs there is room for
+void processBackgroundJobs(struct jobTable *jobs) {
+    if (jobs->count > 0 || liveSampleDue || scheduleDue || captureDue) {
+        reapChildren(jobs, NULL);
+    }
+}
 
-    // Correct the difference when the after microseconds > before microseconds
-    if (microDifference < 0) {
-        microDifference += 1000000;
+// Take a job out of the table without freeing it, unlinking its processes from their PID buckets
+// and putting the slot back on the free list
+struct job takeBackgroundJob(struct jobTable *jobs, int slot) {
+    struct job target = jobs->slots[slot];
+    for (int i = 0; i < target.processCount; i++) {
+        struct process **link = &jobs->pidBuckets[target.processes[i].pid % jobs->capacity];
+        while (*link != &target.processes[i]) {
+            link = &(*link)->hashNext;
+        }
+        *link = target.processes[i].hashNext;
     }
 
-    // Add the corrected microsecond difference to the total
-    difference += microDifference;
+    jobs->slots[slot].processes = NULL;
+    jobs->slots[slot].processCount = 0;
+    jobs->freeSlots[jobs->freeCount++] = slot;
+    jobs->count--;
+    if (target.stopped) {
+        jobs->stoppedJobs--;
+    }
+    if (target.deadline.timeout > 0) {
+        jobs->deadlineJobs--;
+    }
+    if (liveEnabled) {
+        clearLiveRecord(&liveStats, slot + 1);
+    }
+    return target;
+}
 
-    // Convert to milliseconds and return the result
-    return (difference / 1000);
+// Remove a finished job from the table and free it
+void removeBackgroundJob(struct jobTable *jobs, int slot) {
+    struct job target = takeBackgroundJob(jobs, slot);
+    freeJob(&target);
+    jobs->finishedCount++;
 }
 
-// Print the statistics about the child process with the given rusage data
-void printChildStatistics(struct rusage childStats, struct timeval beforeTime, struct timeval afterTime) {
-    long difference, userCPUTime, sysCPUTime, volContext, involContext, pageFaults, unrecPageFaults;
-    difference = computeTimeDifference(beforeTime, afterTime);
-    userCPUTime = (childStats.ru_utime.tv_sec * 1000) + (childStats.ru_utime.tv_usec / 1000);
-    sysCPUTime = (childStats.ru_stime.tv_sec * 1000) + (childStats.ru_stime.tv_usec / 1000);
-    volContext = childStats.ru_nvcsw;
-    involContext = childStats.ru_nivcsw;
-    pageFaults = childStats.ru_majflt;
-    unrecPageFaults = childStats.ru_minflt;
+// Split the arguments into pipeline stages on "|" and pull out the "<", ">" and ">>" redirections
+// Returns FALSE and prints an error if the command line doesn't make sense
+int parsePipeline(char** arguments, int argumentCount, struct pipeline *pipeline) {
+    int count = 0;
+
+    // There can't be more stages or stage arguments than arguments, plus one for the NULL
+    if (argumentCount + 1 > pipeline->capacity) {
+        pipeline->capacity = argumentCount + 1;
+        pipeline->stageArguments = realloc(pipeline->stageArguments, pipeline->capacity * sizeof(char*));
+        pipeline->stages = realloc(pipeline->stages, pipeline->capacity * sizeof(char**));
+        if (pipeline->stageArguments == NULL || pipeline->stages == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+
+    pipeline->stageCount = 1;
+    pipeline->stages[0] = pipeline->stageArguments;
+    pipeline->inputFile = NULL;
+    pipeline->outputFile = NULL;
+    pipeline->appendOutput = FALSE;
+
+    for (int i = 0; arguments[i] != NULL; i++) {
+        char* argument = arguments[i];
 
-    printf("\n***********************************************************************\n");
-    printf("Wall-Clock time: %li milliseconds\n", difference);
-    printf("User CPU time: %li milliseconds\n", userCPUTime);
-    printf("System CPU time: %li milliseconds\n", sysCPUTime);
-    printf("Voluntary context switches: %li\n", volContext);
-    printf("Involuntary context switches: %li\n", involContext);
-    printf("Page faults: %li\n", pageFaults);
-    printf("Page faults that could be satisfied with unreclaimed pages: %li\n", unrecPageFaults);
-    printf("***********************************************************************\n\n");
+        if (strcmp(argument, "|") == 0) {
+            // End the current stage and start the next one
+            if (pipeline->stages[pipeline->stageCount - 1] == &pipeline->stageArguments[count]) {
+                printf("Pipeline stages can't be empty!\n");
+                return FALSE;
+            }
+            pipeline->stageArguments[count++] = NULL;
+            pipeline->stages[pipeline->stageCount++] = &pipeline->stageArguments[count];
+        } else if (strcmp(argument, "<") == 0 || strcmp(argument, ">") == 0 || strcmp(argument, ">>") == 0) {
+            if (arguments[i + 1] == NULL) {
+                printf("You must specify a file after %s!\n", argument);
+                return FALSE;
+            }
+            if (argument[0] == '<') {
+                pipeline->inputFile = arguments[++i];
+            } else {
+                pipeline->appendOutput = (argument[1] == '>');
+                pipeline->outputFile = arguments[++i];
+            }
+        } else {
+            pipeline->stageArguments[count++] = argument;
+        }
+    }
+
+    if (pipeline->stages[pipeline->stageCount - 1] == &pipeline->stageArguments[count]) {
+        printf(pipeline->stageCount == 1 ? "You must specify the command to run!\n" : "Pipeline stages can't be empty!\n");
+        return FALSE;
+    }
+    pipeline->stageArguments[count] = NULL;
+
+    return TRUE;
+}
+
+// Open the redirections and start every stage of the pipeline, connecting them with pipes
+// Background jobs are put in their own cgroup or given rlimits if that is turned on
+// Returns the number of processes started, which are stored in the job
+int launchPipeline(struct pipeline *pipeline, struct job *job, struct commandHash *commandHash, int inBackground, int nice, struct placement *placement, struct cacheEntry *cacheEntry) {
+    int inputFd = -1, outputFd = -1;
+
+    // Open the redirected files first so a bad file name doesn't leave half a pipeline running
+    if (pipeline->inputFile != NULL) {
+        inputFd = open(pipeline->inputFile, O_RDONLY | O_CLOEXEC);
+        if (inputFd == -1) {
+            printf("Unable to open %s!\nError Number: %i\nError Message: %s\n", pipeline->inputFile, errno, strerror(errno));
+            if (cacheEntry != NULL) {
+                abortCacheEntry(cacheEntry);
+            }
+            return 0;
+        }
+    }
+    if (pipeline->outputFile != NULL) {
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (pipeline->appendOutput ? O_APPEND : O_TRUNC);
+        outputFd = open(pipeline->outputFile, flags, 0666);
+        if (outputFd == -1) {
+            printf("Unable to open %s!\nError Number: %i\nError Message: %s\n", pipeline->outputFile, errno, strerror(errno));
+            if (inputFd != -1) {
+                close(inputFd);
+            }
+            return 0;
+        }
+    }
+
+    // The job's command is the stage commands joined by pipes
+    int commandLength = 1;
+    for (int i = 0; i < pipeline->stageCount; i++) {
+        commandLength += strlen(pipeline->stages[i][0]) + 3;
+    }
+    job->command = malloc(commandLength);
+    job->command[0] = '\0';
+    job->processes = calloc(pipeline->stageCount, sizeof(struct process));
+    job->processCount = 0;
+    job->cgroup = NULL;
+    job->pgid = 0;
+    job->stopped = FALSE;
+    job->stoppedCount = 0;
+    job->stoppedTime = 0;
+    job->savedModes = FALSE;
+    job->queueWait = 0;
+    job->capture = NULL;
+    job->cacheEntry = cacheEntry;
+    job->cache = CACHE_UNUSED;
+
+    // Every stage shares the job's placement, and with --spread a background job that wasn't given one gets the least loaded core
+    job->placement = *placement;
+    if (inBackground && spreadEnabled) {
+        spreadPlacement(&topology, &job->placement);
+    }
+    if (hasPlacement(&job->placement)) {
+        claimPlacement(&topology, &job->placement);
+    }
+
+    // Every stage of a captured job writes its stderr into the capture pipe, and the last stage its stdout too
+    int captureFd = -1;
+    if (inBackground && captureEnabled) {
+        job->capture = openCapture(&captureFd);
+        if (job->capture == NULL) {
+            printf("Unable to capture the job's output!\nError Number: %i\nError Message: %s\n", errno, strerror(errno));
+        } else {
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = job->capture;
+            epoll_ctl(captureEpollFd, EPOLL_CTL_ADD, job->capture->pipeFd, &event);
+        }
+    }
+
+    // A cached job writes into its new result the same way, the entry keeps its own fds open
+    int jobOutputFd = captureFd, jobErrorFd = captureFd;
+    if (cacheEntry != NULL) {
+        jobOutputFd = cacheEntry->outputFd;
+        jobErrorFd = cacheEntry->errorFd;
+    }
+
+    // Every stage of the job shares one leaf cgroup
+    int limitJob = inBackground && cgroupMode != CGROUP_OFF;
+    if (limitJob && cgroupMode == CGROUP_V2) {
+        static int cgroupCount = 0;
+        char name[32];
+        snprintf(name, sizeof(name), "job-%i", ++cgroupCount);
+        job->cgroup = createJobCgroup(name, &jobLimits);
+        if (job->cgroup == NULL) {
+            printf("Unable to create a cgroup for the job!\nError Number: %i\nError Message: %s\n", errno, strerror(errno));
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &job->startTime);
+
+    int previousRead = inputFd;
+    for (int i = 0; i < pipeline->stageCount; i++) {
+        char** arguments = pipeline->stages[i];
+        int pipeFds[2] = {-1, -1};
+        struct launchOptions options;
+
+        initLaunchOptions(&options);
+        options.path = lookupCommand(commandHash, arguments[0]);
+        options.inputFd = previousRead;
+        options.outputFd = (outputFd != -1) ? outputFd : jobOutputFd;
+        options.errorFd = jobErrorFd;
+        options.hold = perfEnabled || limitJob;
+        options.nice = nice;
+        if (hasPlacement(&job->placement)) {
+            options.placement = &job->placement;
+        }
+
+        // With job control the job gets its own process group, led by the first stage
+        // A foreground job's first stage is held until it has been given the terminal
+        if (jobControl) {
+            options.processGroup = job->pgid;
+            options.defaultSignals = TRUE;
+            if (i == 0 && !inBackground) {
+                options.hold = TRUE;
+            }
+        }
+
+        // Every stage but the last writes into a pipe, the pipe fds are close-on-exec
+        if (i < pipeline->stageCount - 1) {
+            if (pipe2(pipeFds, O_CLOEXEC) == -1) {
+                printf("Unable to create a pipe!\nError Number: %i\nError Message: %s\n", errno, strerror(errno));
+                break;
+            }
+            options.outputFd = pipeFds[1];
+        }
+
+        int pid = launchCommand(arguments[0], arguments, &options);
+
+        // Drop the cached path if the command wasn't there anymore
+        if (options.pathStale) {
+            forgetCommand(commandHash, arguments[0]);
+        }
+
+        // The children have their own copies of these now
+        if (previousRead != -1) {
+            close(previousRead);
+        }
+        if (pipeFds[1] != -1) {
+            close(pipeFds[1]);
+        }
+        previousRead = pipeFds[0];
+
+        if (pid == -1) {
+            break;
+        }
+
+        struct process *process = &job->processes[job->processCount++];
+        process->pid = pid;
+        process->command = strdup(arguments[0]);
+        process->arguments = duplicateArguments(arguments);
+
+        if (jobControl && i == 0) {
+            job->pgid = pid;
+            if (!inBackground) {
+                tcsetpgrp(terminalFd, pid);
+            }
+        }
+
+        // Attach the counters while the child is held, so they start counting at exec
+        if (perfEnabled) {
+            openPerfCounters(&process->counters, pid);
+        }
+
+        // Limit the child before it runs anything
+        if (job->cgroup != NULL) {
+            if (addToCgroup(job->cgroup, pid) == -1) {
+                printf("Unable to move PID %i into its cgroup: %s\n", pid, strerror(errno));
+            }
+        } else if (limitJob && applyRlimits(pid, &jobLimits) == -1) {
+            printf("Unable to set the limits for PID %i: %s\n", pid, strerror(errno));
+        }
+        releaseCommand(&options);
+
+        if (i > 0) {
+            strcat(job->command, " | ");
+        }
+        strcat(job->command, arguments[0]);
+    }
+
+    if (previousRead != -1) {
+        close(previousRead);
+    }
+    if (outputFd != -1) {
+        close(outputFd);
+    }
+    if (captureFd != -1) {
+        close(captureFd);
+    }
+
+    job->remaining = job->processCount;
+    if (job->processCount == 0) {
+        freeJob(job);
+    }
+    return job->processCount;
+}
+
+// Run the limit builtin: show the limits, change one with "limit name value", or remove them with "limit clear"
+void runLimitBuiltin(char** arguments) {
+    if (arguments[1] == NULL) {
+        printLimits(&jobLimits, cgroupMode);
+    } else if (strcmp(arguments[1], "clear") == 0) {
+        memset(&jobLimits, 0, sizeof(jobLimits));
+    } else if (arguments[2] == NULL || parseLimit(&jobLimits, arguments[1], arguments[2]) == -1) {
+        printf("Usage: limit [cpu cores | memory bytes[K|M|G] | pids count | clear]\n");
+    } else if (cgroupMode == CGROUP_OFF) {
+        printf("Limits only apply when shell2 is started with --cgroup.\n");
+    } else if (cgroupMode == CGROUP_RLIMIT && strcmp(arguments[1], "cpu") == 0) {
+        printf("CPU limits need cgroups, setrlimit can't enforce them.\n");
+    }
+}
+
+// Block SIGCHLD and return a signalfd that reports it instead
+int setupChildSignal() {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+
+    // The signal has to be blocked so it stays pending for the signalfd
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+        return -1;
+    }
+
+    return signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+// Throw away the queued SIGCHLD notifications, since the job list is rescanned anyway
+void drainChildSignal() {
+    struct signalfd_siginfo info[16];
+    while (read(childSignalFd, info, sizeof(info)) > 0) {
+    }
+}
+
+// Sleep until a child changes state, a deadline passes, a live sample or a look at the queue is due,
+// a captured job writes something, or the given fd becomes readable
+// Returns TRUE if the given fd is readable
+int waitForChildEvent(int fd) {
+    struct pollfd fds[7];
+    int count = 2, liveIndex = -1, scheduleIndex = -1, captureIndex = -1, outputIndex = -1, inputIndex = -1;
+
+    fds[0].fd = childSignalFd;
+    fds[0].events = POLLIN;
+    fds[1].fd = deadlineTimerFd;
+    fds[1].events = POLLIN;
+    if (liveEnabled) {
+        liveIndex = count++;
+        fds[liveIndex].fd = liveStats.timerFd;
+        fds[liveIndex].events = POLLIN;
+    }
+    if (schedulingEnabled) {
+        scheduleIndex = count++;
+        fds[scheduleIndex].fd = scheduler.timerFd;
+        fds[scheduleIndex].events = POLLIN;
+    }
+    if (captureEnabled) {
+        captureIndex = count++;
+        fds[captureIndex].fd = captureEpollFd;
+        fds[captureIndex].events = POLLIN;
+    }
+    if (blockedCapture != NULL) {
+        outputIndex = count++;
+        fds[outputIndex].fd = STDOUT_FILENO;
+        fds[outputIndex].events = POLLOUT;
+    }
+    if (fd != childSignalFd) {
+        inputIndex = count++;
+        fds[inputIndex].fd = fd;
+        fds[inputIndex].events = POLLIN;
+    }
+
+    while (poll(fds, count, -1) == -1) {
+        if (errno != EINTR) {
+            return FALSE;
+        }
+    }
+
+    if (fds[0].revents & POLLIN) {
+        drainChildSignal();
+    }
+
+    // The deadlines themselves are checked the next time children are reaped
+    if (fds[1].revents & POLLIN) {
+        unsigned long long expirations;
+        read(deadlineTimerFd, &expirations, sizeof(expirations));
+    }
+
+    // Likewise the sample is taken the next time children are reaped
+    if (liveIndex != -1 && (fds[liveIndex].revents & POLLIN)) {
+        unsigned long long expirations;
+        read(liveStats.timerFd, &expirations, sizeof(expirations));
+        liveSampleDue = TRUE;
+    }
+    if (scheduleIndex != -1 && (fds[scheduleIndex].revents & POLLIN)) {
+        unsigned long long expirations;
+        read(scheduler.timerFd, &expirations, sizeof(expirations));
+        scheduleDue = TRUE;
+    }
+
+    // The pipes themselves are drained the next time children are reaped
+    if (captureIndex != -1 && (fds[captureIndex].revents & POLLIN)) {
+        captureDue = TRUE;
+    }
+    if (outputIndex != -1 && (fds[outputIndex].revents & (POLLOUT | POLLHUP | POLLERR))) {
+        resumeCapture();
+    }
+
+    return (inputIndex != -1) && (fds[inputIndex].revents & (POLLIN | POLLHUP | POLLERR));
+}
+
+// Block until all of the background jobs have completed, and every queued job has run, reporting each one as it finishes
+// Stopped jobs are hung up on and continued, since nothing could ever continue them once we exit
+void waitForBackgroundJobs(struct jobTable *jobs) {
+    processBackgroundJobs(jobs);
+    for (int slot = 0; jobs->stoppedJobs > 0 && slot < jobs->capacity; slot++) {
+        struct job *job = &jobs->slots[slot];
+        if (job->processes != NULL && job->stopped) {
+            printf("Hanging up stopped job [%i] %s\n", slot + 1, job->command);
+            signalJob(job, SIGHUP);
+            signalJob(job, SIGCONT);
+        }
+    }
+    if (jobs->count > 0 || scheduler.count > 0) {
+        printf("There are still background jobs that haven't completed.\n");
+        printf("Waiting for them to complete.\n\n");
+        fflush(stdout);
+        while (jobs->count > 0 || scheduler.count > 0) {
+            waitForChildEvent(childSignalFd);
+            processBackgroundJobs(jobs);
+            fflush(stdout);
+        }
+    }
+}
+
+// Open the job history named by SHELL2_HISTORY, or ~/.shell2_history, an empty name turns it off
+void openJobHistory() {
+    char* fileName = getenv("SHELL2_HISTORY");
+    char defaultName[4096];
+
+    if (fileName == NULL) {
+        char* home = getenv("HOME");
+        if (home == NULL) {
+            return;
+        }
+        snprintf(defaultName, sizeof(defaultName), "%s/.shell2_history", home);
+        fileName = defaultName;
+    }
+    if (fileName[0] == '\0') {
+        return;
+    }
+
+    if (openHistory(&history, fileName) == -1) {
+        printf("Unable to open the job history %s!\nError Number: %i\nError Message: %s\n", fileName, errno, strerror(errno));
+        return;
+    }
+    historyEnabled = TRUE;
+}
+
+// Append a finished job to the history, with the usage of all of its processes added together
+void recordJobHistory(struct job *job) {
+    if (!historyEnabled) {
+        return;
+    }
+
+    struct historyRecord record;
+    struct timespec now, realNow;
+    memset(&record, 0, sizeof(record));
+
+    record.argumentHash = HISTORY_HASH_SEED;
+    for (int i = 0; i < job->processCount; i++) {
+        struct process *process = &job->processes[i];
+        record.argumentHash = hashArguments(process->arguments, record.argumentHash);
+        addUsage(&record.stats, &process->stats);
+        if (processWallTime(job, process) > record.wallTime) {
+            record.wallTime = processWallTime(job, process);
+        }
+    }
+
+    // The job was timed on the monotonic clock, so work out when it started in real time
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    clock_gettime(CLOCK_REALTIME, &realNow);
+    record.startTime = realNow.tv_sec * 1000000000LL + realNow.tv_nsec - computeTimeDifference(job->startTime, now);
+
+    struct process *last = &job->processes[job->processCount - 1];
+    record.pid = last->pid;
+    record.status = last->status;
+    record.processCount = job->processCount;
+    strncpy(record.command, job->command, HISTORY_COMMAND_SIZE - 1);
+
+    appendHistory(&history, &record);
+}
+
+// Sleep until a child changes state, then report any background jobs that finished
+void waitForJobEvent(struct jobTable *jobs) {
+    fflush(stdout);
+    waitForChildEvent(childSignalFd);
+    processBackgroundJobs(jobs);
+}
+
+// Find the job named by "%n" or by the PID of any of its processes, or the newest job if there is no argument
+// Returns the job's slot, or -1 after printing an error
+int findJobArgument(struct jobTable *jobs, char* argument) {
+    int slot = -1;
+
+    if (argument == NULL) {
+        for (int i = jobs->capacity - 1; i >= 0 && slot == -1; i--) {
+            if (jobs->slots[i].processes != NULL) {
+                slot = i;
+            }
+        }
+        if (slot == -1) {
+            printf("There are no background jobs!\n");
+        }
+        return slot;
+    }
+
+    if (argument[0] == '%') {
+        slot = atoi(argument + 1) - 1;
+        if (slot < 0 || slot >= jobs->capacity || jobs->slots[slot].processes == NULL) {
+            slot = -1;
+        }
+    } else {
+        struct process *process;
+        slot = findJobSlot(jobs, atoi(argument), &process);
+    }
+    if (slot == -1) {
+        printf("There is no background job %s!\n", argument);
+    }
+    return slot;
+}
+
+// Run the wait builtin: "wait" waits for every running and queued job, "wait -n" for the next one to finish,
+// and "wait %n" or "wait pid" for one job
+// Stopped jobs would never finish, so they aren't waited for
+void runWaitBuiltin(struct jobTable *jobs, char** arguments) {
+    processBackgroundJobs(jobs);
+
+    if (arguments[1] == NULL) {
+        while (jobs->count > jobs->stoppedJobs || scheduler.count > 0) {
+            waitForJobEvent(jobs);
+        }
+        return;
+    }
+
+    if (strcmp(arguments[1], "-n") == 0) {
+        if (jobs->count == jobs->stoppedJobs && scheduler.count == 0) {
+            printf("There are no running background jobs to wait for.\n");
+            return;
+        }
+        long finished = jobs->finishedCount;
+        while (jobs->finishedCount == finished && (jobs->count > jobs->stoppedJobs || scheduler.count > 0)) {
+            waitForJobEvent(jobs);
+        }
+        return;
+    }
+
+    int slot = findJobArgument(jobs, arguments[1]);
+    if (slot == -1) {
+        return;
+    }
+
+    // Queued jobs can start while we wait and take over the slot, so follow the job by its last PID
+    // Starting them can also grow the job table, so the job is looked up again after every event
+    struct job *job = &jobs->slots[slot];
+    int pid = job->processes[job->processCount - 1].pid;
+    while (job->processes != NULL && job->processes[job->processCount - 1].pid == pid && !job->stopped) {
+        waitForJobEvent(jobs);
+        job = &jobs->slots[slot];
+    }
+    if (job->processes != NULL && job->processes[job->processCount - 1].pid == pid) {
+        printf("[%i] %s is stopped.\n", slot + 1, job->command);
+    }
+}
+
+// Put the shell in its own process group in the foreground of the terminal, and ignore the
+// signals meant for the jobs, so Ctrl-C and Ctrl-Z only reach the foreground job
+void setupJobControl(int fd) {
+    if (!isatty(fd)) {
+        return;
+    }
+
+    // If we were started in the background, wait until we are brought to the foreground
+    pid_t shellGroup;
+    while (tcgetpgrp(fd) != (shellGroup = getpgrp())) {
+        kill(-shellGroup, SIGTTIN);
+    }
+
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+
+    // This fails harmlessly if we already lead a session
+    setpgid(0, 0);
+    if (tcsetpgrp(fd, getpgrp()) == -1 || tcgetattr(fd, &shellModes) == -1) {
+        return;
+    }
+
+    terminalFd = fd;
+    jobControl = TRUE;
+}
+
+// Wait for the foreground job to finish or stop, then take the terminal back
+// A finished job is reported, and a stopped job goes into the job table
+void runForegroundJob(struct jobTable *jobs, struct job *job) {
+    if (liveEnabled) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        publishLiveJob(job, 0, now);
+    }
+
+    // Sleep on the signalfd until every stage finishes, reporting background jobs meanwhile
+    while (!reapChildren(jobs, job)) {
+        waitForChildEvent(childSignalFd);
+    }
+    if (liveEnabled) {
+        clearLiveRecord(&liveStats, 0);
+    }
+
+    if (jobControl) {
+        // Remember the terminal settings of a stopped job, like an editor's raw mode, for fg
+        if (job->stopped) {
+            job->savedModes = (tcgetattr(terminalFd, &job->terminalModes) == 0);
+        }
+        tcsetpgrp(terminalFd, getpgrp());
+        tcsetattr(terminalFd, TCSADRAIN, &shellModes);
+    }
+
+    if (job->stopped) {
+        // Its output is collected again while it is in the background
+        if (job->capture != NULL) {
+            job->capture->passThrough = FALSE;
+            if (blockedCapture == job->capture) {
+                resumeCapture();
+            }
+        }
+        int slot = storeBackgroundJob(jobs, job);
+        printf("\n[%i] Stopped %s\n", slot + 1, job->command);
+        return;
+    }
+
+    // Pass on the last of a captured or cached job's output before its statistics, waiting for stdout if it is full
+    if (job->capture != NULL) {
+        while (!drainCapture(job->capture, &captureSettings) && job->capture->blocked) {
+            struct pollfd output = {STDOUT_FILENO, POLLOUT, 0};
+            poll(&output, 1, -1);
+        }
+    }
+    if (job->cacheEntry != NULL) {
+        finishCachedJob(job);
+    }
+
+    // Print the statistics
+    printJobStatistics(job);
+    recordJobHistory(job);
+    freeJob(job);
+}
+
+// Send a signal to every process of a job, through its process group if it has one
+// Returns -1 if the signal couldn't be sent
+int signalJob(struct job *job, int signalNumber) {
+    if (job->pgid > 0) {
+        return kill(-job->pgid, signalNumber);
+    }
+
+    int result = 0;
+    for (int i = 0; i < job->processCount; i++) {
+        if (!job->processes[i].finished && kill(job->processes[i].pid, signalNumber) == -1) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+// Turn "9", "KILL" or "SIGKILL" into a signal number, or -1 if it isn't known
+int parseSignal(char* name) {
+    static const struct {
+        char* name;
+        int number;
+    } signalNames[] = {
+        {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL},
+        {"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"TERM", SIGTERM}, {"CONT", SIGCONT},
+        {"STOP", SIGSTOP}, {"TSTP", SIGTSTP}
+    };
+
+    if (name[0] >= '0' && name[0] <= '9') {
+        return atoi(name);
+    }
+    if (strncmp(name, "SIG", 3) == 0) {
+        name += 3;
+    }
+    for (int i = 0; i < (int) (sizeof(signalNames) / sizeof(signalNames[0])); i++) {
+        if (strcmp(name, signalNames[i].name) == 0) {
+            return signalNames[i].number;
+        }
+    }
+    return -1;
+}
+
+// Run the fg, bg, kill and stop builtins
+void runJobControlBuiltin(struct jobTable *jobs, char** arguments) {
+    char* builtin = arguments[0];
+    char* target = arguments[1];
+    int signalNumber = SIGTERM;
+
+    processBackgroundJobs(jobs);
+
+    // kill takes an optional signal before the job, and also works on any PID
+    if (strcmp(builtin, "kill") == 0) {
+        if (target != NULL && target[0] == '-') {
+            signalNumber = parseSignal(target + 1);
+            target = arguments[2];
+        }
+        if (signalNumber == -1 || target == NULL) {
+            printf("Usage: kill [-signal] %%job|pid\n");
+            return;
+        }
+
+        struct process *process;
+        if (target[0] != '%' && findJobSlot(jobs, atoi(target), &process) == -1) {
+            if (kill(atoi(target), signalNumber) == -1) {
+                printf("Unable to signal %s: %s\n", target, strerror(errno));
+            }
+            return;
+        }
+    } else if (strcmp(builtin, "stop") == 0 && target == NULL) {
+        printf("Usage: stop %%job|pid\n");
+        return;
+    }
+
+    int slot = findJobArgument(jobs, target);
+    if (slot == -1) {
+        return;
+    }
+    struct job *job = &jobs->slots[slot];
+
+    if (strcmp(builtin, "kill") == 0) {
+        if (signalJob(job, signalNumber) == -1) {
+            printf("Unable to signal job %i: %s\n", slot + 1, strerror(errno));
+        } else if (job->stopped && signalNumber != SIGKILL && signalNumber != SIGCONT) {
+            // A stopped job can't act on the signal until it runs again
+            signalJob(job, SIGCONT);
+        }
+    } else if (strcmp(builtin, "stop") == 0) {
+        if (signalJob(job, SIGSTOP) == -1) {
+            printf("Unable to stop job %i: %s\n", slot + 1, strerror(errno));
+        }
+    } else if (strcmp(builtin, "bg") == 0) {
+        printf("[%i] %s &\n", slot + 1, job->command);
+        if (signalJob(job, SIGCONT) == -1) {
+            printf("Unable to continue job %i: %s\n", slot + 1, strerror(errno));
+        }
+    } else {
+        // fg moves the job out of the table and waits for it like a new foreground job
+        struct job foreground = takeBackgroundJob(jobs, slot);
+        printf("%s\n", foreground.command);
+
+        // Show what a captured job has written so far, and let the rest through as it comes
+        if (foreground.capture != NULL) {
+            drainCapture(foreground.capture, &captureSettings);
+            writeCapture(foreground.capture, stdout);
+            resetCapture(foreground.capture);
+            foreground.capture->passThrough = TRUE;
+        }
+        fflush(stdout);
+
+        if (jobControl) {
+            tcsetpgrp(terminalFd, foreground.pgid);
+            if (foreground.savedModes) {
+                tcsetattr(terminalFd, TCSADRAIN, &foreground.terminalModes);
+            }
+        }
+        if (foreground.stopped) {
+            signalJob(&foreground, SIGCONT);
+        }
+        runForegroundJob(jobs, &foreground);
+    }
+}
+
+// Sleep until there is user input, reporting background jobs that finish while we wait
+void waitForInput(int fd, void* context) {
+    struct jobTable *jobs = context;
+
+    while (!waitForChildEvent(fd)) {
+        processBackgroundJobs(jobs);
+        fflush(stdout);
+    }
+}
+
+// Write a live record for a job, with the CPU time and resident size of its processes read from /proc
+// The foreground job goes in record 0 and each background job in the record after its slot
+void publishLiveJob(struct job *job, int index, struct timespec now) {
+    struct liveRecord record;
+    struct timespec realNow;
+    memset(&record, 0, sizeof(record));
+
+    for (int i = 0; i < job->processCount; i++) {
+        struct process *process = &job->processes[i];
+        long long cpuTime, rss;
+
+        // Reaped processes aren't in /proc any more, but their final usage is known
+        if (process->finished) {
+            record.cpuTime += timevalToMicroseconds(process->stats.ru_utime) * 1000LL + timevalToMicroseconds(process->stats.ru_stime) * 1000LL;
+        } else if (sampleProcess(process->pid, &cpuTime, &rss) == 0) {
+            record.cpuTime += cpuTime;
+            record.rss += rss;
+        }
+    }
+
+    // Leave out the time the job has spent stopped, like the final statistics do
+    long long elapsed = computeTimeDifference(job->startTime, now);
+    clock_gettime(CLOCK_REALTIME, &realNow);
+    record.startTime = realNow.tv_sec * 1000000000LL + realNow.tv_nsec - elapsed;
+    record.elapsed = elapsed - job->stoppedTime - (job->stopped ? computeTimeDifference(job->stopTime, now) : 0);
+    record.sampleTime = realNow.tv_sec * 1000000000LL + realNow.tv_nsec;
+
+    record.job = index;
+    record.pid = job->processes[job->processCount - 1].pid;
+    record.state = job->stopped ? LIVE_STOPPED : LIVE_RUNNING;
+    record.processCount = job->processCount;
+    strncpy(record.command, job->command, LIVE_COMMAND_SIZE - 1);
+
+    writeLiveRecord(&liveStats, index, &record);
+    startLiveTimer(&liveStats);
+}
+
+// Refresh the live record of every running job, and stop the timer once there are none
+void sampleLiveJobs(struct jobTable *jobs, struct job *foreground) {
+    struct timespec now, realNow;
+    liveSampleDue = FALSE;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (foreground != NULL && foreground->remaining > 0) {
+        publishLiveJob(foreground, 0, now);
+    }
+    for (int slot = 0, found = 0; found < jobs->count; slot++) {
+        if (jobs->slots[slot].processes != NULL) {
+            publishLiveJob(&jobs->slots[slot], slot + 1, now);
+            found++;
+        }
+    }
+
+    clock_gettime(CLOCK_REALTIME, &realNow);
+    __atomic_store_n(&liveStats.header->sampleTime, realNow.tv_sec * 1000000000LL + realNow.tv_nsec, __ATOMIC_RELEASE);
+
+    if (jobs->count == 0 && (foreground == NULL || foreground->remaining == 0)) {
+        stopLiveTimer(&liveStats);
+    }
+}
+
+// Remove the shared memory segment when the shell exits
+void removeLiveStats() {
+    closeLiveStats(&liveStats);
+}
+
+// Put a background job in the queue, to be started once there is room for it
+void queueBackgroundJob(char** arguments, int argumentCount, int nice, struct placement *placement, struct deadline *deadline) {
+    struct queuedJob *queued = enqueueJob(&scheduler, arguments, argumentCount, nice, placement, deadline);
+    printf("[q%li] queued %s\n", queued->id, arguments[0]);
+    startSchedulerTimer(&scheduler);
+    scheduleDue = TRUE;
+}
+
+// Start queued jobs, next in line first, for as long as the load and the job limit leave room
+// The load is only read once, so the jobs started here are counted against it
+void dispatchQueuedJobs(struct jobTable *jobs) {
+    static struct pipeline pipeline;
+    struct systemLoad load;
+
+    scheduleDue = FALSE;
+    if (scheduler.count == 0) {
+        stopSchedulerTimer(&scheduler);
+        return;
+    }
+    readSystemLoad(&load);
+
+    for (int admitted = 0; scheduler.count > 0; admitted++) {
+        int running = jobs->count - jobs->stoppedJobs;
+        if ((maxJobs > 0 && running >= maxJobs) || !admitJob(&load, running, admitted)) {
+            break;
+        }
+
+        // The command was checked when it was queued, so it only fails here if it can't be started
+        struct queuedJob *queued = dequeueJob(&scheduler);
+        struct job job;
+        fflush(stdout);
+        if (parsePipeline(queued->arguments, queued->argumentCount, &pipeline) && launchPipeline(&pipeline, &job, &commandHash, TRUE, queued->nice, &queued->placement, NULL) > 0) {
+            job.deadline = queued->deadline;
+            startDeadline(&job.deadline, job.startTime);
+            job.queueWait = computeTimeDifference(queued->submitTime, job.startTime);
+            int slot = storeBackgroundJob(jobs, &job);
+            printJobInfo(jobs, slot);
+        }
+        freeQueuedJob(queued);
+    }
+
+    if (scheduler.count == 0) {
+        stopSchedulerTimer(&scheduler);
+    }
+}
+
+// Move the output of every captured job that has written something into its buffer
+void drainCaptures() {
+    struct epoll_event events[64];
+    int count;
+
+    captureDue = FALSE;
+    do {
+        count = epoll_wait(captureEpollFd, events, 64, 0);
+        for (int i = 0; i < count; i++) {
+            struct capture *capture = events[i].data.ptr;
+            if (!drainCapture(capture, &captureSettings) && capture->blocked) {
+                pauseCapture(capture);
+            }
+        }
+    } while (count == 64);
+}
+
+// Stop watching a passed through job's output while stdout is full, and watch stdout instead,
+// since the pipe would stay readable and keep waking us up
+void pauseCapture(struct capture *capture) {
+    epoll_ctl(captureEpollFd, EPOLL_CTL_DEL, capture->pipeFd, NULL);
+    blockedCapture = capture;
+}
+
+// Watch the blocked job's output again once stdout has room, and pass on what is waiting
+void resumeCapture() {
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = blockedCapture;
+    epoll_ctl(captureEpollFd, EPOLL_CTL_ADD, blockedCapture->pipeFd, &event);
+    blockedCapture->blocked = FALSE;
+    blockedCapture = NULL;
+    captureDue = TRUE;
+}
+
+// Run the output builtin: "output %n" or "output pid" prints what the job has written so far,
+// and "output" does the same for the newest job
+void runOutputBuiltin(struct jobTable *jobs, char** arguments) {
+    processBackgroundJobs(jobs);
+
+    int slot = findJobArgument(jobs, arguments[1]);
+    if (slot == -1) {
+        return;
+    }
+    struct job *job = &jobs->slots[slot];
+    if (job->capture == NULL) {
+        printf("The output of job %i isn't being captured.\n", slot + 1);
+        return;
+    }
+    drainCapture(job->capture, &captureSettings);
+    writeCapture(job->capture, stdout);
+}
+
+// Look up a cached command, and on a hit write out its stored output and statistics as if it had just run
+// Returns TRUE on a hit, and FALSE if the command has to be run
+int replayCachedJob(char** arguments, char* key) {
+    struct cachedResult result;
+    struct timespec beforeTime, afterTime;
+    int outputFd, errorFd;
+
+    clock_gettime(CLOCK_MONOTONIC, &beforeTime);
+    if (!lookupCache(cacheDirectory, key, &result, &outputFd, &errorFd)) {
+        return FALSE;
+    }
+    fflush(stdout);
+    replayCachedOutput(outputFd, result.outputSize, STDOUT_FILENO);
+    replayCachedOutput(errorFd, result.errorSize, STDERR_FILENO);
+    close(outputFd);
+    close(errorFd);
+    clock_gettime(CLOCK_MONOTONIC, &afterTime);
+
+    // Nothing ran, so there is no usage to report, just the time the real run would have taken
+    long long savedTime = result.wallTime - computeTimeDifference(beforeTime, afterTime);
+    countCacheResult(cacheDirectory, TRUE, savedTime);
+
+    struct rusage noStats;
+    memset(&noStats, 0, sizeof(noStats));
+    struct commandRecord record = {.command = arguments[0], .arguments = arguments, .status = result.status, .stats = noStats, .startTime = beforeTime, .endTime = afterTime, .cache = CACHE_HIT, .savedTime = savedTime, .node = -1};
+    writeStatsRecord(&statsOutput, &record);
+    return TRUE;
+}
+
+// Pass on the output of a cached job that missed, and store its result under the last stage's exit status
+// Jobs that were killed, timed out or had a stage fail to exit normally aren't stored
+void finishCachedJob(struct job *job) {
+    struct cacheEntry *entry = job->cacheEntry;
+    struct process *last = &job->processes[job->processCount - 1];
+    struct cachedResult result;
+    int storable = !job->deadline.timedOut;
+
+    memset(&result, 0, sizeof(result));
+    result.status = last->status;
+    result.stats = last->stats;
+    for (int i = 0; i < job->processCount; i++) {
+        storable = storable && WIFEXITED(job->processes[i].status);
+        if (processWallTime(job, &job->processes[i]) > result.wallTime) {
+            result.wallTime = processWallTime(job, &job->processes[i]);
+        }
+    }
+    result.outputSize = lseek(entry->outputFd, 0, SEEK_END);
+    result.errorSize = lseek(entry->errorFd, 0, SEEK_END);
+
+    fflush(stdout);
+    replayCachedOutput(entry->outputFd, result.outputSize, STDOUT_FILENO);
+    replayCachedOutput(entry->errorFd, result.errorSize, STDERR_FILENO);
+
+    if (storable) {
+        commitCacheEntry(entry, &result, cacheSize);
+    } else {
+        abortCacheEntry(entry);
+    }
+    job->cacheEntry = NULL;
+    job->cache = CACHE_MISS;
+    countCacheResult(cacheDirectory, FALSE, 0);
 }
@@ -0,0 +1,590 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+
+// What each size is run with unless the sizes are given
+#define DEFAULT_SIZES "10,100,1000,10000,100000"
+#define DEFAULT_PROBES 100
+
+// Give up on a shell that says nothing for this long
+#define STALL_TIMEOUT 60000
+
+// A rough upper bound on what each held job costs the system, for skipping sizes that can't fit
+#define JOB_MEMORY_KB 512
+
+#define OUTPUT_BUFFER_SIZE 65536
+
+// The shell being measured, and the pipes its input and output go through
+struct benchShell {
+    int pid;
+    int inputFd;
+    int outputFd;
+    char buffer[OUTPUT_BUFFER_SIZE];
+    int length;
+    int prompts;
+};
+
+// What the jobs and the shell have said during one run, indexed by job number
+// Reports are the "Job ... has finished" lines, kept by PID until they are matched with the exits
+struct benchRun {
+    int jobs;
+    int reportFd;
+    char reportBuffer[OUTPUT_BUFFER_SIZE];
+    int reportLength;
+    long long *writeTime;
+    long long *startTime;
+    long long *exitTime;
+    int *pids;
+    int started;
+    int exited;
+    long long *reportPids;
+    long long *reportTime;
+    int reported;
+};
+
+// The shell's own CPU time and memory, read from /proc
+struct shellUsage {
+    long long cpuTime;
+    long long rss;
+    long long maxRss;
+};
+
+void printUsage(char* programName);
+int runJob(char* reportPath, char* gatePath, int index);
+long long now();
+int startShell(struct benchShell *shell, char* shellPath);
+int readShellOutput(struct benchShell *shell, struct benchRun *run);
+void readReports(struct benchRun *run);
+int waitForShell(struct benchShell *shell, struct benchRun *run, int prompts, int started, int exited, int reported);
+int sendCommand(struct benchShell *shell, char* command);
+void readShellUsage(int pid, struct shellUsage *usage);
+char* checkCapacity(int jobs);
+int runSize(char* shellPath, char* jobPath, char* directory, int jobs, int probes, int first);
+void printDistribution(char* name, long long *values, int count);
+int compareValues(const void* first, const void* second);
+
+int main(int argc, char* argv[]) {
+    static struct option longOptions[] = {
+        {"shell", required_argument, NULL, 's'},
+        {"sizes", required_argument, NULL, 'n'},
+        {"probes", required_argument, NULL, 'p'},
+        {"job", no_argument, NULL, 'J'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    char* shellPath = "./shell2";
+    char* sizes = DEFAULT_SIZES;
+    int probes = DEFAULT_PROBES;
+    int job = 0;
+    int option;
+
+    while ((option = getopt_long(argc, argv, "s:n:p:h", longOptions, NULL)) != -1) {
+        switch (option) {
+        case 's':
+            shellPath = optarg;
+            break;
+        case 'n':
+            sizes = optarg;
+            break;
+        case 'p':
+            probes = atoi(optarg);
+            break;
+        case 'J':
+            job = 1;
+            break;
+        default:
+            printUsage(argv[0]);
+            exit(option == 'h' ? 0 : 1);
+        }
+    }
+
+    // The jobs the shell runs are this program too
+    if (job) {
+        if (argc - optind != 3) {
+            exit(1);
+        }
+        return runJob(argv[optind], argv[optind + 1], atoi(argv[optind + 2]));
+    }
+
+    char jobPath[4096];
+    ssize_t length = readlink("/proc/self/exe", jobPath, sizeof(jobPath) - 1);
+    if (length == -1) {
+        perror("readlink");
+        exit(1);
+    }
+    jobPath[length] = '\0';
+
+    char directory[] = "/tmp/shellbench.XXXXXX";
+    if (mkdtemp(directory) == NULL) {
+        perror("mkdtemp");
+        exit(1);
+    }
+
+    // A job that writes to a shell that died shouldn't take us with it
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("{\"shell\":\"%s\",\"results\":[", shellPath);
+    int first = 1;
+    for (char* size = strtok(sizes, ","); size != NULL; size = strtok(NULL, ",")) {
+        int jobs = atoi(size);
+        if (jobs <= 0) {
+            continue;
+        }
+        runSize(shellPath, jobPath, directory, jobs, probes, first);
+        first = 0;
+    }
+    printf("]}\n");
+
+    rmdir(directory);
+    return 0;
+}
+
+// Print the options
+void printUsage(char* programName) {
+    printf("Usage: %s [-s shell] [-n sizes] [-p probes]\n", programName);
+    printf("  -s, --shell path    the shell to measure (default ./shell2)\n");
+    printf("  -n, --sizes list    comma-separated numbers of concurrent jobs (default %s)\n", DEFAULT_SIZES);
+    printf("  -p, --probes count  prompt round trips to time while the jobs are live (default %i)\n", DEFAULT_PROBES);
+    printf("Starts each number of background jobs in the shell, holds them all live, then lets them exit at once.\n");
+    printf("Prints the launch latency, exit-to-report latency, prompt latency and the shell's CPU and memory as JSON.\n");
+}
+
+// Run as one of the benchmark's jobs: say when we started, hold until the gate closes, and say when we exit
+// The gate is a FIFO the benchmark keeps open for writing, so reading it returns once the benchmark closes it
+int runJob(char* reportPath, char* gatePath, int index) {
+    char line[128];
+
+    int reportFd = open(reportPath, O_WRONLY);
+    if (reportFd == -1) {
+        return 1;
+    }
+    int length = snprintf(line, sizeof(line), "S %i %i %lli\n", index, getpid(), now());
+    write(reportFd, line, length);
+
+    // Opening without blocking means a gate that is already closed reads as closed straight away
+    int gateFd = open(gatePath, O_RDONLY | O_NONBLOCK);
+    if (gateFd != -1) {
+        fcntl(gateFd, F_SETFL, 0);
+        ssize_t result;
+        while ((result = read(gateFd, line, sizeof(line))) > 0 || (result == -1 && errno == EINTR)) {
+        }
+    }
+
+    // Lines this short are written to the FIFO in one piece, even with every job writing at once
+    length = snprintf(line, sizeof(line), "E %i %i %lli\n", index, getpid(), now());
+    write(reportFd, line, length);
+    return 0;
+}
+
+// The monotonic clock in nanoseconds, which is the same for every process
+long long now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000000000LL + time.tv_nsec;
+}
+
+// Start the shell with pipes for its input and output, with prompts on and its statistics and history thrown away
+// Returns -1 if it couldn't be started
+int startShell(struct benchShell *shell, char* shellPath) {
+    int inputPipe[2], outputPipe[2];
+
+    if (pipe2(inputPipe, O_CLOEXEC) == -1) {
+        return -1;
+    }
+    if (pipe2(outputPipe, O_CLOEXEC) == -1) {
+        close(inputPipe[0]);
+        close(inputPipe[1]);
+        return -1;
+    }
+
+    shell->pid = fork();
+    if (shell->pid == 0) {
+        dup2(inputPipe[0], STDIN_FILENO);
+        dup2(outputPipe[1], STDOUT_FILENO);
+        signal(SIGPIPE, SIG_DFL);
+        setenv("STATS_FILE", "/dev/null", 1);
+        setenv("SHELL2_HISTORY", "", 1);
+        execl(shellPath, shellPath, "-i", (char*) NULL);
+        _exit(127);
+    }
+    close(inputPipe[0]);
+    close(outputPipe[1]);
+    if (shell->pid == -1) {
+        close(inputPipe[1]);
+        close(outputPipe[0]);
+        return -1;
+    }
+    shell->inputFd = inputPipe[1];
+    shell->outputFd = outputPipe[0];
+    shell->length = 0;
+    shell->prompts = 0;
+    return 0;
+}
+
+// Read what the shell has written, counting prompts and noting the time each job was reported
+// Returns -1 once the shell has closed its output
+int readShellOutput(struct benchShell *shell, struct benchRun *run) {
+    ssize_t length = read(shell->outputFd, shell->buffer + shell->length, sizeof(shell->buffer) - shell->length);
+    if (length <= 0) {
+        return (length == -1 && errno == EINTR) ? 0 : -1;
+    }
+    long long time = now();
+    shell->length += length;
+
+    // A prompt isn't followed by a newline, so it is taken off the front of a line by itself
+    int offset = 0;
+    while (offset < shell->length) {
+        char* line = shell->buffer + offset;
+        if (shell->length - offset >= 3 && strncmp(line, "-> ", 3) == 0) {
+            shell->prompts++;
+            offset += 3;
+            continue;
+        }
+        char* end = memchr(line, '\n', shell->length - offset);
+        if (end == NULL) {
+            break;
+        }
+        *end = '\0';
+        char* pid = strstr(line, " with PID ");
+        if (strncmp(line, "Job ", 4) == 0 && pid != NULL && run->reported < run->jobs) {
+            run->reportPids[run->reported] = atoll(pid + strlen(" with PID "));
+            run->reportTime[run->reported++] = time;
+        }
+        offset = end + 1 - shell->buffer;
+    }
+
+    // A line longer than the buffer is dropped, the ones we want are short
+    if (offset == 0 && shell->length == sizeof(shell->buffer)) {
+        offset = shell->length;
+    }
+    memmove(shell->buffer, shell->buffer + offset, shell->length - offset);
+    shell->length -= offset;
+    return 0;
+}
+
+// Read the start and exit times the jobs have written into the report FIFO
+void readReports(struct benchRun *run) {
+    ssize_t length = read(run->reportFd, run->reportBuffer + run->reportLength, sizeof(run->reportBuffer) - run->reportLength);
+    if (length <= 0) {
+        return;
+    }
+    run->reportLength += length;
+
+    int offset = 0;
+    char* end;
+    while ((end = memchr(run->reportBuffer + offset, '\n', run->reportLength - offset)) != NULL) {
+        char kind;
+        int index, pid;
+        long long time;
+        *end = '\0';
+        if (sscanf(run->reportBuffer + offset, "%c %i %i %lli", &kind, &index, &pid, &time) == 4 && index >= 0 && index < run->jobs) {
+            if (kind == 'S') {
+                run->startTime[index] = time;
+                run->pids[index] = pid;
+                run->started++;
+            } else {
+                run->exitTime[index] = time;
+                run->exited++;
+            }
+        }
+        offset = end + 1 - run->reportBuffer;
+    }
+    memmove(run->reportBuffer, run->reportBuffer + offset, run->reportLength - offset);
+    run->reportLength -= offset;
+}
+
+// Wait for the shell's output and the jobs' reports until there have been at least this many prompts, starts, exits and reports
+// Returns -1 if the shell exited or went quiet for too long
+int waitForShell(struct benchShell *shell, struct benchRun *run, int prompts, int started, int exited, int reported) {
+    struct pollfd fds[2] = {{shell->outputFd, POLLIN, 0}, {run->reportFd, POLLIN, 0}};
+
+    while (shell->prompts < prompts || run->started < started || run->exited < exited || run->reported < reported) {
+        int ready = poll(fds, 2, STALL_TIMEOUT);
+        if (ready == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ready <= 0) {
+            return -1;
+        }
+        if (fds[1].revents & POLLIN) {
+            readReports(run);
+        }
+        if ((fds[0].revents & (POLLIN | POLLHUP)) && readShellOutput(shell, run) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Send the shell one line
+// Returns -1 if the shell isn't reading anymore
+int sendCommand(struct benchShell *shell, char* command) {
+    size_t length = strlen(command);
+    for (size_t written = 0; written < length; ) {
+        ssize_t result = write(shell->inputFd, command + written, length - written);
+        if (result == -1 && errno != EINTR) {
+            return -1;
+        }
+        written += (result > 0) ? result : 0;
+    }
+    return 0;
+}
+
+// Read the shell's CPU time in nanoseconds and its current and peak resident size in kilobytes
+// Only the shell itself is counted, not the jobs it has reaped
+void readShellUsage(int pid, struct shellUsage *usage) {
+    char path[64], line[1024];
+
+    // schedstat has the time on the CPU in nanoseconds, stat only has it in clock ticks
+    memset(usage, 0, sizeof(struct shellUsage));
+    snprintf(path, sizeof(path), "/proc/%i/schedstat", pid);
+    FILE* file = fopen(path, "r");
+    if (file != NULL) {
+        if (fscanf(file, "%lli", &usage->cpuTime) != 1) {
+            usage->cpuTime = 0;
+        }
+        fclose(file);
+    }
+    snprintf(path, sizeof(path), "/proc/%i/stat", pid);
+    file = (usage->cpuTime == 0) ? fopen(path, "r") : NULL;
+    if (file != NULL) {
+        // The command name can have spaces, so start after its closing parenthesis
+        if (fgets(line, sizeof(line), file) != NULL && strrchr(line, ')') != NULL) {
+            unsigned long long userTicks, systemTicks;
+            if (sscanf(strrchr(line, ')') + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &userTicks, &systemTicks) == 2) {
+                usage->cpuTime = (userTicks + systemTicks) * (1000000000LL / sysconf(_SC_CLK_TCK));
+            }
+        }
+        fclose(file);
+    }
+
+    snprintf(path, sizeof(path), "/proc/%i/status", pid);
+    file = fopen(path, "r");
+    if (file != NULL) {
+        while (fgets(line, sizeof(line), file) != NULL) {
+            sscanf(line, "VmRSS: %lli", &usage->rss);
+            sscanf(line, "VmHWM: %lli", &usage->maxRss);
+        }
+        fclose(file);
+    }
+}
+
+// Check that the system can hold this many jobs at once, along with whatever else is running
+// Returns why it can't, or NULL if it can
+char* checkCapacity(int jobs) {
+    struct rlimit limit;
+    long long value;
+    char line[256];
+
+    FILE* file = fopen("/proc/sys/kernel/pid_max", "r");
+    if (file != NULL) {
+        if (fscanf(file, "%lli", &value) == 1 && jobs + 1000 > value) {
+            fclose(file);
+            return "pid_max";
+        }
+        fclose(file);
+    }
+
+    if (getrlimit(RLIMIT_NPROC, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY && (rlim_t) jobs + 100 > limit.rlim_cur) {
+        return "RLIMIT_NPROC";
+    }
+
+    file = fopen("/proc/meminfo", "r");
+    if (file != NULL) {
+        while (fgets(line, sizeof(line), file) != NULL) {
+            if (sscanf(line, "MemAvailable: %lli", &value) == 1 && (long long) jobs * JOB_MEMORY_KB > value) {
+                fclose(file);
+                return "memory";
+            }
+        }
+        fclose(file);
+    }
+    return NULL;
+}
+
+// Run one size: start the jobs one prompt at a time, time prompts while they are all live,
+// then open the gate and time how long each exit takes to be reported
+// Prints the JSON object for the size, and returns -1 if the shell didn't make it through
+int runSize(char* shellPath, char* jobPath, char* directory, int jobs, int probes, int first) {
+    struct benchShell shell;
+    struct benchRun run;
+    char reportPath[4200], gatePath[4200];
+    char* command = NULL;
+
+    printf("%s\n{\"jobs\":%i", first ? "" : ",", jobs);
+    char* reason = checkCapacity(jobs);
+    if (reason != NULL) {
+        printf(",\"skipped\":\"%s\"}", reason);
+        fprintf(stderr, "Skipping %i jobs, there isn't enough room (%s)\n", jobs, reason);
+        return -1;
+    }
+    fprintf(stderr, "Running %i jobs\n", jobs);
+
+    // We hold both FIFOs open for reading and writing, so opening them never blocks and the jobs see the gate close only when we close it
+    snprintf(reportPath, sizeof(reportPath), "%s/report", directory);
+    snprintf(gatePath, sizeof(gatePath), "%s/gate", directory);
+    if (mkfifo(reportPath, 0600) == -1 || mkfifo(gatePath, 0600) == -1) {
+        printf(",\"error\":\"mkfifo\"}");
+        unlink(reportPath);
+        return -1;
+    }
+    memset(&run, 0, sizeof(run));
+    shell.pid = -1;
+    run.jobs = jobs;
+    run.reportFd = open(reportPath, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    int gateFd = open(gatePath, O_RDWR | O_CLOEXEC);
+    run.writeTime = calloc(jobs, sizeof(long long));
+    run.startTime = calloc(jobs, sizeof(long long));
+    run.exitTime = calloc(jobs, sizeof(long long));
+    run.pids = calloc(jobs, sizeof(int));
+    run.reportPids = calloc(jobs, sizeof(long long));
+    run.reportTime = calloc(jobs, sizeof(long long));
+    long long *launchRoundTrip = calloc(jobs, sizeof(long long));
+    long long *probeRoundTrip = calloc(probes > 0 ? probes : 1, sizeof(long long));
+
+    int failed = (run.reportFd == -1 || gateFd == -1 || startShell(&shell, shellPath) == -1);
+    if (!failed) {
+        failed = waitForShell(&shell, &run, 1, 0, 0, 0);
+    }
+
+    // Each launch waits for the next prompt, so the latency is the shell's and not a queue of our own
+    long long launchBegin = now();
+    for (int i = 0; i < jobs && !failed; i++) {
+        free(command);
+        asprintf(&command, "%s --job %s %s %i &\n", jobPath, reportPath, gatePath, i);
+        run.writeTime[i] = now();
+        failed = sendCommand(&shell, command) == -1 || waitForShell(&shell, &run, shell.prompts + 1, 0, 0, 0) == -1;
+        launchRoundTrip[i] = now() - run.writeTime[i];
+    }
+    long long launchTime = now() - launchBegin;
+
+    // Every job is live and held at the gate once it has said it started
+    struct shellUsage launchUsage, finalUsage;
+    if (!failed) {
+        failed = waitForShell(&shell, &run, 0, jobs, 0, 0);
+    }
+    readShellUsage(shell.pid, &launchUsage);
+
+    // cd runs in the shell without starting anything, so it times the prompt alone
+    for (int i = 0; i < probes && !failed; i++) {
+        long long probeStart = now();
+        failed = sendCommand(&shell, "cd .\n") == -1 || waitForShell(&shell, &run, shell.prompts + 1, 0, 0, 0) == -1;
+        probeRoundTrip[i] = now() - probeStart;
+    }
+
+    // Let every job exit at once and wait for all of them to be reported
+    // The clock starts first, since closing the gate wakes every job and we may not run again for a while
+    long long reapBegin = now();
+    close(gateFd);
+    gateFd = -1;
+    if (!failed) {
+        failed = waitForShell(&shell, &run, 0, jobs, jobs, jobs);
+    }
+    long long reapTime = now() - reapBegin;
+    readShellUsage(shell.pid, &finalUsage);
+
+    if (shell.pid > 0) {
+        sendCommand(&shell, "exit\n");
+        close(shell.inputFd);
+        close(shell.outputFd);
+        if (failed) {
+            kill(shell.pid, SIGKILL);
+        }
+        waitpid(shell.pid, NULL, 0);
+    }
+
+    if (failed) {
+        printf(",\"error\":\"the shell stopped responding after %i of %i jobs started\"}", run.started, jobs);
+        fprintf(stderr, "The shell stopped responding after %i of %i jobs started\n", run.started, jobs);
+    } else {
+        // Launch latency runs from writing the line to the job running, report latency from the job exiting to its line
+        long long *launchLatency = calloc(jobs, sizeof(long long));
+        long long *reportLatency = calloc(jobs, sizeof(long long));
+        for (int i = 0; i < jobs; i++) {
+            launchLatency[i] = run.startTime[i] - run.writeTime[i];
+        }
+
+        // Match the reports to the exits by PID, both sorted by PID next to their times
+        long long *exits = calloc(jobs * 2, sizeof(long long));
+        long long *reports = calloc(jobs * 2, sizeof(long long));
+        for (int i = 0; i < jobs; i++) {
+            exits[i * 2] = run.pids[i];
+            exits[i * 2 + 1] = run.exitTime[i];
+            reports[i * 2] = run.reportPids[i];
+            reports[i * 2 + 1] = run.reportTime[i];
+        }
+        qsort(exits, jobs, sizeof(long long) * 2, compareValues);
+        qsort(reports, jobs, sizeof(long long) * 2, compareValues);
+        for (int i = 0; i < jobs; i++) {
+            reportLatency[i] = reports[i * 2 + 1] - exits[i * 2 + 1];
+        }
+
+        printf(",\"launch_rate\":%.1f", jobs / (launchTime / 1000000000.0));
+        printDistribution("launch_us", launchLatency, jobs);
+        printDistribution("launch_prompt_us", launchRoundTrip, jobs);
+        printDistribution("report_us", reportLatency, jobs);
+        printDistribution("prompt_us", probeRoundTrip, probes);
+        printf(",\"reap_all_us\":%lli", reapTime / 1000);
+        printf(",\"shell_cpu_us\":{\"launch\":%lli,\"total\":%lli}", launchUsage.cpuTime / 1000, finalUsage.cpuTime / 1000);
+        printf(",\"shell_rss_kb\":{\"live\":%lli,\"after\":%lli,\"max\":%lli}}", launchUsage.rss, finalUsage.rss, finalUsage.maxRss);
+
+        free(launchLatency);
+        free(reportLatency);
+        free(exits);
+        free(reports);
+    }
+    fflush(stdout);
+
+    if (gateFd != -1) {
+        close(gateFd);
+    }
+    if (run.reportFd != -1) {
+        close(run.reportFd);
+    }
+    unlink(reportPath);
+    unlink(gatePath);
+    free(command);
+    free(run.writeTime);
+    free(run.startTime);
+    free(run.exitTime);
+    free(run.pids);
+    free(run.reportPids);
+    free(run.reportTime);
+    free(launchRoundTrip);
+    free(probeRoundTrip);
+    return failed ? -1 : 0;
+}
+
+// Print the median, 90th and 99th percentiles, maximum and mean of some nanosecond times, in microseconds
+void printDistribution(char* name, long long *values, int count) {
+    if (count <= 0) {
+        return;
+    }
+    qsort(values, count, sizeof(long long), compareValues);
+
+    long long total = 0;
+    for (int i = 0; i < count; i++) {
+        total += values[i];
+    }
+    printf(",\"%s\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f,\"mean\":%.1f}", name,
+        values[count / 2] / 1000.0, values[count * 9 / 10] / 1000.0, values[count * 99 / 100] / 1000.0,
+        values[count - 1] / 1000.0, total / 1000.0 / count);
+}
+
+// Order times, or pairs of PIDs and times by their PID
+int compareValues(const void* first, const void* second) {
+    long long a = *(const long long*) first, b = *(const long long*) second;
+    return (a > b) - (a < b);
+}
@@ -0,0 +1,347 @@
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "stats.h"
+
+int parseStatsFormat(char* format);
+void writeCSVString(FILE* file, char* string);
+void writeJSONRecord(struct statsOutput *output, struct commandRecord *record);
+void writeCSVRecord(struct statsOutput *output, struct commandRecord *record);
+void writeCount(FILE* file, char* separator, long long count, char* missing);
+void printPerfStatistics(FILE* file, struct perfCounts *counts);
+
+// How each CACHE_ value is written in the JSON and CSV output
+static char* cacheResults[] = {"", "miss", "hit"};
+
+// Turn a format name into one of the STATS_ constants, or -1 if it isn't known
+int parseStatsFormat(char* format) {
+    if (strcmp(format, "human") == 0) {
+        return STATS_HUMAN;
+    } else if (strcmp(format, "json") == 0) {
+        return STATS_JSON;
+    } else if (strcmp(format, "csv") == 0) {
+        return STATS_CSV;
+    }
+    return -1;
+}
+
+// Set up the statistics output, using STATS_FORMAT, STATS_FILE and STATS_FD for anything not given
+// Records go to stdout unless a file name or descriptor is given
+// Returns 0 on success, or -1 after printing an error
+int openStatsOutput(struct statsOutput *output, char* format, char* fileName, int fd, int banner) {
+    output->banner = banner;
+    output->wroteHeader = 0;
+    output->perf = 0;
+    output->file = stdout;
+
+    if (format == NULL) {
+        format = getenv("STATS_FORMAT");
+    }
+    output->format = (format == NULL) ? STATS_HUMAN : parseStatsFormat(format);
+    if (output->format == -1) {
+        printf("Unknown statistics format %s, expected human, json or csv!\n", format);
+        return -1;
+    }
+
+    if (fileName == NULL && fd == -1) {
+        fileName = getenv("STATS_FILE");
+        if (fileName == NULL && getenv("STATS_FD") != NULL) {
+            fd = atoi(getenv("STATS_FD"));
+        }
+    }
+
+    if (fileName != NULL) {
+        output->file = fopen(fileName, "a");
+    } else if (fd != -1 && fd != STDOUT_FILENO) {
+        output->file = fdopen(fd, "a");
+    }
+    if (output->file == NULL) {
+        printf("Unable to open the statistics output!\nError Number: %i\nError Message: %s\n", errno, strerror(errno));
+        output->file = stdout;
+        return -1;
+    }
+
+    // Collect whole records in a large buffer so logging doesn't cost a write per field
+    if (output->file != stdout) {
+        setvbuf(output->file, NULL, _IOFBF, STATS_BUFFER_SIZE);
+    }
+
+    return 0;
+}
+
+// Push out any buffered records, for example before the shell goes idle
+void flushStatsOutput(struct statsOutput *output) {
+    fflush(output->file);
+}
+
+// Write the statistics for a finished command in the configured format
+void writeStatsRecord(struct statsOutput *output, struct commandRecord *record) {
+    if (output->format == STATS_JSON) {
+        writeJSONRecord(output, record);
+    } else if (output->format == STATS_CSV) {
+        writeCSVRecord(output, record);
+    } else {
+        printChildStatistics(output, record);
+    }
+}
+
+// Write a string as a quoted JSON string
+void writeJSONString(FILE* file, char* string) {
+    putc('"', file);
+    for (unsigned char* c = (unsigned char*) string; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(file, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(file, "\\u%04x", *c);
+        } else {
+            putc(*c, file);
+        }
+    }
+    putc('"', file);
+}
+
+// Write a string as a quoted CSV field
+void writeCSVString(FILE* file, char* string) {
+    putc('"', file);
+    for (char* c = string; *c != '\0'; c++) {
+        if (*c == '"') {
+            putc('"', file);
+        }
+        putc(*c, file);
+    }
+    putc('"', file);
+}
+
+// Write one JSON object per line
+void writeJSONRecord(struct statsOutput *output, struct commandRecord *record) {
+    FILE* file = output->file;
+    struct rusage *stats = &record->stats;
+
+    fprintf(file, "{\"pid\":%i,\"command\":", record->pid);
+    writeJSONString(file, record->command);
+    fprintf(file, ",\"argv\":[");
+    for (int i = 0; record->arguments != NULL && record->arguments[i] != NULL; i++) {
+        if (i > 0) {
+            putc(',', file);
+        }
+        writeJSONString(file, record->arguments[i]);
+    }
+    fprintf(file, "],\"exit_code\":%i,\"signal\":%i", WIFEXITED(record->status) ? WEXITSTATUS(record->status) : -1, WIFSIGNALED(record->status) ? WTERMSIG(record->status) : 0);
+    fprintf(file, ",\"wall_us\":%lli,\"user_us\":%li,\"sys_us\":%li", computeTimeDifference(record->startTime, record->endTime) / 1000, timevalToMicroseconds(stats->ru_utime), timevalToMicroseconds(stats->ru_stime));
+    fprintf(file, ",\"voluntary_ctxsw\":%li,\"involuntary_ctxsw\":%li", stats->ru_nvcsw, stats->ru_nivcsw);
+    fprintf(file, ",\"minor_faults\":%li,\"major_faults\":%li,\"max_rss_kb\":%li", stats->ru_minflt, stats->ru_majflt, stats->ru_maxrss);
+    fprintf(file, ",\"timed_out\":%s,\"queue_wait_us\":%lli", record->timedOut ? "true" : "false", record->queueWait / 1000);
+    if (record->cache != CACHE_UNUSED) {
+        fprintf(file, ",\"cache\":\"%s\",\"saved_us\":%lli", cacheResults[record->cache], record->savedTime / 1000);
+    }
+    if (record->cpus != NULL) {
+        fprintf(file, ",\"cpus\":\"%s\"", record->cpus);
+        if (record->node >= 0) {
+            fprintf(file, ",\"node\":%i", record->node);
+        }
+    }
+
+    if (record->perf != NULL) {
+        struct perfCounts *counts = record->perf;
+        double instructionsPerCycle = computeInstructionsPerCycle(counts);
+        writeCount(file, ",\"cycles\":", counts->values[PERF_CYCLES], "null");
+        writeCount(file, ",\"instructions\":", counts->values[PERF_INSTRUCTIONS], "null");
+        if (instructionsPerCycle < 0) {
+            fprintf(file, ",\"ipc\":null");
+        } else {
+            fprintf(file, ",\"ipc\":%.3f", instructionsPerCycle);
+        }
+        writeCount(file, ",\"cache_misses\":", counts->values[PERF_CACHE_MISSES], "null");
+        writeCount(file, ",\"branch_misses\":", counts->values[PERF_BRANCH_MISSES], "null");
+        writeCount(file, ",\"task_clock_us\":", counts->values[PERF_TASK_CLOCK] < 0 ? -1 : counts->values[PERF_TASK_CLOCK] / 1000, "null");
+    }
+    fprintf(file, "}\n");
+}
+
+// Write a counter after the separator, or the missing text when it wasn't available
+void writeCount(FILE* file, char* separator, long long count, char* missing) {
+    fputs(separator, file);
+    if (count >= 0) {
+        fprintf(file, "%lli", count);
+    } else {
+        fputs(missing, file);
+    }
+}
+
+// Write one CSV row per command, with a header before the first one
+void writeCSVRecord(struct statsOutput *output, struct commandRecord *record) {
+    FILE* file = output->file;
+    struct rusage *stats = &record->stats;
+
+    if (!output->wroteHeader) {
+        fprintf(file, "pid,command,argv,exit_code,signal,wall_us,user_us,sys_us,voluntary_ctxsw,involuntary_ctxsw,minor_faults,major_faults,max_rss_kb,timed_out,queue_wait_us,cache,saved_us,cpus,node");
+        fprintf(file, output->perf ? ",cycles,instructions,ipc,cache_misses,branch_misses,task_clock_us\n" : "\n");
+        output->wroteHeader = 1;
+    }
+
+    fprintf(file, "%i,", record->pid);
+    writeCSVString(file, record->command);
+    putc(',', file);
+
+    // The arguments share one field, separated by spaces
+    putc('"', file);
+    for (int i = 0; record->arguments != NULL && record->arguments[i] != NULL; i++) {
+        if (i > 0) {
+            putc(' ', file);
+        }
+        for (char* c = record->arguments[i]; *c != '\0'; c++) {
+            if (*c == '"') {
+                putc('"', file);
+            }
+            putc(*c, file);
+        }
+    }
+    putc('"', file);
+
+    fprintf(file, ",%i,%i", WIFEXITED(record->status) ? WEXITSTATUS(record->status) : -1, WIFSIGNALED(record->status) ? WTERMSIG(record->status) : 0);
+    fprintf(file, ",%lli,%li,%li", computeTimeDifference(record->startTime, record->endTime) / 1000, timevalToMicroseconds(stats->ru_utime), timevalToMicroseconds(stats->ru_stime));
+    fprintf(file, ",%li,%li,%li,%li,%li", stats->ru_nvcsw, stats->ru_nivcsw, stats->ru_minflt, stats->ru_majflt, stats->ru_maxrss);
+    fprintf(file, ",%i,%lli,%s,%lli", record->timedOut ? 1 : 0, record->queueWait / 1000, cacheResults[record->cache], record->savedTime / 1000);
+    // A CPU list like "0-3,8" has commas in it, so it is quoted
+    putc(',', file);
+    if (record->cpus != NULL) {
+        writeCSVString(file, record->cpus);
+    }
+    putc(',', file);
+    if (record->cpus != NULL && record->node >= 0) {
+        fprintf(file, "%i", record->node);
+    }
+
+    // Keep the columns lined up with the header even if this record has no counters
+    if (output->perf) {
+        struct perfCounts empty = {{-1, -1, -1, -1, -1}};
+        struct perfCounts *counts = (record->perf != NULL) ? record->perf : &empty;
+        double instructionsPerCycle = computeInstructionsPerCycle(counts);
+        writeCount(file, ",", counts->values[PERF_CYCLES], "");
+        writeCount(file, ",", counts->values[PERF_INSTRUCTIONS], "");
+        if (instructionsPerCycle < 0) {
+            fprintf(file, ",");
+        } else {
+            fprintf(file, ",%.3f", instructionsPerCycle);
+        }
+        writeCount(file, ",", counts->values[PERF_CACHE_MISSES], "");
+        writeCount(file, ",", counts->values[PERF_BRANCH_MISSES], "");
+        writeCount(file, ",", counts->values[PERF_TASK_CLOCK] < 0 ? -1 : counts->values[PERF_TASK_CLOCK] / 1000, "");
+    }
+    putc('\n', file);
+}
+
+// Print the statistics about the child process with the given exit status and rusage data
+void printChildStatistics(struct statsOutput *output, struct commandRecord *record) {
+    FILE* file = output->file;
+    struct rusage *childStats = &record->stats;
+    double difference = computeTimeDifference(record->startTime, record->endTime) / 1000000.0;
+
+    if (output->banner) {
+        fprintf(file, "\n***********************************************************************\n");
+    }
+    if (record->timedOut) {
+        fprintf(file, "Timed out!\n");
+    }
+    if (WIFSIGNALED(record->status)) {
+        fprintf(file, "Terminated by signal: %i (%s)\n", WTERMSIG(record->status), strsignal(WTERMSIG(record->status)));
+    } else if (WEXITSTATUS(record->status) != 0) {
+        fprintf(file, "Exit status: %i\n", WEXITSTATUS(record->status));
+    }
+    if (record->queueWait > 0) {
+        fprintf(file, "Queue wait time: %.3f milliseconds\n", record->queueWait / 1000000.0);
+    }
+    if (record->cache == CACHE_HIT) {
+        fprintf(file, "Result cache hit, saving %.3f milliseconds\n", record->savedTime / 1000000.0);
+    } else if (record->cache == CACHE_MISS) {
+        fprintf(file, "Result cache miss\n");
+    }
+    fprintf(file, "Wall-Clock time: %.3f milliseconds\n", difference);
+    fprintf(file, "User CPU time: %.3f milliseconds\n", timevalToMilliseconds(childStats->ru_utime));
+    fprintf(file, "System CPU time: %.3f milliseconds\n", timevalToMilliseconds(childStats->ru_stime));
+    fprintf(file, "Voluntary context switches: %li\n", childStats->ru_nvcsw);
+    fprintf(file, "Involuntary context switches: %li\n", childStats->ru_nivcsw);
+    if (record->cpus != NULL && record->node >= 0) {
+        fprintf(file, "Placement: CPUs %s on node %i\n", record->cpus, record->node);
+    } else if (record->cpus != NULL) {
+        fprintf(file, "Placement: CPUs %s\n", record->cpus);
+    }
+    fprintf(file, "Page faults: %li\n", childStats->ru_majflt);
+    fprintf(file, "Page faults that could be satisfied with unreclaimed pages: %li\n", childStats->ru_minflt);
+    fprintf(file, "Maximum resident set size: %li kilobytes\n", childStats->ru_maxrss);
+    if (record->perf != NULL) {
+        printPerfStatistics(file, record->perf);
+    }
+    if (output->banner) {
+        fprintf(file, "***********************************************************************\n\n");
+    }
+}
+
+// Print the perf counters next to the rusage statistics
+void printPerfStatistics(FILE* file, struct perfCounts *counts) {
+    char* names[PERF_COUNTER_COUNT] = {"CPU cycles", "Instructions", "Cache misses", "Branch misses", "Task clock"};
+
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        if (counts->values[i] < 0) {
+            fprintf(file, "%s: not available\n", names[i]);
+        } else if (i == PERF_TASK_CLOCK) {
+            fprintf(file, "%s: %.3f milliseconds\n", names[i], counts->values[i] / 1000000.0);
+        } else {
+            fprintf(file, "%s: %lli\n", names[i], counts->values[i]);
+        }
+
+        // Show the derived IPC right after the instruction count
+        if (i == PERF_INSTRUCTIONS && computeInstructionsPerCycle(counts) >= 0) {
+            fprintf(file, "Instructions per cycle: %.3f\n", computeInstructionsPerCycle(counts));
+        }
+    }
+}
+
+// Compute the difference between the two specified times in nanoseconds
+long long computeTimeDifference(struct timespec beforeTime, struct timespec afterTime) {
+    // Borrow from the seconds through the signed nanosecond difference
+    return (long long) (afterTime.tv_sec - beforeTime.tv_sec) * 1000000000LL + (afterTime.tv_nsec - beforeTime.tv_nsec);
+}
+
+// Convert a timeval from the rusage data into milliseconds
+double timevalToMilliseconds(struct timeval time) {
+    return (time.tv_sec * 1000.0) + (time.tv_usec / 1000.0);
+}
+
+// Convert a timeval from the rusage data into microseconds
+long timevalToMicroseconds(struct timeval time) {
+    return (time.tv_sec * 1000000L) + time.tv_usec;
+}
+
+// Make a deep copy of a NULL terminated argument list
+char** duplicateArguments(char** arguments) {
+    int count = 0;
+    while (arguments[count] != NULL) {
+        count++;
+    }
+
+    char** copy = malloc((count + 1) * sizeof(char*));
+    for (int i = 0; i < count; i++) {
+        copy[i] = strdup(arguments[i]);
+    }
+    copy[count] = NULL;
+
+    return copy;
+}
+
+// Free an argument list made by duplicateArguments
+void freeArguments(char** arguments) {
+    if (arguments == NULL) {
+        return;
+    }
+    for (int i = 0; arguments[i] != NULL; i++) {
+        free(arguments[i]);
+    }
+    free(arguments);
+}
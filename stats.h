@@ -0,0 +1,68 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "perf.h"
+
+// Formats that command statistics can be written in
+#define STATS_HUMAN 0
+#define STATS_JSON 1
+#define STATS_CSV 2
+
+// Whether a command's result came from the result cache
+#define CACHE_UNUSED 0
+#define CACHE_MISS 1
+#define CACHE_HIT 2
+
+// Size of the buffer records are collected in before being written out
+#define STATS_BUFFER_SIZE 65536
+
+// Everything known about a command once it has finished
+struct commandRecord {
+    int pid;
+    char* command;
+    char** arguments;
+    int status;
+    struct rusage stats;
+    struct timespec startTime;
+    struct timespec endTime;
+    // Hardware counters, or NULL if they weren't collected
+    struct perfCounts *perf;
+    // Set when the command was signalled because it ran past its timeout
+    int timedOut;
+    // Nanoseconds the command spent queued before it was started, kept out of the wall-clock time
+    long long queueWait;
+    // Whether the result cache was used, and on a hit, the nanoseconds the command took when it really ran
+    int cache;
+    long long savedTime;
+    // The CPUs the command was pinned to, like "0-3", or NULL if it wasn't placed, and its NUMA node or -1
+    char* cpus;
+    int node;
+};
+
+// Where and how command statistics get written
+struct statsOutput {
+    int format;
+    FILE* file;
+    int banner;
+    int wroteHeader;
+    // Whether CSV output should include the perf counter columns
+    int perf;
+};
+
+int openStatsOutput(struct statsOutput *output, char* format, char* fileName, int fd, int banner);
+void flushStatsOutput(struct statsOutput *output);
+void writeStatsRecord(struct statsOutput *output, struct commandRecord *record);
+void printChildStatistics(struct statsOutput *output, struct commandRecord *record);
+void writeJSONString(FILE* file, char* string);
+long long computeTimeDifference(struct timespec beforeTime, struct timespec afterTime);
+double timevalToMilliseconds(struct timeval time);
+long timevalToMicroseconds(struct timeval time);
+char** duplicateArguments(char** arguments);
+void freeArguments(char** arguments);
+
+#endif
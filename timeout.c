@@ -0,0 +1,281 @@
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+
+#include "timeout.h"
+
+#define TRUE 1
+#define FALSE 0
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+void addNanoseconds(struct timespec *time, long long nanoseconds);
+int isBefore(struct timespec first, struct timespec second);
+
+// Set up a deadline, a timeout of 0 means the command can run forever
+void initDeadline(struct deadline *deadline, long long timeout, long long killAfter) {
+    memset(deadline, 0, sizeof(struct deadline));
+    deadline->timeout = timeout;
+    deadline->killAfter = killAfter;
+}
+
+// Start counting down from when the command was launched
+void startDeadline(struct deadline *deadline, struct timespec startTime) {
+    if (deadline->timeout > 0) {
+        deadline->expires = startTime;
+        addNanoseconds(&deadline->expires, deadline->timeout);
+        deadline->armed = TRUE;
+    }
+}
+
+// Move a time forward by the given number of nanoseconds
+void addNanoseconds(struct timespec *time, long long nanoseconds) {
+    time->tv_sec += nanoseconds / 1000000000;
+    time->tv_nsec += nanoseconds % 1000000000;
+    if (time->tv_nsec >= 1000000000) {
+        time->tv_sec++;
+        time->tv_nsec -= 1000000000;
+    }
+}
+
+// Whether the first time comes before the second
+int isBefore(struct timespec first, struct timespec second) {
+    return first.tv_sec < second.tv_sec || (first.tv_sec == second.tv_sec && first.tv_nsec < second.tv_nsec);
+}
+
+// Work out which signal is due, moving the deadline on to the kill-after time once SIGTERM is sent
+// Returns the signal to send, or 0 if the deadline hasn't passed
+int nextDeadlineSignal(struct deadline *deadline, struct timespec now) {
+    if (!deadline->armed || isBefore(now, deadline->expires)) {
+        return 0;
+    }
+
+    if (deadline->signalsSent == 0) {
+        deadline->timedOut = TRUE;
+        deadline->signalsSent = 1;
+        if (deadline->killAfter > 0) {
+            deadline->expires = now;
+            addNanoseconds(&deadline->expires, deadline->killAfter);
+        } else {
+            deadline->armed = FALSE;
+        }
+        return SIGTERM;
+    }
+
+    deadline->signalsSent = 2;
+    deadline->armed = FALSE;
+    return SIGKILL;
+}
+
+// Keep track of the earliest of several deadlines, for arming a single timer
+void keepEarliestDeadline(struct deadline *deadline, struct timespec *earliest, int* found) {
+    if (deadline->armed && (!*found || isBefore(deadline->expires, *earliest))) {
+        *earliest = deadline->expires;
+        *found = TRUE;
+    }
+}
+
+// Create a timer on the monotonic clock that becomes readable when it fires
+int openDeadlineTimer() {
+    return timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+}
+
+// Arm the timer for an absolute time, or disarm it if there is no deadline
+void setDeadlineTimer(int timerFd, struct timespec *expires) {
+    struct itimerspec setting;
+    memset(&setting, 0, sizeof(setting));
+    if (expires != NULL) {
+        setting.it_value = *expires;
+    }
+    timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &setting, NULL);
+}
+
+// Get a descriptor that becomes readable when the process exits
+int openPidFd(pid_t pid) {
+    return syscall(SYS_pidfd_open, pid, 0);
+}
+
+// Get a signalfd that becomes readable when any child changes state, for kernels without pidfds
+// SIGCHLD stays blocked from then on so none are missed, which children don't inherit since every launch clears the mask
+// The descriptor is shared by every caller and kept open, and -1 is returned if it can't be made
+int openChildSignalFd() {
+    static int childSignalFd = -1;
+    sigset_t mask;
+
+    if (childSignalFd == -1) {
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        if (sigprocmask(SIG_BLOCK, &mask, NULL) == 0) {
+            childSignalFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        }
+    }
+    return childSignalFd;
+}
+
+// Throw away the queued SIGCHLD notifications, the caller checks its children itself
+void drainChildSignals(int signalFd) {
+    struct signalfd_siginfo info[16];
+    while (read(signalFd, info, sizeof(info)) > 0) {
+    }
+}
+
+// Check whether a child has exited without reaping it, so the caller can still collect its status and rusage
+int hasExited(pid_t pid) {
+    siginfo_t info;
+    info.si_pid = 0;
+    return waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == pid;
+}
+
+// Sleep until SIGCHLD arrives or the given deadline passes, for when the descriptors can't be polled
+void waitForChildSignal(struct timespec *expires) {
+    sigset_t mask;
+    struct timespec now, timeout = {0, 0};
+
+    // The signal has to be blocked to be waited for, which the shared signalfd already does
+    openChildSignalFd();
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (expires != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (isBefore(now, *expires)) {
+            long long remaining = (expires->tv_sec - now.tv_sec) * 1000000000LL + expires->tv_nsec - now.tv_nsec;
+            addNanoseconds(&timeout, remaining);
+        }
+    }
+    sigtimedwait(&mask, NULL, expires != NULL ? &timeout : NULL);
+}
+
+// Wait for the process like wait4, signalling it as its deadline passes
+// Sleeps in poll on a pidfd, or the SIGCHLD signalfd without one, and a timerfd, so there is no polling and no extra process
+int waitWithDeadline(pid_t pid, struct deadline *deadline, int* status, struct rusage *stats) {
+    int exitFd = -1, timerFd = -1, childSignals = FALSE, result;
+
+    if (deadline->armed) {
+        exitFd = openPidFd(pid);
+        if (exitFd == -1) {
+            exitFd = openChildSignalFd();
+            childSignals = TRUE;
+        }
+        timerFd = openDeadlineTimer();
+        if (exitFd == -1 || timerFd == -1) {
+            printf("Unable to enforce the timeout!\nError Number: %i\nError Message: %s\n", errno, strerror(errno));
+        }
+    }
+
+    while (exitFd != -1 && timerFd != -1) {
+        struct pollfd fds[2] = {{exitFd, POLLIN, 0}, {timerFd, POLLIN, 0}};
+
+        // The child may have exited before SIGCHLD was blocked, so look before sleeping
+        if (childSignals && hasExited(pid)) {
+            break;
+        }
+        setDeadlineTimer(timerFd, deadline->armed ? &deadline->expires : NULL);
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if ((fds[0].revents & POLLIN) && childSignals) {
+            drainChildSignals(exitFd);
+        } else if (fds[0].revents & POLLIN) {
+            break;
+        }
+        if (!(fds[1].revents & POLLIN)) {
+            continue;
+        }
+
+        struct timespec now;
+        unsigned long long expirations;
+        read(timerFd, &expirations, sizeof(expirations));
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        // A stopped command has to be continued to act on SIGTERM
+        int signalNumber = nextDeadlineSignal(deadline, now);
+        if (signalNumber != 0) {
+            kill(pid, signalNumber);
+            if (signalNumber == SIGTERM) {
+                kill(pid, SIGCONT);
+            }
+        }
+    }
+
+    if (exitFd != -1 && !childSignals) {
+        close(exitFd);
+    }
+    if (timerFd != -1) {
+        close(timerFd);
+    }
+
+    while ((result = wait4(pid, status, 0, stats)) == -1 && errno == EINTR) {
+    }
+    return result;
+}
+
+// Parse a duration like timeout(1) does: a number with an optional s, m, h or d suffix, or ms
+// Returns -1 if it isn't a valid duration or is too long to count in nanoseconds
+int parseDuration(char* text, long long *duration) {
+    char* end;
+    double value = strtod(text, &end);
+    double scale = 1e9;
+
+    if (end == text || value < 0) {
+        return -1;
+    }
+    if (strcmp(end, "ms") == 0) {
+        scale = 1e6;
+    } else if (strcmp(end, "m") == 0) {
+        scale = 60e9;
+    } else if (strcmp(end, "h") == 0) {
+        scale = 3600e9;
+    } else if (strcmp(end, "d") == 0) {
+        scale = 86400e9;
+    } else if (strcmp(end, "") != 0 && strcmp(end, "s") != 0) {
+        return -1;
+    }
+
+    // Infinite, NaN and overflowing durations can't be converted, and LLONG_MAX rounds up to 2^63 as a double
+    if (!isfinite(value) || value * scale >= (double) LLONG_MAX) {
+        return -1;
+    }
+    *duration = (long long) (value * scale);
+    return 0;
+}
+
+// Handle a "timeout [-k duration] duration command..." prefix on a command line
+// Returns the number of arguments to skip to get to the command, or -1 after printing the usage
+int parseTimeoutPrefix(char** arguments, struct deadline *deadline) {
+    long long timeout = 0, killAfter = 0;
+    int i = 1;
+
+    initDeadline(deadline, 0, 0);
+    if (arguments[0] == NULL || strcmp(arguments[0], "timeout") != 0) {
+        return 0;
+    }
+
+    int valid = TRUE;
+    if (arguments[i] != NULL && strcmp(arguments[i], "-k") == 0) {
+        valid = (arguments[i + 1] != NULL && parseDuration(arguments[i + 1], &killAfter) == 0);
+        i += 2;
+    }
+    if (!valid || arguments[i] == NULL || parseDuration(arguments[i], &timeout) == -1 || arguments[i + 1] == NULL) {
+        printf("Usage: timeout [-k duration] duration command [arguments...]\n");
+        return -1;
+    }
+
+    initDeadline(deadline, timeout, killAfter);
+    return i + 1;
+}
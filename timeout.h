@@ -0,0 +1,34 @@
+#ifndef TIMEOUT_H
+#define TIMEOUT_H
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <time.h>
+
+// A command's deadline, like timeout(1): SIGTERM once it passes, then SIGKILL killAfter later
+struct deadline {
+    // Nanoseconds, 0 for no timeout or for never sending SIGKILL
+    long long timeout;
+    long long killAfter;
+    int armed;
+    struct timespec expires;
+    int signalsSent;
+    int timedOut;
+};
+
+void initDeadline(struct deadline *deadline, long long timeout, long long killAfter);
+void startDeadline(struct deadline *deadline, struct timespec startTime);
+int nextDeadlineSignal(struct deadline *deadline, struct timespec now);
+void keepEarliestDeadline(struct deadline *deadline, struct timespec *earliest, int* found);
+int openDeadlineTimer();
+void setDeadlineTimer(int timerFd, struct timespec *expires);
+int openPidFd(pid_t pid);
+int openChildSignalFd();
+void drainChildSignals(int signalFd);
+int hasExited(pid_t pid);
+void waitForChildSignal(struct timespec *expires);
+int waitWithDeadline(pid_t pid, struct deadline *deadline, int* status, struct rusage *stats);
+int parseDuration(char* text, long long *duration);
+int parseTimeoutPrefix(char** arguments, struct deadline *deadline);
+
+#endif